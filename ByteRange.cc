@@ -3,10 +3,19 @@
 #include "time_util.h"
 #include "common.h"
 
+/*
+  Find which transmission of the range was received first, and set recv_type.
+  The result is kept until the range is sent or received again, so calling
+  it again from a later pass is O(1).
+ */
 bool ByteRange::matchReceivedType(RangeManager *rm, bool print) {
+	if (recv_matched && !print)
+		return recv_type != DEF;
+	recv_matched = 1;
+
 	if (print) {
-		printf("Range(%s): recv timestamp: %u ", seq_pair_str(rm->get_print_seq(startSeq), rm->get_print_seq(endSeq)).c_str(), received_tstamp_tcp);
-		printf("tstamps: %lu, rdb-stamps: %lu", tstamps_tcp.size(), rdb_tstamps_tcp.size());
+		printf("Range(%s): recv timestamp: %u ", seq_pair_str(rm->get_print_seq(startSeq), rm->get_print_seq(endSeq)).c_str(), recv->received_tstamp_tcp);
+		printf("tstamps: %lu, rdb-stamps: %lu", tstamps_tcp.size(), recv->rdb_tstamps_tcp.size());
 	}
 	// Find which data packet was received first
 
@@ -14,7 +23,7 @@ bool ByteRange::matchReceivedType(RangeManager *rm, bool print) {
 		if (print) {
 			printf("     timestamp: %u\n", tstamps_tcp[i].first);
  		}
-		if (tstamps_tcp[i].first == received_tstamp_tcp) {
+		if (tstamps_tcp[i].first == recv->received_tstamp_tcp) {
 			send_tcp_stamp_recv_index = (uint8_t)i; // Store the index of the send packet that matches the first received packet
 			// Retrans
 			if (i > 0) {
@@ -29,12 +38,12 @@ bool ByteRange::matchReceivedType(RangeManager *rm, bool print) {
 			}
 		}
 	}
-	for (ulong i = 0; i < rdb_tstamps_tcp.size(); i++) {
+	for (ulong i = 0; i < recv->rdb_tstamps_tcp.size(); i++) {
 		if (print) {
-			printf(" rdb_timestamp: %u\n", rdb_tstamps_tcp[i]);
+			printf(" rdb_timestamp: %u\n", recv->rdb_tstamps_tcp[i]);
 		}
 
-		if (rdb_tstamps_tcp[i] == received_tstamp_tcp) {
+		if (recv->rdb_tstamps_tcp[i] == recv->received_tstamp_tcp) {
 			recv_type = RDB;
 			recv_type_num = static_cast<uint8_t>(i + 1);
 			return true;
@@ -47,8 +56,8 @@ bool ByteRange::matchReceivedType(RangeManager *rm, bool print) {
 }
 
 void ByteRange::printTstampsTcp(ulong limit) {
-	printf("recv timestamp: %u, ", received_tstamp_tcp);
-	printf("tstamps_tcp count: %lu, rdb-stamps count: %lu\n", tstamps_tcp.size(), rdb_tstamps_tcp.size());
+	printf("recv timestamp: %u, ", recv->received_tstamp_tcp);
+	printf("tstamps_tcp count: %lu, rdb-stamps count: %lu\n", tstamps_tcp.size(), recv->rdb_tstamps_tcp.size());
 
 	ulong size = tstamps_tcp.size();
 	if (limit > 0)
@@ -56,47 +65,38 @@ void ByteRange::printTstampsTcp(ulong limit) {
 	for (ulong i = 0; i < size; i++) {
 		printf("     timestamp: %u\n", tstamps_tcp[i].first);
 	}
-	size = rdb_tstamps_tcp.size();
+	size = recv->rdb_tstamps_tcp.size();
 	if (limit > 0)
 		size = std::min(size, limit);
-	for (ulong i = 0; i < rdb_tstamps_tcp.size(); i++) {
-		printf(" rdb_timestamp: %u\n", rdb_tstamps_tcp[i]);
+	for (ulong i = 0; i < recv->rdb_tstamps_tcp.size(); i++) {
+		printf(" rdb_timestamp: %u\n", recv->rdb_tstamps_tcp[i]);
 	}
 	printf("\n");
 }
 
 void ByteRange::printTstampsPcap() {
-	long acktime_3 = get_usecs(&ackTime);
+	long acktime_3 = (long) TS_TO_US(ackTime);
 	printf("acked timestamp: %ld ", acktime_3);
 
-	timeval tmp;
-	long ms = 0;
 	for (ulong i = 0; i < sent_tstamp_pcap.size(); i++) {
-		timersub(&ackTime, &sent_tstamp_pcap[i].first, &tmp);
-		ms = (tmp.tv_sec * 1000) + (tmp.tv_usec / 1000);
-
-		long ts = 0;
-		if (sent_tstamp_pcap[i].first.tv_sec > 0) {
-			ts += sent_tstamp_pcap[i].first.tv_sec * 1000000;
-		}
-		ts += (sent_tstamp_pcap[i].first.tv_usec);
+		long ms = (long) TS_TO_MS(ackTime - sent_tstamp_pcap[i].first);
+		long ts = (long) TS_TO_US(sent_tstamp_pcap[i].first);
 		printf("     timestamp: %lu, diff: %lu\n", ts, ms);
 	}
 }
 
-bool ByteRange::addSegmentEnteredKernelTime(seq64_t seq, timeval &tv) {
+bool ByteRange::addSegmentEnteredKernelTime(seq64_t seq, tstamp_t ts) {
 
 	if (sent_data_pkt_pcap_index == -1) {
 		//printf("sent_data_pkt_pcap_index: %hu, acked_sent: %u\n", sent_data_pkt_pcap_index, acked_sent);
 		return false;
 	}
-	long sent = get_usecs(&(sent_tstamp_pcap[(size_t) sent_data_pkt_pcap_index].first));
-	long soj = get_usecs(&tv);
-	if (soj > sent) {
+	tstamp_t sent = sent_tstamp_pcap[(size_t) sent_data_pkt_pcap_index].first;
+	if (ts > sent) {
 		char buf1[30];
 		char buf2[30];
-		sprint_time_us_prec(buf1, sent_tstamp_pcap[(size_t) sent_data_pkt_pcap_index].first);
-		sprint_time_us_prec(buf2, tv);
+		sprint_time_us_prec(buf1, tstamp_to_timeval(sent));
+		sprint_time_us_prec(buf2, tstamp_to_timeval(ts));
 		size_t print_packet_ranges_index = 0;
 		//fprintf(stderr, "ByteRange seq_with_print_range() type: %d\n", sent_tstamp_pcap[sent_data_pkt_pcap_index].second);
 		if (GlobOpts::print_packets_pairs.size() == 0 ||
@@ -109,53 +109,56 @@ bool ByteRange::addSegmentEnteredKernelTime(seq64_t seq, timeval &tv) {
 		return false;
 	}
 	sojourn_time = 1;
-	sojourn_tstamps.push_back(pair<seq64_t, timeval>(seq, tv));
+	getCold()->sojourn_tstamps.push_back(pair<seq64_t, tstamp_t>(seq, ts));
 	return true;
 }
 
+/* Get the difference between send time and the time all the range was SACKed
+   Return: Time difference in microseconds, 0 if the range was not SACKed
+ */
+long ByteRange::getSendSackTimeDiff() {
+	tstamp_t sack = getSackTime();
+	if (!sack || !getSendTime())
+		return 0;
+	return (long) TS_TO_US(sack - sent_tstamp_pcap[0].first);
+}
+
 /* Get the difference between send and ack time for this range
    Return: Time difference in microseconds
  */
 long ByteRange::getSendAckTimeDiff(RangeManager *rm) {
-	timeval tv_diff;
 	long usec = 0;
 
-	if (sent_tstamp_pcap.empty() || (sent_tstamp_pcap[0].first.tv_sec == 0 && sent_tstamp_pcap[0].first.tv_usec == 0)) {
+	if (!getSendTime()) {
 #ifdef DEBUG
 		cerr << "Range without a send time. Skipping: " << endl;
 #endif
 		return 0;
 	}
 
-	if (ackTime.tv_sec == 0 && ackTime.tv_usec == 0) {
+	if (!ackTime) {
 		// If equals, they're syn or acks
 		if (startSeq != endSeq) {
-			multimap<seq64_t, ByteRange*>::reverse_iterator it, it_end = rm->ranges.rend();
-			int count = 0;
-			// Goes through all the packets from the end
 			// If all the packets after this packet has no ack time, then we presume it's caused by the
 			// ack not being received before tcpdump was killed
-			for (it = rm->ranges.rbegin(); it != it_end; it++) {
-				if (!(it->second->ackTime.tv_sec == 0 && it->second->ackTime.tv_usec == 0))
-					break;
-				if (it->second->getStartSeq() == startSeq && it->second->getEndSeq() == endSeq) {
-					if (GlobOpts::debugLevel == 2 || GlobOpts::debugLevel == 5) {
-						fprintf(stderr, "Range with no ACK time. This packet is at the end of the stream (%dth last), so we presume" \
-								" this is caused by tcpdump being killed before the packets were acked.\n", count);
-					}
-					return 0;
+			if (rm->isInUnackedTail(this)) {
+				if (GlobOpts::debugLevel == 2 || GlobOpts::debugLevel == 5) {
+					RangeMap::reverse_iterator it = rm->ranges.rbegin();
+					int count = 0;
+					for (; it->second != this; it++)
+						count++;
+					fprintf(stderr, "Range with no ACK time. This packet is at the end of the stream (%dth last), so we presume" \
+							" this is caused by tcpdump being killed before the packets were acked.\n", count);
 				}
-				count++;
+				return 0;
 			}
-			colored_printf(RED, "Range(%llu, %llu) has no ACK time. This shouldn't really happen... Packet is %d before last packet\n", startSeq, endSeq, count);
+			colored_printf(RED, "Range(%llu, %llu) has no ACK time. This shouldn't really happen... Packet is %d before last packet\n",
+						   startSeq, endSeq, (int) rm->getUnackedTailCount());
 		}
 		return 0;
 	}
 
-	/* since ackTime will always be bigger than sent_tstamp_pcap,
-	   (directly comparable timers) timerSub can be used here */
-	timersub(&ackTime, &sent_tstamp_pcap[0].first, &tv_diff);
-	usec = get_usecs(&tv_diff);
+	usec = (long) TS_TO_US(ackTime - sent_tstamp_pcap[0].first);
 
 	if (usec < 0) { /* Should not be possible */
 		colored_fprintf(stderr, RED, "Found byte with negative latency (%d usec)\n", usec);
@@ -172,10 +175,8 @@ long ByteRange::getSendAckTimeDiff(RangeManager *rm) {
 			cerr << "Strange latency: " << usec << "usec." << endl;
 			//cerr << "Start seq: " << rm->relative_seq(startSeq) << " End seq: " << rm->relative_seq(endSeq) << endl;
 			cerr << "Size of range: " << endSeq - startSeq << endl;
-			cerr << "sent_tstamp_pcap.tv_sec: " << sent_tstamp_pcap[0].first.tv_sec << " - sent_tstamp_pcap.tv_usec: "
-				 << sent_tstamp_pcap[0].first.tv_usec << endl;
-			cerr << "ackTime.tv_sec : " << ackTime.tv_sec << "  - ackTime.tv_usec : "
-				 << ackTime.tv_usec << endl;
+			cerr << "sent_tstamp_pcap: " << sent_tstamp_pcap[0].first << " ns" << endl;
+			cerr << "ackTime         : " << ackTime << " ns" << endl;
 			cerr << "Number of retransmissions: " << packet_retrans_count << endl;
 			cerr << "Number of bundles: " << rdb_count << endl;
 		}
@@ -185,11 +186,10 @@ long ByteRange::getSendAckTimeDiff(RangeManager *rm) {
 }
 
 vector< pair<int, int> > ByteRange::getSojournTimes() {
-	timeval tv_diff;
 	vector< pair<int, int> > sojourn_times;
 	long usec = 0;
 
-	if (sent_tstamp_pcap.empty() || (sent_tstamp_pcap[0].first.tv_sec == 0 && sent_tstamp_pcap[0].first.tv_usec == 0)) {
+	if (!getSendTime()) {
 #ifdef DEBUG
 		cerr << "Range without a send time. Skipping: " << endl;
 #endif
@@ -206,25 +206,24 @@ vector< pair<int, int> > ByteRange::getSojournTimes() {
 	ulong send_tstamp_index = 0;
 	for (ulong i = 0; i < sent_tstamp_pcap.size(); i++) {
 		send_tstamp_index = i;
-		if (sent_tstamp_pcap[i].second == ST_PKT)
+		if (getSentType(i) == ST_PKT)
 			break;
 	}
 
-	if (sent_tstamp_pcap[send_tstamp_index].second != ST_PKT) {
-		printf("Using sent time for packet type: %d ??\n", sent_tstamp_pcap[send_tstamp_index].second);
+	if (getSentType(send_tstamp_index) != ST_PKT) {
+		printf("Using sent time for packet type: %d ??\n", getSentType(send_tstamp_index));
 	}
 
 	seq64_t tmpBeginSeq = startSeq;
-	for (ulong i = 0; i < sojourn_tstamps.size(); i++) {
-		timersub(&sent_tstamp_pcap[send_tstamp_index].first, &sojourn_tstamps[i].second, &tv_diff);
-		usec = get_usecs(&tv_diff);
+	for (ulong i = 0; i < cold->sojourn_tstamps.size(); i++) {
+		usec = (long) TS_TO_US(sent_tstamp_pcap[send_tstamp_index].first - cold->sojourn_tstamps[i].second);
 		if (usec < 0) { /* Should not be possible */
 			colored_fprintf(stderr, RED, "Found ByteRange with negative sojourn latency (%d usec).\n", usec);
 			cout << this->strInfo();
 			//assert(0);
 		}
-		sojourn_times.push_back(pair<int, int>(sojourn_tstamps[i].first - tmpBeginSeq, usec));
-		tmpBeginSeq = sojourn_tstamps[i].first;
+		sojourn_times.push_back(pair<int, int>(cold->sojourn_tstamps[i].first - tmpBeginSeq, usec));
+		tmpBeginSeq = cold->sojourn_tstamps[i].first;
 	}
 
 	if (GlobOpts::debugLevel == 2 || GlobOpts::debugLevel == 5) {
@@ -233,10 +232,8 @@ vector< pair<int, int> > ByteRange::getSojournTimes() {
 			cerr << "Strange latency: " << usec << "usec." << endl;
 			//cerr << "Start seq: " << rm->relative_seq(startSeq) << " End seq: " << rm->relative_seq(endSeq) << endl;
 			cerr << "Size of range: " << endSeq - startSeq << endl;
-			cerr << "sent_tstamp_pcap.tv_sec: " << sent_tstamp_pcap[0].first.tv_sec << " - sent_tstamp_pcap.tv_usec: "
-				 << sent_tstamp_pcap[0].first.tv_usec << endl;
-			cerr << "ackTime.tv_sec : " << ackTime.tv_sec << "  - ackTime.tv_usec : "
-				 << ackTime.tv_usec << endl;
+			cerr << "sent_tstamp_pcap: " << sent_tstamp_pcap[0].first << " ns" << endl;
+			cerr << "ackTime         : " << ackTime << " ns" << endl;
 			cerr << "Number of retransmissions: " << packet_retrans_count << endl;
 			cerr << "Number of bundles: " << rdb_count << endl;
 		}
@@ -244,21 +241,12 @@ vector< pair<int, int> > ByteRange::getSojournTimes() {
 	return sojourn_times;
 }
 
-void ByteRange::calculateRecvDiff(timeval *recv_tstamp) {
-	timeval tv;
-	long ms = 0;
-	if (recv_tstamp == NULL) {
-		recv_tstamp = &received_tstamp_pcap;
+void ByteRange::calculateRecvDiff(tstamp_t recv_tstamp) {
+	if (!recv_tstamp) {
+		recv_tstamp = recv->received_tstamp_pcap;
 	}
-	/* Use own macro in order to handle negative diffs */
-	negtimersub(recv_tstamp, &sent_tstamp_pcap[send_tcp_stamp_recv_index].first, &tv);
-
-	ms += tv.tv_sec * 1000;
-	if (ms >= 0)
-		ms += (tv.tv_usec / 1000);
-	else
-		ms -= (tv.tv_usec / 1000);
-	diff = ms;
+	/* The diff is negative when the receiver clock is behind */
+	recv->diff = (long) TS_TO_MS(recv_tstamp - sent_tstamp_pcap[send_tcp_stamp_recv_index].first);
 }
 
 string ByteRange::str() {
@@ -271,8 +259,8 @@ string ByteRange::strInfo() {
 	stringstream s;
 	s << "ByteRange(" << startSeq << ", " << endSeq << ")" << endl;
 	s << "size: " << byte_count << endl;
-	s << "sent_tstamp: " << sent_tstamp_pcap[0].first.tv_sec << "."  << sent_tstamp_pcap[0].first.tv_usec  << endl;
-	s << "ackTime:     " << ackTime.tv_sec << "." << ackTime.tv_usec  << endl;
+	s << "sent_tstamp: " << TS_TO_SEC(sent_tstamp_pcap[0].first) << "."  << TS_TO_US(sent_tstamp_pcap[0].first % NSEC_PER_SEC)  << endl;
+	s << "ackTime:     " << TS_TO_SEC(ackTime) << "." << TS_TO_US(ackTime % NSEC_PER_SEC)  << endl;
 
 	//if (sojourn_time)
 	//	s << "sojournTime: " << sojourn_tstamp.tv_sec << "." << sojourn_tstamp.tv_usec  << endl;
@@ -298,24 +286,3 @@ string ByteRange::strInfo() {
 */
 	return s.str();
 }
-
-timeval* ByteRange::getSendTime() {
-	if (sent_tstamp_pcap[0].first.tv_sec == 0 && sent_tstamp_pcap[0].first.tv_usec == 0)
-		return NULL;
-	else
-		return &sent_tstamp_pcap[0].first;
-}
-
-timeval* ByteRange::getAckTime() {
-	if (ackTime.tv_sec == 0 && ackTime.tv_usec == 0)
-		return NULL;
-	else
-		return &ackTime;
-}
-
-timeval* ByteRange::getRecvTime() {
-	if (received_tstamp_pcap.tv_sec == 0 && received_tstamp_pcap.tv_usec == 0)
-		return NULL;
-	else
-		return &received_tstamp_pcap;
-}
@@ -4,15 +4,68 @@
 #include "RangeManager.h"
 #include "common.h"
 #include "time_util.h"
+#include "SmallVector.h"
 
 using namespace std;
 
 # define END_SEQ(seq_end) (seq_end)
 
+/*
+  A transmission of a range, matched against the received packets to find
+  the ones that were lost. The received flag fits in the padding before
+  tstamp_pcap, so marking a transmission received needs no extra memory.
+ */
+struct SentTstamp {
+	uint32_t tstamp_tcp;
+	uint32_t received;
+	tstamp_t tstamp_pcap;
+};
+
+/*
+  The part of a range that is matched against the receiver dump. It is only
+  allocated, next to the range in the arena, when there is a receiver dump.
+ */
+struct ByteRangeRecv {
+	tstamp_t received_tstamp_pcap;
+	uint32_t received_tstamp_tcp;
+	uint32_t received_index;           // Capture order of the segment the receive times are from, with --recv-join
+	long diff;                         // Difference between the send and receive time
+	SmallVector< uint32_t, 1> rdb_tstamps_tcp;  // tcp tstamp for data in RDB packets
+	SmallVector<SentTstamp, 1> sent_tstamps_tcp; // tcp tstamp of each transmission, matched to received used to find which packets were lost
+
+	ByteRangeRecv() : received_tstamp_pcap(0), received_tstamp_tcp(0), received_index(0), diff(0) {}
+
+	/* Mark the first transmission with tstamp_tcp that is not received yet as received */
+	void setReceived(uint32_t tstamp_tcp) {
+		for (size_t i = 0; i < sent_tstamps_tcp.size(); i++) {
+			if (!sent_tstamps_tcp[i].received && sent_tstamps_tcp[i].tstamp_tcp == tstamp_tcp) {
+				SentTstamp st = sent_tstamps_tcp[i];
+				st.received = 1;
+				sent_tstamps_tcp.set(i, st);
+				break;
+			}
+		}
+	}
+};
+
+/* State that few ranges have, allocated the first time it is needed */
+struct ByteRangeCold {
+	tstamp_t sack_tstamp;                      // When all the range was first SACKed, 0 if it was not
+	SmallVector<SackBlocks, 0> tcp_sacks;      // SACK blocks of the ACKs registered on this range, with --packet-details
+	SmallVector< pair<seq64_t, tstamp_t>, 0> sojourn_tstamps; // endseq for segment, tstamp when entered kernel
+
+	ByteRangeCold() : sack_tstamp(0) {}
+};
+
+/*
+  The fields read by the passes over all the ranges come first, so they
+  share a cache line. The histories and the receiver and cold state follow.
+ */
 class ByteRange {
 public:
 	seq64_t startSeq;                  // The relative sequence number of the first byte in this range
 	seq64_t endSeq;                    // The relative sequence number of the last byte in this range
+	tstamp_t ackTime;
 	uint16_t byte_count;               // The number of bytes in this range
 	uint16_t original_payload_size;
 	uint8_t packet_sent_count;         // Count number of packet transmissions. This value is not copied when splitting a byte range!
@@ -24,35 +77,29 @@ public:
 	uint8_t rdb_count;                 // Count number of times this byte range has been transmitted as redundant (rdb) data
 	uint8_t rdb_miss_count;
 	uint8_t rdb_hit_count;
-
-	vector< pair<seq64_t, timeval> > sojourn_tstamps; // endseq for segment, tstamp when entered kernel
-	vector< pair<timeval, sent_type> > sent_tstamp_pcap; // pcap tstamp for when packet was sent, sent_type {ST_NONE, ST_PKT, ST_RTR, ST_PURE_ACK};
-	timeval received_tstamp_pcap;
-	uint8_t send_tcp_stamp_recv_index; // The index of the element in the tstamps_tcp vector that matches the received tcp time stamp
-	uint32_t received_tstamp_tcp;
-	vector< pair<uint32_t, uint32_t> > tstamps_tcp;
-	vector< uint32_t> rdb_tstamps_tcp;  // tcp tstamp for data in RDB packets
-	vector< vector< pair<seq64_t, seq64_t> > > tcp_sacks;  // tcp tstamp for data in RDB packets
-
-	vector< pair<uint32_t, timeval> > lost_tstamps_tcp; // tcp tstamp matched to received used to find which packets were lost
-
-	timeval ackTime;
 	uint8_t acked : 1,
 		original_packet_is_rdb : 1,
 		recv_type : 2,                 // DEF, DATA, RDB, RETR
 		sojourn_time : 1,              // If sojourn time can be calulcated
-		app_layer_latency_tstamp : 1;  // If application layer latency should use the receiver time stamp (1), or the tstamp of previous range (0).
+		app_layer_latency_tstamp : 1,  // If application layer latency should use the receiver time stamp (1), or the tstamp of previous range (0).
+		recv_matched : 1;              // If matchReceivedType() has set recv_type since the range was last sent or received
 	uint8_t recv_type_num;             // Which packet of the specific type was first received
-	int16_t sent_data_pkt_pcap_index;  // Index of the first transmission (ST_PKT) in the sent_tstamp_pcap vector
 	uint8_t fin;                       // Number of FINs sent
 	uint8_t syn;                       // Number of SYNs sent
 	uint8_t rst;                       // Number of RSTs sent
 	uint8_t acked_sent;                // Count acks sent for this sequence number
 	uint8_t ack_count;                 // Count number of times this packet was acked
 	uint8_t dupack_count;
+	uint8_t send_tcp_stamp_recv_index; // The index of the element in the tstamps_tcp vector that matches the received tcp time stamp
 	uint16_t tcp_window;
-private:
-	long diff;
+	int16_t sent_data_pkt_pcap_index;  // Index of the first transmission (ST_PKT) in the sent_tstamp_pcap vector
+	uint16_t sent_inherited;           // The first sent_tstamp_pcap entries, copied from the range this was split from, count as ST_NONE
+
+	// Most ranges are sent once, so the histories hold one transmission inline
+	SmallVector< pair<tstamp_t, sent_type>, 1> sent_tstamp_pcap; // pcap tstamp for when packet was sent, sent_type {ST_NONE, ST_PKT, ST_RTR, ST_PURE_ACK};
+	SmallVector< pair<uint32_t, uint32_t>, 1> tstamps_tcp;
+	ByteRangeRecv *recv;               // NULL without a receiver dump
+	ByteRangeCold *cold;               // NULL until needed, see getCold()
 
 public:
 	ByteRange(seq64_t start, seq64_t end) {
@@ -74,47 +121,51 @@ public:
 		rdb_count = 0;
 		recv_type = DEF;
 		recv_type_num = 1;
-		received_tstamp_tcp = 0;
+		recv = NULL;
+		cold = NULL;
 		rdb_miss_count = 0;
 		rdb_hit_count = 0;
-		diff = 0;
 		tcp_window = 0;
-		ackTime.tv_sec = 0;
-		ackTime.tv_usec = 0;
+		ackTime = 0;
 		fin = 0;
 		syn = 0;
 		rst = 0;
 		original_packet_is_rdb = 0;
 		acked_sent = 0;
 		app_layer_latency_tstamp = 0;
+		recv_matched = 0;
 		sojourn_time = 0;
 		sent_data_pkt_pcap_index = -1;
+		sent_inherited = 0;
 	}
 
-	inline void increase_received(uint32_t tstamp_tcp, timeval tstamp_pcap, bool in_sequence) {
+	~ByteRange() { delete cold; }
+	ByteRange(const ByteRange&) = delete;
+	ByteRange& operator=(const ByteRange&) = delete;
+
+	/*
+	  The receive times are those of the segment captured first. joinReceivedRanges()
+	  inserts the segments out of capture order, and passes the index of each.
+	 */
+	inline void increase_received(uint32_t tstamp_tcp, tstamp_t tstamp_pcap, bool in_sequence, uint32_t index = std::numeric_limits<uint32_t>::max()) {
 
-		if (!data_received_count) {
+		if (!data_received_count || index < recv->received_index) {
 			app_layer_latency_tstamp = in_sequence;
-			received_tstamp_tcp = tstamp_tcp;
-			received_tstamp_pcap = tstamp_pcap;
+			recv->received_tstamp_tcp = tstamp_tcp;
+			recv->received_tstamp_pcap = tstamp_pcap;
+			recv->received_index = index;
+			recv_matched = 0;
 		}
 		data_received_count++;
-
-		vector< pair<uint32_t, timeval> >::iterator it, it_end;
-		it = lost_tstamps_tcp.begin(), it_end = lost_tstamps_tcp.end();
-		while (it != it_end) {
-			if (it->first == tstamp_tcp) {
-				lost_tstamps_tcp.erase(it);
-				break;
-			}
-			it++;
-		}
+		recv->setReceived(tstamp_tcp);
 	}
 
-	inline void increase_sent(uint32_t tcp_tsval, uint32_t tcp_tsecr, timeval tstamp_pcap, bool rdb, sent_type sent_t=ST_PKT) {
+	inline void increase_sent(uint32_t tcp_tsval, uint32_t tcp_tsecr, tstamp_t tstamp_pcap, bool rdb, sent_type sent_t=ST_PKT) {
+		recv_matched = 0;
 
 		if (rdb) {
-			rdb_tstamps_tcp.push_back(tcp_tsval);
+			if (recv)
+				recv->rdb_tstamps_tcp.push_back(tcp_tsval);
 		}
 		else {
 			tstamps_tcp.push_back(pair<uint32_t, uint32_t>(tcp_tsval, tcp_tsecr));
@@ -134,8 +185,11 @@ public:
 		if (sent_t == ST_PKT)
 			sent_data_pkt_pcap_index = static_cast<int16_t>(sent_tstamp_pcap.size());
 
-		sent_tstamp_pcap.push_back(pair<timeval, sent_type>(tstamp_pcap, sent_t));
-		lost_tstamps_tcp.push_back(pair<uint32_t, timeval>(tcp_tsval, tstamp_pcap));
+		sent_tstamp_pcap.push_back(pair<tstamp_t, sent_type>(tstamp_pcap, sent_t));
+		if (recv) {
+			SentTstamp st = { tcp_tsval, 0, tstamp_pcap };
+			recv->sent_tstamps_tcp.push_back(st);
+		}
 	}
 
 	void updateByteCount() {
@@ -144,57 +198,89 @@ public:
 	}
 
 	// Split and make a new range at the end
-	ByteRange* splitEnd(seq64_t start, seq64_t end) {
+	ByteRange* splitEnd(seq64_t start, seq64_t end, ByteRangeArena &arena) {
 		endSeq = start;
-		return split(start, end);
+		return split(start, end, arena);
 	}
 
-	ByteRange* split(seq64_t start, seq64_t end) {
-		ByteRange *new_br = new ByteRange(start, end);
+	ByteRange* split(seq64_t start, seq64_t end, ByteRangeArena &arena) {
+		ByteRange *new_br = arena.create(start, end);
 		new_br->packet_sent_count = 0;
 		new_br->data_retrans_count = data_retrans_count;
 		new_br->data_sent_count = data_sent_count;
 		new_br->data_received_count = data_received_count;
-		new_br->received_tstamp_tcp = received_tstamp_tcp;
 		new_br->tstamps_tcp = tstamps_tcp;
-		new_br->rdb_tstamps_tcp = rdb_tstamps_tcp;
+		if (recv) {
+			new_br->app_layer_latency_tstamp = app_layer_latency_tstamp;
+			new_br->recv->received_tstamp_pcap = recv->received_tstamp_pcap;
+			new_br->recv->received_tstamp_tcp = recv->received_tstamp_tcp;
+			new_br->recv->received_index = recv->received_index;
+			new_br->recv->rdb_tstamps_tcp = recv->rdb_tstamps_tcp;
+		}
 		new_br->ackTime = ackTime;
 		new_br->acked = acked;
+		if (cold && cold->sack_tstamp)
+			new_br->getCold()->sack_tstamp = cold->sack_tstamp;
 		updateByteCount();
+		// The histories are shared with new_br until either range is sent again
 		new_br->sent_tstamp_pcap = sent_tstamp_pcap;
-		for (size_t i = 0; i < new_br->sent_tstamp_pcap.size(); i++)
-			new_br->sent_tstamp_pcap[i].second = ST_NONE;
+		new_br->sent_inherited = static_cast<uint16_t>(sent_tstamp_pcap.size());
 		return new_br;
 	}
 
-	void registerSACKS(DataSeg* data) { tcp_sacks.push_back(data->tcp_sacks); }
+	// Hand the state registered by ACKs on the end of this range over to br
+	void moveAckState(ByteRange *br) {
+		br->ack_count = ack_count;
+		br->dupack_count = dupack_count;
+		br->tcp_window = tcp_window;
+		if (cold && !cold->tcp_sacks.empty())
+			br->getCold()->tcp_sacks.swap(cold->tcp_sacks);
+		ack_count = 0;
+		dupack_count = 0;
+		tcp_window = 0;
+	}
+
+	void registerSACKS(DataSeg* data) { getCold()->tcp_sacks.push_back(data->tcp_sacks); }
+	ByteRangeCold* getCold() {
+		if (!cold)
+			cold = new ByteRangeCold();
+		return cold;
+	}
 	bool matchReceivedType(RangeManager *rm, bool print=false);
 	void printTstampsTcp(ulong limit);
 
 	seq64_t getStartSeq() { return startSeq; }
 	seq64_t getEndSeq() { return endSeq; }
 	long getSendAckTimeDiff(RangeManager *rm);
+	long getSendSackTimeDiff();
 	uint8_t getNumRetrans() { return packet_retrans_count; }
 	uint8_t getNumBundled() { return rdb_count; }
 	uint16_t getNumBytes() { return byte_count; }
 	uint16_t getDataSentCount() { return data_sent_count; }
 	uint16_t getDataReceivedCount() { return data_received_count; }
 	uint16_t getOrinalPayloadSize() { return original_payload_size; }
+	sent_type getSentType(size_t i) const { return i < sent_inherited ? ST_NONE : sent_tstamp_pcap[i].second; }
 	int getTotalBytesTransfered() { return byte_count + byte_count * data_retrans_count + byte_count * rdb_count; }
 	bool isAcked() { return acked; }
-	void insertAckTime(timeval *tv) { ackTime = *tv; acked = 1; }
-	void calculateRecvDiff(timeval *recv_tstamp = NULL);
-	long getRecvDiff() { return diff; }
-	void setRecvDiff(long _diff) { diff = _diff; }
+	void insertAckTime(tstamp_t ts) { ackTime = ts; acked = 1; }
+	void calculateRecvDiff(tstamp_t recv_tstamp = 0);
+	long getRecvDiff() { return recv->diff; }
+	void setRecvDiff(long _diff) { recv->diff = _diff; }
 	string strInfo();
 	string str();
 	void printTstampsPcap();
-	timeval* getSendTime();
-	timeval* getRecvTime();
-	timeval* getAckTime();
-	void setRecvTime(timeval *tv) { received_tstamp_pcap = *tv; }
+	// The times are 0 when not set
+	tstamp_t getSendTime() const { return sent_tstamp_pcap.empty() ? 0 : sent_tstamp_pcap[0].first; }
+	tstamp_t getRecvTime() const { return recv ? recv->received_tstamp_pcap : 0; }
+	tstamp_t getAckTime() const { return ackTime; }
+	tstamp_t getSackTime() const { return cold ? cold->sack_tstamp : 0; }
+	void insertSackTime(tstamp_t ts) { getCold()->sack_tstamp = ts; }
+	void setRecvTime(tstamp_t ts) { recv->received_tstamp_pcap = ts; }
 	vector< pair<int, int> > getSojournTimes();
-	bool addSegmentEnteredKernelTime(seq64_t seq, timeval &tv);
+	bool addSegmentEnteredKernelTime(seq64_t seq, tstamp_t ts);
 };
 
+static_assert(offsetof(ByteRange, sent_inherited) + sizeof(uint16_t) <= CACHE_LINE_SIZE,
+	"The fields read by the range passes must fit in the first cache line");
+
 #endif /* BYTERANGE_H */
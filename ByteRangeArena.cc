@@ -0,0 +1,92 @@
+#include <new>
+#include <stdlib.h>
+#include "ByteRangeArena.h"
+#include "ByteRange.h"
+
+/* Methods for class ByteRangeArena */
+ByteRangeArena::ByteRangeArena(range_profile p)
+	: used(0)
+	, count(0)
+	, profile(p)
+	, stride(sizeof(ByteRange))
+{
+	if (profile == RANGE_PROFILE_RECEIVER)
+		stride += sizeof(ByteRangeRecv);
+	// Every range starts a cache line, so its leading fields never straddle two
+	stride = (stride + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+ByteRangeArena::~ByteRangeArena() {
+	for (size_t i = 0; i < slabs.size(); i++) {
+		size_t n = (i + 1 == slabs.size()) ? used : slabSize(i);
+		for (size_t j = 0; j < n; j++) {
+			ByteRange *br = reinterpret_cast<ByteRange*>(slabs[i] + j * stride);
+			if (br->recv)
+				br->recv->~ByteRangeRecv();
+			br->~ByteRange();
+		}
+		free(slabs[i]);
+	}
+}
+
+/* The receiver side matching is only needed when a receiver dump is analysed */
+range_profile ByteRangeArena::defaultProfile() {
+	return GlobOpts::withRecv ? RANGE_PROFILE_RECEIVER : RANGE_PROFILE_SENDER;
+}
+
+ByteRange* ByteRangeArena::create(seq64_t start, seq64_t end) {
+	char *slot;
+	if (!free_slots.empty()) {
+		ByteRange *empty = free_slots.back();
+		free_slots.pop_back();
+		if (empty->recv)
+			empty->recv->~ByteRangeRecv();
+		empty->~ByteRange();
+		slot = reinterpret_cast<char*>(empty);
+	}
+	else {
+		if (slabs.empty() || used == slabSize(slabs.size() - 1)) {
+			void *slab;
+			if (posix_memalign(&slab, CACHE_LINE_SIZE, slabSize(slabs.size()) * stride))
+				throw std::bad_alloc();
+			slabs.push_back(static_cast<char*>(slab));
+			used = 0;
+		}
+		slot = slabs.back() + used++ * stride;
+	}
+	count++;
+	ByteRange *br = new (slot) ByteRange(start, end);
+	if (profile == RANGE_PROFILE_RECEIVER)
+		br->recv = new (slot + sizeof(ByteRange)) ByteRangeRecv();
+	return br;
+}
+
+/*
+  Frees the state of br, and keeps its slot for the next range created.
+  The slot holds an empty range until then, so the destructor may destroy
+  every slot.
+ */
+void ByteRangeArena::release(ByteRange *br) {
+	char *slot = reinterpret_cast<char*>(br);
+	if (br->recv)
+		br->recv->~ByteRangeRecv();
+	br->~ByteRange();
+	br = new (slot) ByteRange(0, 0);
+	if (profile == RANGE_PROFILE_RECEIVER)
+		br->recv = new (slot + sizeof(ByteRange)) ByteRangeRecv();
+	free_slots.push_back(br);
+	count--;
+}
+
+/* Ranges the slabs have room for */
+size_t ByteRangeArena::capacity() const {
+	size_t ranges = 0;
+	for (size_t i = 0; i < slabs.size(); i++)
+		ranges += slabSize(i);
+	return ranges;
+}
+
+/* Bytes allocated for the slabs */
+size_t ByteRangeArena::footprint() const {
+	return capacity() * stride + slabs.capacity() * sizeof(char*) + free_slots.capacity() * sizeof(ByteRange*);
+}
@@ -0,0 +1,55 @@
+#ifndef BYTERANGEARENA_H
+#define BYTERANGEARENA_H
+
+#include "common.h"
+
+class ByteRange;
+
+/* Ranges in the first slab of an arena, each new slab doubles up to BYTERANGE_SLAB_MAX */
+#define BYTERANGE_SLAB_MIN 16
+#define BYTERANGE_SLAB_MAX 4096
+
+/* Slabs and range slots are aligned to cache lines */
+#define CACHE_LINE_SIZE 64
+
+/* What is stored for each range, picked from the analyses that are run */
+enum range_profile {
+	RANGE_PROFILE_SENDER,       // Sender dump only
+	RANGE_PROFILE_RECEIVER      // With a receiver dump, a ByteRangeRecv follows each range
+};
+
+/*
+  Allocates the ByteRanges of a connection from slabs of memory.
+  The slabs are only freed together with the arena, when the connection
+  is destroyed. Ranges released before then leave their slot to the next
+  range created. The slabs start small, as most connections in a dump send
+  little data.
+ */
+class ByteRangeArena {
+private:
+	vector<char*> slabs;
+	vector<ByteRange*> free_slots;  // Released ranges, reset to empty ones
+	size_t used;                // Ranges created in the last slab
+	size_t count;
+	range_profile profile;
+	size_t stride;              // Bytes per range
+
+	static size_t slabSize(size_t slab) { return std::min((size_t) BYTERANGE_SLAB_MIN << std::min(slab, (size_t) 16), (size_t) BYTERANGE_SLAB_MAX); }
+
+public:
+	ByteRangeArena(range_profile p);
+	~ByteRangeArena();
+	ByteRangeArena(const ByteRangeArena&) = delete;
+	ByteRangeArena& operator=(const ByteRangeArena&) = delete;
+
+	static range_profile defaultProfile();
+
+	ByteRange* create(seq64_t start, seq64_t end);
+	void release(ByteRange *br);
+	size_t size() const { return count; }
+	size_t slabCount() const { return slabs.size(); }
+	size_t capacity() const;
+	size_t footprint() const;
+};
+
+#endif /* BYTERANGEARENA_H */
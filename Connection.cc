@@ -132,7 +132,7 @@ seq64_t Connection::getRelativeSequenceNumber(seq32_t seq, relative_seq_type typ
 
 uint32_t Connection::getDuration(bool analyse_range_duration) {
 	double d;
-	if (analyse_range_duration) {
+	if (analyse_range_duration && !rm->retired_count) {
 		d = getTimeInterval(rm->analyse_range_start->second, rm->analyse_range_last->second);
 	}
 	else {
@@ -284,16 +284,15 @@ bool Connection::registerSent(sendData* sd) {
 /* Process range for outgoing packet */
 void Connection::registerRange(sendData* sd) {
 	if (DEBUGL_SENDER(4)) {
-		if (firstSendTime.tv_sec == 0 && firstSendTime.tv_usec == 0) {
+		if (!firstSendTime) {
 			firstSendTime = sd->data.tstamp_pcap;
 		}
 
-		timeval offset;
-		timersub(&(sd->data.tstamp_pcap), &firstSendTime, &offset);
+		tstamp_t offset = sd->data.tstamp_pcap - firstSendTime;
 		cerr << "\nRegistering new outgoing. Seq: " << rm->get_print_seq(sd->data.seq) << " - "
 		     << rm->get_print_seq(END_SEQ(sd->data.endSeq)) << " Absolute seq: " << sd->data.seq << " - "
 			 << END_SEQ(sd->data.endSeq) << " Payload: " << sd->data.payloadSize << endl;
-		cerr << "Time offset: Secs: " << offset.tv_sec << "." << offset.tv_usec << endl;
+		cerr << "Time offset: Secs: " << TS_TO_SEC(offset) << "." << TS_TO_US(offset % NSEC_PER_SEC) << endl;
 	}
 
 	rm->insertSentRange(sd);
@@ -307,15 +306,16 @@ void Connection::registerRange(sendData* sd) {
 
 /* Register times for first ACK of each byte */
 bool Connection::registerAck(DataSeg *seg) {
-	static bool ret;
+	bool ret;
 	if (DEBUGL_SENDER(4)) {
-		timeval offset;
-		timersub(&seg->tstamp_pcap, &firstSendTime, &offset);
+		tstamp_t offset = seg->tstamp_pcap - firstSendTime;
 		cerr << endl << "Registering new ACK. Conn: " << getConnKey() << " Ack: " << rm->get_print_seq(seg->ack) << endl;
-		cerr << "Time offset: Secs: " << offset.tv_sec << " uSecs: " << offset.tv_usec << endl;
+		cerr << "Time offset: Secs: " << TS_TO_SEC(offset) << " uSecs: " << TS_TO_US(offset % NSEC_PER_SEC) << endl;
 	}
 
 	ret = rm->processAck(seg);
+	if (GlobOpts::stream_horizon_ms)
+		rm->retireRanges(seg->tstamp_pcap);
 	if (ret) {
 		lastLargestAckSeq = seg->endSeq;
 		lastLargestAckSeqAbsolute = seg->seq_absolute + seg->payloadSize;
@@ -339,27 +339,25 @@ void Connection::calculateRetransAndRDBStats() {
 // Set which ranges to analyse
 void Connection::setAnalyseRangeInterval() {
 	ulong start_index = 0;
-	rm->analyse_range_start = rm->ranges.begin();
+	rm->analyse_range_start = rm->retired_count ? rm->retired_end : rm->ranges.begin();
 	rm->analyse_range_end = rm->ranges.end();
 	rm->analyse_range_last = rm->analyse_range_end;
 	rm->analyse_range_last--;
 	rm->analyse_time_sec_start = GlobOpts::analyse_start;
 
-	timeval tv;
-	timersub(&(rm->ranges.rbegin()->second->sent_tstamp_pcap[0].first),
-			 &rm->analyse_range_start->second->sent_tstamp_pcap[0].first, &tv);
-	rm->analyse_time_sec_end = tv.tv_sec;
+	tstamp_t elapsed = rm->ranges.rbegin()->second->sent_tstamp_pcap[0].first - rm->getFirstSendTime();
+	rm->analyse_time_sec_end = TS_TO_SEC(elapsed);
 
 	if (GlobOpts::analyse_start) {
-		map<seq64_t, ByteRange*>::iterator it, it_end;
+		RangeMap::iterator it, it_end;
 		it = rm->ranges.begin();
-		timeval first_pcap_tstamp = it->second->sent_tstamp_pcap[0].first;
+		tstamp_t first_pcap_tstamp = it->second->sent_tstamp_pcap[0].first;
 		it_end = rm->ranges.end();
 		for (; it != it_end; it++) {
-			timersub(&(it->second->sent_tstamp_pcap[0].first), &first_pcap_tstamp, &tv);
-			if (tv.tv_sec >= GlobOpts::analyse_start) {
+			elapsed = it->second->sent_tstamp_pcap[0].first - first_pcap_tstamp;
+			if (TS_TO_SEC(elapsed) >= GlobOpts::analyse_start) {
 				rm->analyse_range_start = it;
-				rm->analyse_time_sec_start = tv.tv_sec;
+				rm->analyse_time_sec_start = TS_TO_SEC(elapsed);
 				break;
 			}
 			start_index++;
@@ -367,26 +365,25 @@ void Connection::setAnalyseRangeInterval() {
 	}
 
 	if (GlobOpts::analyse_end) {
-		multimap<seq64_t, ByteRange*>::reverse_iterator rit, rit_end = rm->ranges.rend();
+		RangeMap::reverse_iterator rit, rit_end = rm->ranges.rend();
 		rit = rm->ranges.rbegin();
-		timeval last_pcap_tstamp = rit->second->sent_tstamp_pcap[0].first;
+		tstamp_t last_pcap_tstamp = rit->second->sent_tstamp_pcap[0].first;
 		rit_end = rm->ranges.rend();
 		for (; rit != rit_end; rit++) {
-			timersub(&last_pcap_tstamp, &(rit->second->sent_tstamp_pcap[0].first), &tv);
-			if (tv.tv_sec >= GlobOpts::analyse_end) {
+			elapsed = last_pcap_tstamp - rit->second->sent_tstamp_pcap[0].first;
+			if (TS_TO_SEC(elapsed) >= GlobOpts::analyse_end) {
 				rm->analyse_range_last = rm->analyse_range_end = rit.base();
 				rm->analyse_range_end++;
-				timersub(&(rit->second->sent_tstamp_pcap[0].first),
-						 &rm->ranges.begin()->second->sent_tstamp_pcap[0].first, &tv);
-				rm->analyse_time_sec_end = tv.tv_sec;
+				elapsed = rit->second->sent_tstamp_pcap[0].first - rm->ranges.begin()->second->sent_tstamp_pcap[0].first;
+				rm->analyse_time_sec_end = TS_TO_SEC(elapsed);
 				break;
 			}
 		}
 	}
 	else if (GlobOpts::analyse_duration) {
 		ulong end_index = rm->ranges.size();
-		timeval begin_tv = rm->analyse_range_start->second->sent_tstamp_pcap[0].first;
-		map<seq64_t, ByteRange*>::iterator begin_it, end_it, tmp_it;
+		tstamp_t begin_tstamp = rm->analyse_range_start->second->sent_tstamp_pcap[0].first;
+		RangeMap::iterator begin_it, end_it, tmp_it;
 		begin_it = rm->analyse_range_start;
 		end_it = rm->ranges.end();
 		while (true) {
@@ -395,7 +392,6 @@ void Connection::setAnalyseRangeInterval() {
 			if (!advance) {
 				rm->analyse_range_end = rm->analyse_range_last = begin_it;
 				rm->analyse_range_end++;
-				timersub(&(begin_it->second->sent_tstamp_pcap[0].first), &begin_tv, &tv);
 				rm->analyse_time_sec_end = rm->analyse_time_sec_start + GlobOpts::analyse_duration;
 				break;
 			}
@@ -403,15 +399,15 @@ void Connection::setAnalyseRangeInterval() {
 			tmp_it = begin_it;
 			std::advance(tmp_it, (long)advance);
 
-			timersub(&(tmp_it->second->sent_tstamp_pcap[0].first), &begin_tv, &tv);
+			elapsed = tmp_it->second->sent_tstamp_pcap[0].first - begin_tstamp;
 			// Compares seconds, does not take into account milliseconds
 			// Shorter than the requested length
-			if (tv.tv_sec <= GlobOpts::analyse_duration) {
+			if (TS_TO_SEC(elapsed) <= GlobOpts::analyse_duration) {
 				begin_it = tmp_it;
 				start_index += advance;
 			}
 			// Longer than the requested length
-			else if (tv.tv_sec > GlobOpts::analyse_duration) {
+			else if (TS_TO_SEC(elapsed) > GlobOpts::analyse_duration) {
 				end_index -= advance;
 			}
 		}
@@ -500,7 +496,10 @@ void Connection::registerRecvd(sendData *sd) {
 		sd->data.in_sequence = 1;
 	}
 
-	rm->insertReceivedRange(sd);
+	if (GlobOpts::recv_join)
+		rm->deferReceivedRange(sd);
+	else
+		rm->insertReceivedRange(sd);
 	lastLargestRecvEndSeq = sd->data.endSeq;
 	lastLargestRecvSeqAbsolute = sd->data.seq_absolute + sd->data.payloadSize;
 }
@@ -512,11 +511,11 @@ void Connection::writeByteLatencyVariationCDF(ofstream *stream) {
 }
 
 ullint_t Connection::getNumUniqueBytes() {
-	multimap<seq64_t, ByteRange*>::iterator it, it_end;
+	RangeMap::iterator it, it_end;
 	it = rm->analyse_range_start;
 	it_end = rm->analyse_range_end;
-	seq64_t first_data_seq = 0, last_data_seq = 0;
-	for (; it != it_end; it++) {
+	seq64_t first_data_seq = rm->retired_data_seq, last_data_seq = 0;
+	for (; it != it_end && !rm->retired_data; it++) {
 		if (it->second->getNumBytes()) {
 			first_data_seq = it->second->getStartSeq();
 			break;
@@ -531,13 +530,16 @@ ullint_t Connection::getNumUniqueBytes() {
 			break;
 		}
 	}
+	// With retired ranges, the first range left may be the last with data
+	if (rm->retired_data && !last_data_seq)
+		last_data_seq = it_end->second->getNumBytes() ? it_end->second->getEndSeq() : rm->retired_seq;
 	ulong unique_data_bytes = last_data_seq - first_data_seq;
 	return unique_data_bytes;
 }
 
-void Connection::registerPacketSize(const timeval& first, const timeval& ts, const uint32_t ps,
+void Connection::registerPacketSize(tstamp_t first, tstamp_t ts, const uint32_t ps,
 									const uint16_t payloadSize, bool retrans) {
-	const uint64_t relative_ts = static_cast<uint64_t>(TV_TO_MS(ts) - TV_TO_MS(first));
+	const uint64_t relative_ts = static_cast<uint64_t>(TS_TO_MS(ts) - TS_TO_MS(first));
 	const uint64_t sent_time_bucket_idx = relative_ts / GlobOpts::throughputAggrMs;
 
 	while (sent_time_bucket_idx >= packetSizes.size()) {
@@ -558,11 +560,11 @@ void Connection::writePacketByteCountAndITT(vector<csv::ofstream*> streams) {
 	uint64_t k = 0;
 	while (packetSizes[k].empty()) k++;
 
-	int64_t prev = TV_TO_MICSEC(packetSizes[k][0].time);
+	int64_t prev = TS_TO_US(packetSizes[k][0].time);
 	int64_t itt, tmp;
 	for (i = 0; i < packetSizes.size(); ++i) {
 		for (j = 0; j < packetSizes[i].size(); ++j) {
-			tmp = TV_TO_MICSEC(packetSizes[i][j].time);
+			tmp = TS_TO_US(packetSizes[i][j].time);
 			itt = (tmp - prev) / 1000L;
 			prev = tmp;
 
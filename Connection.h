@@ -27,6 +27,8 @@ public:
 	ullint_t nrRetrans;
 	in_addr srcIp;
 	in_addr dstIp;
+	uint16_t srcPort;                    // Network byte order
+	uint16_t dstPort;
 	ullint_t bundleCount; // Number of packets with RDB data
 	// Used for calculating relative sequence number
 	seq64_t lastLargestStartSeq;
@@ -38,18 +40,26 @@ public:
 	seq32_t lastLargestAckSeqAbsolute;
 	seq64_t lastLargestSojournEndSeq;       // For receiver side analyse
 	seq32_t lastLargestSojournSeqAbsolute;  // For receiver side analyse
+	seq32_t sentSeqEndAbsolute;          // End of the data, SYNs and FINs sent (absolute), the largest ACK expected
 
 	bool closed;
 	int ignored_count;
 
+	// The closing of the connection, tracked with --evict-closed
+	bool finSent;                        // The sender has sent a FIN
+	bool rstSeen;                        // Either end has sent a RST
+	bool recvFinSeen;                    // The receiver has sent a FIN
+	bool recvFinAcked;                   // The sender has acknowledged the FIN of the receiver
+	seq32_t recvFinSeqEnd;               // The sequence number following the FIN of the receiver (absolute)
+
 	vector< vector<PacketSize> > packetSizes;
 	vector<PacketSizeGroup> packetSizeGroups;
 
 	PacketsStats packetsStats;
 	string connKey, senderKey, receiverKey;
 
-	timeval firstSendTime;
-	timeval endTime;
+	tstamp_t firstSendTime;
+	tstamp_t endTime;
 	RangeManager *rm;
 
 	Connection(const in_addr &src_ip, const uint16_t *src_port,
@@ -59,16 +69,18 @@ public:
 							  totRetransBytesSent(0), nrRetrans(0), bundleCount(0), lastLargestStartSeq(0),
 							  lastLargestEndSeq(0), lastLargestRecvEndSeq(0), lastLargestAckSeq(0),
 							  lastLargestSojournEndSeq(0), lastLargestSojournSeqAbsolute(0), closed(false),
-							  ignored_count(0)
+							  ignored_count(0), finSent(false), rstSeen(false), recvFinSeen(false), recvFinAcked(false),
+							  recvFinSeqEnd(0), firstSendTime(0), endTime(0)
 
 	{
 		srcIp                      = src_ip;
 		dstIp                      = dst_ip;
+		srcPort                    = *src_port;
+		dstPort                    = *dst_port;
 		lastLargestSeqAbsolute     = seq;
 		lastLargestRecvSeqAbsolute = seq;
 		lastLargestAckSeqAbsolute  = seq;
-		timerclear(&firstSendTime);
-		timerclear(&endTime);
+		sentSeqEndAbsolute         = seq;
 		rm = new RangeManager(this, seq);
 		connKey = makeConnKey(src_ip, dst_ip, src_port, dst_port);
 		senderKey = makeHostKey(src_ip, src_port);
@@ -87,7 +99,7 @@ public:
 	PacketsStats* getBytesLatencyStats();
 	void genBytesLatencyStats(PacketsStats* bs);
 	void validateRanges();
-	timeval get_duration() ;
+	tstamp_t get_duration() ;
 	void genByteCountGroupedByInterval();
 	void calculateLatencyVariation() { rm->calculateLatencyVariation(); }
 	void makeByteLatencyVariationCDF() { rm->makeByteLatencyVariationCDF(); }
@@ -104,10 +116,16 @@ public:
 	void setAnalyseRangeInterval();
 	void calculateRetransAndRDBStats();
 	uint32_t getDuration(bool analyse_range_duration);
-	void registerPacketSize(const timeval& first_tstamp_in_dump, const timeval& pkt_tstamp, const uint32_t pkt_size,
+	void registerPacketSize(tstamp_t first_tstamp_in_dump, tstamp_t pkt_tstamp, const uint32_t pkt_size,
 							const uint16_t payloadSize, bool retrans);
 	void writePacketByteCountAndITT(vector<csv::ofstream*> streams);
 	seq64_t getRelativeSequenceNumber(seq32_t seq, relative_seq_type type);
+
+	/* True when both ends are done with the connection, or it was closed due to port reuse */
+	bool isFinished() {
+		return closed || rstSeen ||
+			(finSent && recvFinAcked && !before(lastLargestAckSeqAbsolute, sentSeqEndAbsolute));
+	}
 };
 
 #endif /* CONNECTION_H */
@@ -0,0 +1,186 @@
+#include "ConnectionTable.h"
+
+#define CONNECTION_TABLE_MIN_SLOTS 64
+
+static inline bool key_matches(const ConnectionMapKey &key, const in_addr &srcIpAddr, const in_addr &dstIpAddr,
+							   uint16_t srcPort, uint16_t dstPort) {
+	return key.ip_src.s_addr == srcIpAddr.s_addr && key.ip_dst.s_addr == dstIpAddr.s_addr
+		&& key.src_port == srcPort && key.dst_port == dstPort;
+}
+
+/* Methods for class ConnectionTable */
+ConnectionTable::ConnectionTable()
+	: slots(CONNECTION_TABLE_MIN_SLOTS)
+	, sorted(true)
+	, last_hit(0)
+	, last_reverse_hit(0)
+{
+	for (Slot &slot : slots)
+		slot.index = 0;
+}
+
+/*
+  Hash of the two endpoints of a connection.
+  The endpoints are combined symmetrically, so both directions hash to the same slot.
+ */
+uint32_t ConnectionTable::hash(const in_addr &ip_a, const in_addr &ip_b, uint16_t port_a, uint16_t port_b) {
+	uint64_t a = ((uint64_t) ip_a.s_addr << 16) | port_a;
+	uint64_t b = ((uint64_t) ip_b.s_addr << 16) | port_b;
+	uint64_t x = (a ^ b) + (a + b) * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return (uint32_t) x;
+}
+
+Connection* ConnectionTable::find(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort) {
+	const Slot *slot = &slots[last_hit];
+	if (slot->index && key_matches(slot->key, srcIpAddr, dstIpAddr, srcPort, dstPort))
+		return entries[slot->index - 1].second;
+
+	size_t mask = slots.size() - 1;
+	size_t i = hash(srcIpAddr, dstIpAddr, srcPort, dstPort) & mask;
+	for (; slots[i].index; i = (i + 1) & mask) {
+		if (key_matches(slots[i].key, srcIpAddr, dstIpAddr, srcPort, dstPort)) {
+			last_hit = i;
+			return entries[slots[i].index - 1].second;
+		}
+	}
+	return NULL;
+}
+
+/* Find the connection going in the opposite direction of the given 4-tuple */
+Connection* ConnectionTable::findReverse(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort) {
+	const Slot *slot = &slots[last_reverse_hit];
+	if (slot->index && key_matches(slot->key, dstIpAddr, srcIpAddr, dstPort, srcPort))
+		return entries[slot->index - 1].second;
+
+	size_t mask = slots.size() - 1;
+	size_t i = hash(srcIpAddr, dstIpAddr, srcPort, dstPort) & mask;
+	for (; slots[i].index; i = (i + 1) & mask) {
+		if (key_matches(slots[i].key, dstIpAddr, srcIpAddr, dstPort, srcPort)) {
+			last_reverse_hit = i;
+			return entries[slots[i].index - 1].second;
+		}
+	}
+	return NULL;
+}
+
+/* The 4-tuple must not already be in the table */
+void ConnectionTable::insert(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort, Connection *conn) {
+	// Keep the load factor at or below 0.5
+	if ((entries.size() + 1) * 2 > slots.size())
+		grow();
+
+	ConnectionMapKey *key;
+	if (!free_keys.empty()) {
+		key = free_keys.back();
+		free_keys.pop_back();
+	}
+	else {
+		keys.push_back(ConnectionMapKey());
+		key = &keys.back();
+	}
+	key->ip_src = srcIpAddr;
+	key->ip_dst = dstIpAddr;
+	key->src_port = srcPort;
+	key->dst_port = dstPort;
+	entries.push_back(value_type(key, conn));
+	sorted = false;
+
+	size_t mask = slots.size() - 1;
+	size_t i = hash(srcIpAddr, dstIpAddr, srcPort, dstPort) & mask;
+	while (slots[i].index)
+		i = (i + 1) & mask;
+	slots[i].key = *key;
+	slots[i].index = (uint32_t) entries.size();
+	last_hit = i;
+}
+
+/* The slot holding key, which must be in the table */
+size_t ConnectionTable::findSlot(const ConnectionMapKey &key) {
+	size_t mask = slots.size() - 1;
+	size_t i = hash(key.ip_src, key.ip_dst, key.src_port, key.dst_port) & mask;
+	while (!key_matches(slots[i].key, key.ip_src, key.ip_dst, key.src_port, key.dst_port))
+		i = (i + 1) & mask;
+	return i;
+}
+
+/*
+  Removes the connection from the table and returns it, or NULL if it is not
+  in the table. The connection is not deleted.
+  The last connection inserted takes the place of the erased one in the
+  entries, and the slots following the erased slot are shifted back, so the
+  probe sequences stay unbroken.
+ */
+Connection* ConnectionTable::erase(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort) {
+	if (!find(srcIpAddr, dstIpAddr, srcPort, dstPort))
+		return NULL;
+	size_t i = last_hit;
+	size_t index = slots[i].index - 1;
+	value_type erased = entries[index];
+
+	if (index + 1 != entries.size()) {
+		entries[index] = entries.back();
+		slots[findSlot(*entries[index].first)].index = (uint32_t) index + 1;
+	}
+	entries.pop_back();
+	free_keys.push_back(erased.first);
+
+	size_t mask = slots.size() - 1;
+	for (size_t j = (i + 1) & mask; slots[j].index; j = (j + 1) & mask) {
+		size_t home = hash(slots[j].key.ip_src, slots[j].key.ip_dst, slots[j].key.src_port, slots[j].key.dst_port) & mask;
+		// Move the slot back unless its home lies cyclically in (i, j]
+		bool stays = (i < j) ? (home > i && home <= j) : (home > i || home <= j);
+		if (!stays) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i].index = 0;
+	sorted = false;
+	last_hit = last_reverse_hit = 0;
+	return erased.second;
+}
+
+void ConnectionTable::grow() {
+	vector<Slot> old_slots;
+	old_slots.swap(slots);
+	slots.resize(old_slots.size() * 2);
+	for (Slot &slot : slots)
+		slot.index = 0;
+
+	size_t mask = slots.size() - 1;
+	for (const Slot &old : old_slots) {
+		if (!old.index)
+			continue;
+		size_t i = hash(old.key.ip_src, old.key.ip_dst, old.key.src_port, old.key.dst_port) & mask;
+		while (slots[i].index)
+			i = (i + 1) & mask;
+		slots[i] = old;
+	}
+	last_hit = last_reverse_hit = 0;
+}
+
+void ConnectionTable::sortEntries() {
+	if (sorted)
+		return;
+	ordered = entries;
+	ConnectionKeyComparator cmp;
+	sort(ordered.begin(), ordered.end(),
+		 [&cmp](const value_type &a, const value_type &b) { return cmp(a.first, b.first); });
+	sorted = true;
+}
+
+/* The connections are not deleted */
+void ConnectionTable::clear() {
+	slots.assign(CONNECTION_TABLE_MIN_SLOTS, Slot());
+	for (Slot &slot : slots)
+		slot.index = 0;
+	keys.clear();
+	free_keys.clear();
+	entries.clear();
+	ordered.clear();
+	sorted = true;
+	last_hit = last_reverse_hit = 0;
+}
@@ -0,0 +1,106 @@
+#ifndef CONNECTIONTABLE_H
+#define CONNECTIONTABLE_H
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+class Connection;
+
+/* The 4-tuple of a connection, as found in the packet headers (network byte order) */
+struct ConnectionMapKey {
+	in_addr ip_src, ip_dst;
+	u_short src_port, dst_port;
+};
+
+struct ConnectionKeyComparator {
+	bool operator()(const ConnectionMapKey*  left, const ConnectionMapKey* right) const {
+		bool ret;
+		if (left->ip_src.s_addr != right->ip_src.s_addr)
+			ret = left->ip_src.s_addr < right->ip_src.s_addr;
+		else if (left->src_port != right->src_port)
+			ret = left->src_port < right->src_port;
+		else if (left->ip_dst.s_addr != right->ip_dst.s_addr)
+			ret = left->ip_dst.s_addr < right->ip_dst.s_addr;
+		else if (left->dst_port != right->dst_port)
+			ret = left->dst_port < right->dst_port;
+		else
+			ret = false;
+		return ret;
+	}
+	bool operator()(const ConnectionMapKey &left, const ConnectionMapKey &right) const {
+		return (*this)(&left, &right);
+	}
+};
+
+// Sort by converting ports with ntohs
+struct SortedConnectionKeyComparator {
+	bool operator()(const ConnectionMapKey*  left, const ConnectionMapKey* right) const {
+		bool ret;
+		if (left->ip_src.s_addr != right->ip_src.s_addr)
+			ret = left->ip_src.s_addr < right->ip_src.s_addr;
+		else if (ntohs(left->src_port) != ntohs(right->src_port))
+			ret = ntohs(left->src_port) < ntohs(right->src_port);
+		else if (left->ip_dst.s_addr != right->ip_dst.s_addr)
+			ret = left->ip_dst.s_addr < right->ip_dst.s_addr;
+		else if (ntohs(left->dst_port) != ntohs(right->dst_port))
+			ret = ntohs(left->dst_port) < ntohs(right->dst_port);
+		else
+			ret = false;
+		return ret;
+	}
+};
+
+/*
+  Hash table of the connections in a dump, keyed on the 4-tuple.
+  The slots are a flat array probed linearly, holding the key and the index of
+  the connection. The hash is the same for both directions of a connection,
+  so the connection an ACK belongs to is found by comparing the slot keys
+  with the addresses and ports swapped.
+  Iterating the table walks the connections in ConnectionKeyComparator order.
+ */
+class ConnectionTable {
+public:
+	typedef pair<ConnectionMapKey*, Connection*> value_type;
+	typedef vector<value_type>::iterator iterator;
+
+private:
+	struct Slot {
+		ConnectionMapKey key;
+		uint32_t index;         // Index in entries + 1, 0 when the slot is empty
+	};
+
+	vector<Slot> slots;
+	deque<ConnectionMapKey> keys;
+	vector<ConnectionMapKey*> free_keys;  // Keys of erased connections, reused by insert()
+	vector<value_type> entries;   // Connections in insert order
+	vector<value_type> ordered;   // Connections in ConnectionKeyComparator order
+	bool sorted;
+	size_t last_hit;                  // Slot of the last connection found
+	size_t last_reverse_hit;          // Slot of the last connection found by findReverse()
+
+	void grow();
+	void sortEntries();
+	size_t findSlot(const ConnectionMapKey &key);
+
+public:
+	ConnectionTable();
+
+	static uint32_t hash(const in_addr &ip_a, const in_addr &ip_b, uint16_t port_a, uint16_t port_b);
+
+	Connection* find(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort);
+	Connection* findReverse(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort);
+	void insert(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort, Connection *conn);
+	Connection* erase(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort);
+	void clear();
+
+	size_t size() const { return entries.size(); }
+	iterator begin() { sortEntries(); return ordered.begin(); }
+	iterator end() { sortEntries(); return ordered.end(); }
+};
+
+#endif /* CONNECTIONTABLE_H */
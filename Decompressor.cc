@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "Decompressor.h"
+#include "util.h"
+
+/* Decompressor.h brings in config.h, which defines the HAVE_* macros */
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/* Bytes read from the compressed dump, and written to the pipe, at a time */
+#define DECOMPRESS_BUFFER_SIZE (256 * 1024)
+/* Size requested for the pipe between the decompression and libpcap */
+#define DECOMPRESS_PIPE_SIZE   (1024 * 1024)
+
+/* Methods for class Decompressor */
+Decompressor::Decompressor(const string &fn, compression_type t)
+	: filename(fn)
+	, type(t)
+	, in_fd(-1)
+	, out_fd(-1)
+	, file(NULL)
+	, reader_closed(false)
+{
+	bool supported = false;
+#ifdef HAVE_ZLIB
+	supported |= type == COMPRESSION_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+	supported |= type == COMPRESSION_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+	supported |= type == COMPRESSION_LZ4;
+#endif
+	if (!supported) {
+		colored_fprintf(stderr, RED, "Cannot read %s: analyseTCP was built without %s support\n", filename.c_str(), typeName(type));
+		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	}
+
+	int fds[2];
+	in_fd = open(filename.c_str(), O_RDONLY);
+	if (in_fd == -1 || pipe(fds) == -1) {
+		fprintf(stderr, "Failed to open %s: %s\n", filename.c_str(), strerror(errno));
+		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	}
+#ifdef F_SETPIPE_SZ
+	// Best effort, the default pipe size works too
+	fcntl(fds[1], F_SETPIPE_SZ, DECOMPRESS_PIPE_SIZE);
+#endif
+	out_fd = fds[1];
+	file = fdopen(fds[0], "rb");
+
+	worker = thread(&Decompressor::run, this);
+}
+
+/* The read end of the pipe (file) must be closed first, which pcap_close does */
+Decompressor::~Decompressor() {
+	worker.join();
+	if (in_fd != -1)
+		close(in_fd);
+}
+
+/* Returns the compression of the dump, found from the magic number of the file */
+compression_type Decompressor::detect(const string &fn) {
+	// Pipes must be left unopened, as they can only be read once
+	struct stat sb;
+	if (stat(fn.c_str(), &sb) == -1 || !S_ISREG(sb.st_mode))
+		return COMPRESSION_NONE;
+
+	int fd = open(fn.c_str(), O_RDONLY);
+	if (fd == -1)
+		return COMPRESSION_NONE;
+	u_char magic[4];
+	ssize_t n = read(fd, magic, sizeof(magic));
+	close(fd);
+
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return COMPRESSION_GZIP;
+	if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return COMPRESSION_ZSTD;
+	if (n == 4 && magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d && magic[3] == 0x18)
+		return COMPRESSION_LZ4;
+	return COMPRESSION_NONE;
+}
+
+const char* Decompressor::typeName(compression_type t) {
+	switch (t) {
+	case COMPRESSION_GZIP: return "gzip";
+	case COMPRESSION_ZSTD: return "zstd";
+	case COMPRESSION_LZ4: return "lz4";
+	default: return "none";
+	}
+}
+
+/* Runs in the decompression thread */
+void Decompressor::run() {
+	// Writing to the pipe after libpcap has closed it must fail with EPIPE rather than kill the process
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	bool ok = false;
+	switch (type) {
+	case COMPRESSION_GZIP: ok = decompressGzip(); break;
+	case COMPRESSION_ZSTD: ok = decompressZstd(); break;
+	case COMPRESSION_LZ4: ok = decompressLZ4(); break;
+	default: break;
+	}
+
+	if (!ok && !reader_closed) {
+		colored_fprintf(stderr, RED, "Failed to decompress %s, ignoring the rest of the dump.\n", filename.c_str());
+	}
+	// libpcap sees the end of the dump
+	close(out_fd);
+}
+
+bool Decompressor::writeAll(const u_char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(out_fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE)
+				reader_closed = true;
+			return false;
+		}
+		buf += n;
+		len -= (size_t) n;
+	}
+	return true;
+}
+
+bool Decompressor::decompressGzip() {
+#ifdef HAVE_ZLIB
+	// gzclose() closes in_fd
+	gzFile gz = gzdopen(in_fd, "rb");
+	in_fd = -1;
+	if (gz == NULL)
+		return false;
+	gzbuffer(gz, DECOMPRESS_BUFFER_SIZE);
+
+	vector<u_char> out(DECOMPRESS_BUFFER_SIZE);
+	int n;
+	while ((n = gzread(gz, out.data(), (unsigned) out.size())) > 0) {
+		if (!writeAll(out.data(), (size_t) n))
+			break;
+	}
+	if (n < 0) {
+		int err;
+		fprintf(stderr, "gzip: %s\n", gzerror(gz, &err));
+	}
+	// Z_BUF_ERROR when the dump ends in the middle of a gzip stream
+	int ret = gzclose(gz);
+	if (n == 0 && ret == Z_BUF_ERROR)
+		fprintf(stderr, "gzip: unexpected end of file\n");
+	return n == 0 && ret == Z_OK;
+#else
+	return false;
+#endif
+}
+
+bool Decompressor::decompressZstd() {
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *stream = ZSTD_createDStream();
+	ZSTD_initDStream(stream);
+	vector<u_char> in(ZSTD_DStreamInSize());
+	vector<u_char> out(ZSTD_DStreamOutSize());
+
+	size_t ret = 0;
+	ssize_t n;
+	bool ok = true;
+	while (ok && (n = read(in_fd, in.data(), in.size())) > 0) {
+		ZSTD_inBuffer input = { in.data(), (size_t) n, 0 };
+		ZSTD_outBuffer output;
+		// Keep going while the output buffer fills up, as the stream may hold more data
+		do {
+			output = { out.data(), out.size(), 0 };
+			ret = ZSTD_decompressStream(stream, &output, &input);
+			if (ZSTD_isError(ret)) {
+				fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+				ok = false;
+				break;
+			}
+			if (!writeAll(out.data(), output.pos)) {
+				ok = false;
+				break;
+			}
+		} while (input.pos < input.size || output.pos == output.size);
+	}
+	ZSTD_freeDStream(stream);
+
+	// A non-zero hint at the end of the input means the last frame is truncated
+	return ok && ret == 0;
+#else
+	return false;
+#endif
+}
+
+bool Decompressor::decompressLZ4() {
+#ifdef HAVE_LZ4
+	LZ4F_dctx *ctx;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+		return false;
+	vector<u_char> in(DECOMPRESS_BUFFER_SIZE);
+	vector<u_char> out(DECOMPRESS_BUFFER_SIZE);
+
+	size_t ret = 0;
+	ssize_t n;
+	bool ok = true;
+	while (ok && (n = read(in_fd, in.data(), in.size())) > 0) {
+		const u_char *src = in.data();
+		size_t left = (size_t) n;
+		size_t out_size;
+		do {
+			size_t src_size = left;
+			out_size = out.size();
+			ret = LZ4F_decompress(ctx, out.data(), &out_size, src, &src_size, NULL);
+			if (LZ4F_isError(ret)) {
+				fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(ret));
+				ok = false;
+				break;
+			}
+			if (!writeAll(out.data(), out_size)) {
+				ok = false;
+				break;
+			}
+			src += src_size;
+			left -= src_size;
+		} while (left > 0 || out_size == out.size());
+	}
+	LZ4F_freeDecompressionContext(ctx);
+
+	// LZ4F_decompress returns 0 when a frame is complete
+	return ok && ret == 0;
+#else
+	return false;
+#endif
+}
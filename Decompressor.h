@@ -0,0 +1,40 @@
+#ifndef DECOMPRESSOR_H
+#define DECOMPRESSOR_H
+
+#include <thread>
+#include "common.h"
+
+enum compression_type {COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD, COMPRESSION_LZ4};
+
+/*
+  Decompresses a compressed dump (gzip, zstd or lz4) on a thread of its own.
+  The decompressed data is written into a pipe, which serves as the ring
+  buffer between the decompression and libpcap reading the dump from
+  getFile(), so decompression overlaps with the analysis.
+ */
+class Decompressor {
+private:
+	string filename;
+	compression_type type;
+	int in_fd;
+	int out_fd;             // Write end of the pipe
+	FILE *file;             // Read end of the pipe, handed to libpcap
+	thread worker;
+	bool reader_closed;     // libpcap closed the pipe before the end of the dump
+
+	void run();
+	bool writeAll(const u_char *buf, size_t len);
+	bool decompressGzip();
+	bool decompressZstd();
+	bool decompressLZ4();
+
+public:
+	Decompressor(const string &fn, compression_type t);
+	~Decompressor();
+
+	static compression_type detect(const string &fn);
+	static const char* typeName(compression_type t);
+	FILE* getFile() { return file; }
+};
+
+#endif /* DECOMPRESSOR_H */
@@ -1,10 +1,15 @@
 #include <memory>
 #include <string.h>
+#include <thread>
 
 #include "Dump.h"
 #include "color_print.h"
 #include "util.h"
 #include "Statistics.h"
+#include "PcapReader.h"
+#include "PacketQueue.h"
+#include "HeaderBatch.h"
+#include "ShardSpool.h"
 
 static void look_for_get_request(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size);
 
@@ -17,14 +22,22 @@ Dump::Dump(string src_ip, string dst_ip, string tcp_ip, string src_port, string
 	, filterSrcPort(src_port)
 	, filterDstPort(dst_port)
 	, filterTCPPort(tcp_port)
+	, filterSrcAddr(strToIp(src_ip))
+	, filterDstAddr(strToIp(dst_ip))
 	, sentPacketCount(0)
 	, recvPacketCount(0)
 	, sentBytesCount(0)
 	, recvBytesCount(0)
 	, ackCount(0)
 	, max_payload_size(0)
+	, pendingAckCount(0)
+	, orphanAckCount(0)
+	, pendingBatch(new HeaderBatch())
+	, finishedStats(NULL)
+	, evictedConnCount(0)
+	, evictedPacketCount(0)
 {
-	timerclear(&first_sent_time);
+	first_sent_time = 0;
 }
 
 Dump::Dump(const vector<four_tuple_t>& connections, string fn)
@@ -35,6 +48,8 @@ Dump::Dump(const vector<four_tuple_t>& connections, string fn)
 	, filterSrcPort("")
 	, filterDstPort("")
 	, filterTCPPort("")
+	, filterSrcAddr(strToIp(""))
+	, filterDstAddr(strToIp(""))
 	, _connections(connections)
 	, sentPacketCount(0)
 	, recvPacketCount(0)
@@ -42,49 +57,49 @@ Dump::Dump(const vector<four_tuple_t>& connections, string fn)
 	, recvBytesCount(0)
 	, ackCount(0)
 	, max_payload_size(0)
+	, pendingAckCount(0)
+	, orphanAckCount(0)
+	, pendingBatch(new HeaderBatch())
+	, finishedStats(NULL)
+	, evictedConnCount(0)
+	, evictedPacketCount(0)
 {
-	timerclear(&first_sent_time);
+	first_sent_time = 0;
 }
 
 Dump::~Dump() {
-	map<ConnectionMapKey*, Connection*>::iterator cIt, cItEnd;
-	for (cIt = conns.begin(); cIt != conns.end(); cIt++) {
-		delete cIt->first;
-		delete cIt->second;
-	}
+	if (recvStaging && recvStaging->thr.joinable())
+		recvStaging->thr.join();
+	for (auto &it : conns)
+		delete it.second;
 	conns.clear();
 }
 
+/* seq is the first sequence number of a new connection, in host byte order */
 Connection* Dump::getConn(const in_addr &srcIpAddr, const in_addr &dstIpAddr, const uint16_t *srcPort, const uint16_t *dstPort, const seq32_t *seq)
 {
-	ConnectionMapKey connKey;
-	map<ConnectionMapKey*, Connection*>::iterator it;
-	memcpy(&connKey.ip_src, &srcIpAddr, sizeof(in_addr));
-	memcpy(&connKey.ip_dst, &dstIpAddr, sizeof(in_addr));
-	connKey.src_port = *srcPort;
-	connKey.dst_port = *dstPort;
-
-	it = conns.find(&connKey);
-	// Returning the existing connection key
-	if (it != conns.end()) {
-		return it->second;
+	Connection *tmpConn = conns.find(srcIpAddr, dstIpAddr, *srcPort, *dstPort);
+	// Returning the existing connection
+	if (tmpConn != NULL) {
+		return tmpConn;
 	}
 
 	if (seq == NULL) {
 		return NULL;
 	}
 
-	Connection *tmpConn = new Connection(srcIpAddr, srcPort, dstIpAddr, dstPort, ntohl(*seq));
-	ConnectionMapKey *connKeyToInsert = new ConnectionMapKey();
-	memcpy(&connKeyToInsert->ip_src, &srcIpAddr, sizeof(in_addr));
-	memcpy(&connKeyToInsert->ip_dst, &dstIpAddr, sizeof(in_addr));
-	connKeyToInsert->src_port = connKey.src_port;
-	connKeyToInsert->dst_port = connKey.dst_port;
-	conns.insert(pair<ConnectionMapKey*, Connection*>(connKeyToInsert, tmpConn));
+	tmpConn = new Connection(srcIpAddr, srcPort, dstIpAddr, dstPort, *seq);
+	conns.insert(srcIpAddr, dstIpAddr, *srcPort, *dstPort, tmpConn);
 	vbprintf(2, "New connection: %s\n", tmpConn->getConnKey().c_str());
 	return tmpConn;
 }
 
+/* Returns the connection the packet from srcIpAddr:srcPort to dstIpAddr:dstPort is an ACK for */
+Connection* Dump::getReverseConn(const in_addr &srcIpAddr, const in_addr &dstIpAddr, const uint16_t *srcPort, const uint16_t *dstPort)
+{
+	return conns.findReverse(srcIpAddr, dstIpAddr, *srcPort, *dstPort);
+}
+
 Connection* Dump::getConn(string &srcIpStr, string &dstIpStr, string &srcPortStr, string &dstPortStr)
 {
 	in_addr srcIpAddr;
@@ -103,200 +118,961 @@ Connection* Dump::getConn(string &srcIpStr, string &dstIpStr, string &srcPortStr
 	return getConn(srcIpAddr, dstIpAddr, &srcPort, &dstPort, NULL);
 }
 
+/* Returns the size of the link layer header for the packets in the dump */
+static u_int get_link_layer_header_size(int type)
+{
+	switch (type) {
+	case DLT_EN10MB:
+		return SIZE_ETHERNET;
+	case DLT_LINUX_SLL:
+		return SIZE_HEADER_LINUX_COOKED_MODE;
+	default: {
+		fprintf(stderr, "Unsupported link layer type: %d ('%s')\n", type, pcap_datalink_val_to_name(type));
+		exit(1);
+	}
+	}
+}
+
+/* Filter matching the outgoing data packets in the sender dump */
+void Dump::setSentFilter(PacketFilter &filter)
+{
+	if (_connections.size() == 0) {
+		/* Set up pcap filter to include only outgoing tcp
+		 * packets with correct ip and port numbers.
+		 */
+		if (!filterSrcIp.empty())
+			filter.addSrcHost(filterSrcIp);
+		if (!filterSrcPort.empty())
+			filter.addSrcPort(filterSrcPort);
+		if (!filterDstIp.empty())
+			filter.addDstHost(filterDstIp);
+		if (!filterDstPort.empty())
+			filter.addDstPort(filterDstPort);
+
+		if (!filterTCPPort.empty())
+			filter.addPort(filterTCPPort);
+
+		if (!filterTCPIp.empty())
+			filter.addHost(filterTCPIp);
+
+		// Earlier, only packets with TCP payload were used.
+		//filterExp << " && (ip[2:2] - ((ip[0]&0x0f)<<2) - (tcp[12]>>2)) >= 1";
+	} else {
+		stringstream filterExp;
+		auto it  = _connections.begin();
+		auto end = _connections.end();
+		for (; it!=end; it++)
+		{
+			filterExp << "( tcp "
+					  << "&& src host " << it->ip_left() << " && src port " << it->port_left()
+					  << "&& dst host " << it->ip_right() << " && dst port " << it->port_right()
+					  << " ) || ( tcp "
+					  << "&& src host " << it->ip_right() << " && src port " << it->port_right()
+					  << "&& dst host " << it->ip_left() << " && dst port " << it->port_left()
+					  << " )";
+			if (it+1 != end) filterExp << " || ";
+		}
+		filter.setExpression(filterExp.str());
+	}
+}
+
+/* Filter matching the incoming acknowledgements in the sender dump */
+void Dump::setAckFilter(PacketFilter &filter)
+{
+	if (!filterDstIp.empty())
+		filter.addSrcHost(filterDstIp);
+	if (!filterDstPort.empty())
+		filter.addSrcPort(filterDstPort);
+
+	if (!filterSrcIp.empty())
+		filter.addDstHost(filterSrcIp);
+	if (!filterSrcPort.empty())
+		filter.addDstPort(filterSrcPort);
+
+	if (!filterTCPPort.empty())
+		filter.addPort(filterTCPPort);
+
+	filter.addAckFlag();
+}
+
+void Dump::validateRanges()
+{
+	if (GlobOpts::validate_ranges) {
+		/* DEBUG: Validate range */
+		auto it_end = conns.end();
+		for (auto it = conns.begin(); it != it_end; it++) {
+			it->second->validateRanges();
+		}
+	}
+}
+
 /* Traverse the pcap dump and call methods for processing the packets
    This generates initial one-pass statistics from sender-side dump. */
 void Dump::analyseSender()
 {
-	int packetCount = 0;
-	char errbuf[PCAP_ERRBUF_SIZE];
-	pcap_pkthdr header;
-	const u_char *data;
+	if (GlobOpts::threads > 1) {
+		analyseSenderParallel();
+		return;
+	}
 
-	pcap_t *fd = pcap_open_offline(filename.c_str(), errbuf);
-	if (fd == NULL) {
-		cerr << "pcap: Could not open file: " << filename << endl;
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	if (GlobOpts::single_pass) {
+		analyseSenderSinglePass();
+		return;
 	}
 
-	int type = pcap_datalink(fd);
-	u_int link_layer_header_size;
+	PcapReader *reader = new PcapReader(filename);
+	u_int link_layer_header_size = get_link_layer_header_size(reader->getLinkType());
+	PacketFilter sentFilter;
+	setSentFilter(sentFilter);
 
-	switch (type) {
-	case DLT_EN10MB: {
-		link_layer_header_size = SIZE_ETHERNET;
-		break;
-	}
-	case DLT_LINUX_SLL: {
-		link_layer_header_size = SIZE_HEADER_LINUX_COOKED_MODE;
-		break;
+	vbprintf(1, "using pcap filter expression: '%s'\n", sentFilter.getExpression().c_str());
+
+	/* Filter to get outgoing packets */
+	reader->setFilter(sentFilter);
+
+	if (DEBUGL_SENDER(1)) {
+		colored_printf(YELLOW, "Processing sent packets...\n");
+		printf("Using filter: '%s'\n", sentFilter.getExpression().c_str());
 	}
-	default: {
-		fprintf(stderr, "Unsupported link layer type: %d ('%s')\n", type, pcap_datalink_val_to_name(type));
-		exit(1);
+
+	/* Sniff each sent packet in pcap tracefile: */
+	unique_ptr<HeaderBatch> batch(new HeaderBatch());
+	while (batch->read(*reader, PACKET_SENT, link_layer_header_size)) {
+		for (uint32_t i = 0; i < batch->count; i++)
+			processSent(*batch, i); /* Sniff packet */
 	}
+
+	vbclprintf(1, YELLOW, "Finished processing sent packets...\n");
+
+	delete reader;
+
+	validateRanges();
+
+	vbclprintf(1, YELLOW, "Processing acknowledgements...\n");
+
+	reader = new PcapReader(filename);
+	PacketFilter ackFilter;
+	setAckFilter(ackFilter);
+
+	vbprintf(1, "Using pcap filter expression: '%s'\n", ackFilter.getExpression().c_str());
+
+	reader->setFilter(ackFilter);
+
+	/* Sniff each sent packet in pcap tracefile: */
+	while (batch->read(*reader, PACKET_ACK, link_layer_header_size)) {
+		for (uint32_t i = 0; i < batch->count; i++)
+			processAcks(*batch, i); /* Sniff packet */
 	}
 
-	stringstream filterExp;
-	bpf_program compFilter;
+	delete reader;
 
-	bool src_port_range;
-	bool dst_port_range;
+	if (DEBUGL_SENDER(1)) {
+		printf("Finished processing acknowledgements...\n");
+	}
 
-    if (_connections.size() == 0) {
-	    /* Set up pcap filter to include only outgoing tcp
-	     * packets with correct ip and port numbers.
-	     */
-	    src_port_range = !isNumeric(filterSrcPort.c_str(), 10);
-	    dst_port_range = !isNumeric(filterDstPort.c_str(), 10);
+	validateRanges();
+}
 
-	    filterExp << "tcp";
-	    if (!filterSrcIp.empty())
-		    filterExp << " && src host " << filterSrcIp;
-	    if (!filterSrcPort.empty()) {
-		    filterExp << " && src " << (src_port_range ? "portrange " : "port ") << filterSrcPort;
-	    }
-	    if (!filterDstIp.empty())
-		    filterExp << " && dst host " << filterDstIp;
-	    if (!filterDstPort.empty())
-		    filterExp << " && dst " << (dst_port_range ? "portrange " : "port ") << filterDstPort;
+static ConnTupleKey connTupleKey(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort)
+{
+	return ConnTupleKey(((uint64_t) srcIpAddr.s_addr << 32) | dstIpAddr.s_addr, ((uint32_t) srcPort << 16) | dstPort);
+}
 
-        if (!filterTCPPort.empty())
-		    filterExp << " && tcp port " << filterTCPPort;
+/*
+  Returns true if the data acknowledged by the ACK has been registered
+  on the connection, i.e. the ACK may be processed right away.
+ */
+static bool ackIsReady(Connection *conn, seq32_t ack)
+{
+	// Closed due to port reuse, the ACK will be ignored anyways
+	if (conn->closed)
+		return true;
 
-		if (!filterTCPIp.empty())
-		    filterExp << " && host " << filterTCPIp;
+	return !after(ack, conn->sentSeqEndAbsolute);
+}
 
-	    // Earlier, only packets with TCP payload were used.
-	    //filterExp << " && (ip[2:2] - ((ip[0]&0x0f)<<2) - (tcp[12]>>2)) >= 1";
-    } else {
-	    src_port_range = false;
-	    dst_port_range = false;
+/*
+  Traverse the sender dump once, feeding both the outgoing data and the
+  incoming acknowledgements to the connections in capture order.
+  Each packet is classified with the same filters as used by the two-pass
+  analysis, so the packets seen by processSent and processAcks are the same.
+  ACKs that acknowledge data not yet registered on the connection are held
+  back in a small reorder buffer until the data range exists.
+ */
+void Dump::analyseSenderSinglePass()
+{
+	PacketFilter sentFilter, ackFilter;
 
-        auto it  = _connections.begin();
-        auto end = _connections.end();
-        for (; it!=end; it++)
-        {
-            filterExp << "( tcp "
-                      << "&& src host " << it->ip_left() << " && src port " << it->port_left()
-                      << "&& dst host " << it->ip_right() << " && dst port " << it->port_right()
-                      << " ) || ( tcp "
-                      << "&& src host " << it->ip_right() << " && src port " << it->port_right()
-                      << "&& dst host " << it->ip_left() << " && dst port " << it->port_left()
-                      << " )";
-            if (it+1 != end) filterExp << " || ";
-        }
-    }
+	PcapReader reader(filename);
+	u_int link_layer_header_size = get_link_layer_header_size(reader.getLinkType());
+	setSentFilter(sentFilter);
+	setAckFilter(ackFilter);
 
-	vbprintf(1, "using pcap filter expression: '%s'\n", (char*) filterExp.str().c_str());
+	vbprintf(1, "using pcap filter expression: '%s'\n", sentFilter.getExpression().c_str());
+	vbprintf(1, "Using pcap filter expression: '%s'\n", ackFilter.getExpression().c_str());
 
-	/* Filter to get outgoing packets */
-	if (pcap_compile(fd, &compFilter, (char*)((filterExp.str()).c_str()), 0, 0) == -1) {
-		fprintf(stderr, "Couldn't parse filter '%s'. Error: %s\n", filterExp.str().c_str(), pcap_geterr(fd));
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	if (DEBUGL_SENDER(1)) {
+		colored_printf(YELLOW, "Processing sent packets and acknowledgements...\n");
 	}
 
-	if (pcap_setfilter(fd, &compFilter) == -1) {
-		fprintf(stderr, "Couldn't install filter '%s'. Error: %s\n", filterExp.str().c_str(), pcap_geterr(fd));
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	unique_ptr<HeaderBatch> batch(new HeaderBatch());
+	while (batch->read(reader, 0, link_layer_header_size)) {
+		for (uint32_t i = 0; i < batch->count; i++) {
+			if (reader.match(sentFilter, &batch->header[i], batch->data[i]))
+				batch->kind[i] |= PACKET_SENT;
+			if (reader.match(ackFilter, &batch->header[i], batch->data[i]))
+				batch->kind[i] |= PACKET_ACK;
+		}
+		for (uint32_t i = 0; i < batch->count; i++)
+			processSenderPacket(*batch, i);
 	}
-	pcap_freecode(&compFilter);
+	processPendingAcks(0, link_layer_header_size, true);
+	evictFinished(0, link_layer_header_size);
 
 	if (DEBUGL_SENDER(1)) {
-		colored_printf(YELLOW, "Processing sent packets...\n");
-		printf("Using filter: '%s'\n", filterExp.str().c_str());
+		printf("Finished processing sent packets and acknowledgements...\n");
 	}
 
-	/* Sniff each sent packet in pcap tracefile: */
-	do {
-		data = (const u_char *) pcap_next(fd, &header);
-		if (data == NULL) {
-			//char errMsg[50];
-			//sprintf(errMsg, "\nNo more data on file. Packets: %d\n", packetCount);
-			//pcap_perror(fd, errMsg);
-		} else {
-			processSent(&header, data, link_layer_header_size); /* Sniff packet */
-			packetCount++;
-		}
-	} while (data != NULL);
+	validateRanges();
+}
 
-	vbclprintf(1, YELLOW, "Finished processing sent packets...\n");
+/* Process a packet from the sender dump in the single-pass analysis */
+void Dump::processSenderPacket(const HeaderBatch &batch, uint32_t i)
+{
+	tstamp_t now = pcap_tstamp(&batch.header[i]);
+	if (GlobOpts::evict_closed && isEvicted(batch, i, now))
+		return;
 
-	pcap_close(fd);
+	if (batch.kind[i] & PACKET_SENT) {
+		processSent(batch, i);
+		// The data may be what ACKs held back for the connection are waiting for
+		if (!pendingConnAcks.empty() || !orphanConnAcks.empty()) {
+			Connection *conn = getConn(batch.ip_src[i], batch.ip_dst[i], &batch.src_port[i], &batch.dst_port[i], NULL);
+			if (conn != NULL) {
+				if (!orphanConnAcks.empty())
+					adoptOrphanAcks(conn, connTupleKey(batch.ip_src[i], batch.ip_dst[i], batch.src_port[i], batch.dst_port[i]));
+				processReadyAcks(conn, batch.link_header_size);
+			}
+		}
+	}
 
-	if (GlobOpts::validate_ranges) {
-		/* DEBUG: Validate range */
-		auto it_end = conns.end();
-		for (auto it = conns.begin(); it != it_end; it++) {
-			it->second->validateRanges();
+	if (batch.kind[i] & PACKET_ACK) {
+		Connection *conn = getReverseConn(batch.ip_src[i], batch.ip_dst[i], &batch.src_port[i], &batch.dst_port[i]);
+		if (conn != NULL && !pendingConnAcks.count(conn) && ackIsReady(conn, batch.ack[i]))
+			processAcks(batch, i);
+		else
+			deferAck(batch, i, conn);
+	}
+
+	if (!pendingAcks.empty() || !orphanAcks.empty()) {
+		processPendingAcks(now, batch.link_header_size, false);
+	}
+
+	if (!finishedConns.empty()) {
+		evictFinished(now, batch.link_header_size);
+	}
+}
+
+/*
+  Register the FINs and RSTs of a packet on the connection, and queue the
+  connection for eviction once both ends are done with it (--evict-closed).
+ */
+void Dump::checkFinished(Connection *conn, const HeaderBatch &batch, uint32_t i, bool sent)
+{
+	if (!GlobOpts::evict_closed)
+		return;
+
+	if (batch.flags[i] & TH_RST)
+		conn->rstSeen = true;
+
+	if (sent) {
+		if (batch.flags[i] & TH_FIN)
+			conn->finSent = true;
+		if (conn->recvFinSeen && (batch.flags[i] & TH_ACK) && !before(batch.ack[i], conn->recvFinSeqEnd))
+			conn->recvFinAcked = true;
+	}
+	else if (batch.flags[i] & TH_FIN) {
+		conn->recvFinSeen = true;
+		conn->recvFinSeqEnd = batch.seq[i] + (batch.ip_len[i] - batch.ip_hdr_len[i] - batch.tcp_hdr_len[i]) + 1;
+	}
+
+	if (conn->isFinished() && find(finishedConns.begin(), finishedConns.end(), conn) == finishedConns.end())
+		finishedConns.push_back(conn);
+}
+
+/*
+  Returns true if the packet belongs to a connection evicted less than
+  EVICTED_CONN_LINGER_MS ago, i.e. is a late packet to be ignored.
+  A SYN from the sender starts a new connection on the 4-tuple.
+ */
+bool Dump::isEvicted(const HeaderBatch &batch, uint32_t i, tstamp_t now)
+{
+	while (!evictedOrder.empty() && TS_TO_MS(now - evictedOrder.front().first) > EVICTED_CONN_LINGER_MS) {
+		auto it = evictedConns.find(evictedOrder.front().second);
+		if (it != evictedConns.end() && it->second == evictedOrder.front().first)
+			evictedConns.erase(it);
+		evictedOrder.pop_front();
+	}
+
+	if (evictedConns.empty())
+		return false;
+
+	if (batch.kind[i] & PACKET_SENT) {
+		auto it = evictedConns.find(connTupleKey(batch.ip_src[i], batch.ip_dst[i], batch.src_port[i], batch.dst_port[i]));
+		if (it != evictedConns.end()) {
+			if ((batch.flags[i] & TH_SYN) && !(batch.flags[i] & TH_ACK)) {
+				evictedConns.erase(it);
+			}
+			else {
+				evictedPacketCount++;
+				return true;
+			}
 		}
 	}
 
-	vbclprintf(1, YELLOW, "Processing acknowledgements...\n");
+	if ((batch.kind[i] & PACKET_ACK) &&
+		evictedConns.count(connTupleKey(batch.ip_dst[i], batch.ip_src[i], batch.dst_port[i], batch.src_port[i]))) {
+		evictedPacketCount++;
+		return true;
+	}
+	return false;
+}
 
-	pcap_t *fd2 = pcap_open_offline(filename.c_str(), errbuf);
-	if (fd2 == NULL) {
-		cerr << "pcap: Could not open file" << filename << endl;
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+/*
+  Write the statistics of a finished connection and free it.
+  The 4-tuple is remembered for a while to ignore the late packets, unless
+  the connection was closed because the port was reused.
+ */
+void Dump::evictConn(Connection *conn, tstamp_t now, u_int link_layer_header_size)
+{
+	// The ACKs held back for the connection are processed first
+	map<Connection*, deque<PendingAck*> >::iterator it;
+	while ((it = pendingConnAcks.find(conn)) != pendingConnAcks.end())
+		processPendingAck(*it->second.front(), link_layer_header_size);
+
+	if (GlobOpts::validate_ranges)
+		conn->validateRanges();
+	conn->calculateRetransAndRDBStats();
+	finishedStats->finishConn(*conn);
+
+	if (!conn->closed) {
+		ConnTupleKey key = connTupleKey(conn->srcIp, conn->dstIp, conn->srcPort, conn->dstPort);
+		evictedConns[key] = now;
+		evictedOrder.push_back(pair<tstamp_t, ConnTupleKey>(now, key));
 	}
+	vbprintf(2, "Evicted connection: %s\n", conn->getConnKey().c_str());
+	conns.erase(conn->srcIp, conn->dstIp, conn->srcPort, conn->dstPort);
+	freedRanges.add(conn);
+	delete conn;
+	evictedConnCount++;
+}
 
-	filterExp.str("");
-	filterExp << "tcp";
-	if (!filterDstIp.empty())
-		filterExp << " && src host " << filterDstIp;
-	if (!filterDstPort.empty())
-		filterExp << " && src " << (dst_port_range ? "portrange " : "port ") << filterDstPort;
+void Dump::evictFinished(tstamp_t now, u_int link_layer_header_size)
+{
+	while (!finishedConns.empty()) {
+		Connection *conn = finishedConns.front();
+		finishedConns.erase(finishedConns.begin());
+		evictConn(conn, now, link_layer_header_size);
+		// Processing the held back ACKs may have queued it again
+		finishedConns.erase(remove(finishedConns.begin(), finishedConns.end(), conn), finishedConns.end());
+	}
+}
 
-	if (!filterSrcIp.empty())
-		filterExp << " && dst host " << filterSrcIp;
-	if (!filterSrcPort.empty())
-		filterExp << " && dst " << (src_port_range ? "portrange " : "port ") << filterSrcPort;
+/*
+  Analyse the sender dump with the connections sharded over worker threads.
+  The dump is read the same way as in the serial analysis, in one or two passes.
+ */
+void Dump::analyseSenderParallel()
+{
+	PacketFilter sentFilter, ackFilter;
+	setSentFilter(sentFilter);
+	setAckFilter(ackFilter);
 
-	if (!filterTCPPort.empty())
-		filterExp << " && tcp port " << filterTCPPort;
+	createShards();
+
+	if (GlobOpts::single_pass) {
+		PcapReader reader(filename);
+		u_int link_layer_header_size = get_link_layer_header_size(reader.getLinkType());
+
+		vbprintf(1, "using pcap filter expression: '%s'\n", sentFilter.getExpression().c_str());
+		vbprintf(1, "Using pcap filter expression: '%s'\n", ackFilter.getExpression().c_str());
 
-	filterExp << " && ((tcp[tcpflags] & tcp-ack) == tcp-ack)";
+		if (DEBUGL_SENDER(1)) {
+			colored_printf(YELLOW, "Processing sent packets and acknowledgements...\n");
+		}
 
-	vbprintf(1, "Using pcap filter expression: '%s'\n", (char*) filterExp.str().c_str());
+		dispatchPackets(reader, link_layer_header_size, &sentFilter, &ackFilter, 0);
 
-	if (pcap_compile(fd2, &compFilter, (char*)((filterExp.str()).c_str()), 0, 0) == -1) {
-		fprintf(stderr, "Couldn't parse filter '%s'. Error: %s\n", filterExp.str().c_str(), pcap_geterr(fd));
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+		if (DEBUGL_SENDER(1)) {
+			printf("Finished processing sent packets and acknowledgements...\n");
+		}
 	}
+	else {
+		PcapReader *reader = new PcapReader(filename);
+		u_int link_layer_header_size = get_link_layer_header_size(reader->getLinkType());
 
-	if (pcap_setfilter(fd2, &compFilter) == -1) {
-		fprintf(stderr, "Couldn't install filter '%s'. Error: %s\n", filterExp.str().c_str(), pcap_geterr(fd));
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+		vbprintf(1, "using pcap filter expression: '%s'\n", sentFilter.getExpression().c_str());
+		reader->setFilter(sentFilter);
+
+		if (DEBUGL_SENDER(1)) {
+			colored_printf(YELLOW, "Processing sent packets...\n");
+			printf("Using filter: '%s'\n", sentFilter.getExpression().c_str());
+		}
+
+		dispatchPackets(*reader, link_layer_header_size, NULL, NULL, PACKET_SENT);
+		delete reader;
+
+		vbclprintf(1, YELLOW, "Finished processing sent packets...\n");
+		vbclprintf(1, YELLOW, "Processing acknowledgements...\n");
+
+		reader = new PcapReader(filename);
+		vbprintf(1, "Using pcap filter expression: '%s'\n", ackFilter.getExpression().c_str());
+		reader->setFilter(ackFilter);
+		dispatchPackets(*reader, link_layer_header_size, NULL, NULL, PACKET_ACK);
+		delete reader;
+
+		if (DEBUGL_SENDER(1)) {
+			printf("Finished processing acknowledgements...\n");
+		}
 	}
-	pcap_freecode(&compFilter);
 
-	packetCount = 0;
-	/* Sniff each sent packet in pcap tracefile: */
-	do {
-		data = (const u_char *) pcap_next(fd2, &header);
-		if (data == NULL) {
-			char errMsg[50];
-			sprintf(errMsg, "\nNo more data on file. Packets: %d\n", packetCount);
-			//pcap_perror(fd2, errMsg);
-		} else {
-			processAcks(&header, data, link_layer_header_size); /* Sniff packet */
-			packetCount++;
+	mergeShards();
+}
+
+/* Split the connections into one shard per worker thread */
+void Dump::createShards()
+{
+	for (int i = 0; i < GlobOpts::threads; i++) {
+		Dump *shard = new Dump(filterSrcIp, filterDstIp, filterTCPIp, filterSrcPort, filterDstPort, filterTCPPort, filename);
+		shard->first_sent_time = first_sent_time;
+		shards.push_back(shard);
+	}
+
+	for (auto &it : conns) {
+		const ConnectionMapKey *key = it.first;
+		size_t shard = ConnectionTable::hash(key->ip_src, key->ip_dst, key->src_port, key->dst_port) % shards.size();
+		shards[shard]->conns.insert(key->ip_src, key->ip_dst, key->src_port, key->dst_port, it.second);
+	}
+	conns.clear();
+}
+
+/* Move the connections and packet counts of the shards back into this dump */
+void Dump::mergeShards()
+{
+	for (Dump *shard : shards) {
+		for (auto &it : shard->conns) {
+			const ConnectionMapKey *key = it.first;
+			conns.insert(key->ip_src, key->ip_dst, key->src_port, key->dst_port, it.second);
+		}
+		shard->conns.clear();
+
+		sentPacketCount += shard->sentPacketCount;
+		recvPacketCount += shard->recvPacketCount;
+		sentBytesCount += shard->sentBytesCount;
+		recvBytesCount += shard->recvBytesCount;
+		ackCount += shard->ackCount;
+		max_payload_size = max(max_payload_size, shard->max_payload_size);
+		delete shard;
+	}
+	shards.clear();
+}
+
+/* Returns the shard of the connection the packet belongs to */
+size_t Dump::getShard(const u_char *data, u_int link_layer_header_size, uint8_t kind)
+{
+	const sniff_ip *ip = (sniff_ip*) (data + link_layer_header_size);
+	const sniff_tcp *tcp = (sniff_tcp*) (data + link_layer_header_size + IP_HL(ip) * 4);
+	in_addr srcIpAddr = ip->ip_src;
+	in_addr dstIpAddr = ip->ip_dst;
+
+	if (kind == PACKET_RECVD)
+		substituteNatAddrs(srcIpAddr, dstIpAddr);
+
+	// The hash is the same in both directions, so ACKs go to the shard of their connection
+	return ConnectionTable::hash(srcIpAddr, dstIpAddr, tcp->th_sport, tcp->th_dport) % shards.size();
+}
+
+/*
+  Read the packets on this thread and hand them to one worker thread per shard.
+  All the packets of a connection go to the same worker, in capture order.
+  With the sent and ACK filters given, the packets are classified for the
+  single-pass analysis, otherwise all packets are of the given kind.
+  Returns the number of packets dispatched.
+ */
+llint_t Dump::dispatchPackets(PcapReader &reader, u_int link_layer_header_size, PacketFilter *sentFilter, PacketFilter *ackFilter, uint8_t kind)
+{
+	struct Worker {
+		BatchQueue filled;
+		BatchQueue free;
+		vector<PacketBatch> batches;
+		PacketBatch *current;
+		HeaderBatch decoded;
+		thread thr;
+	};
+	vector<unique_ptr<Worker> > workers;
+	bool sender = !(kind & PACKET_RECVD);
+
+	for (Dump *shard : shards) {
+		Worker *worker = new Worker();
+		workers.push_back(unique_ptr<Worker>(worker));
+		worker->batches.resize(PACKET_BATCHES_PER_WORKER);
+		for (PacketBatch &batch : worker->batches)
+			worker->free.push(&batch);
+		worker->current = worker->free.pop();
+		worker->current->count = 0;
+
+		worker->thr = thread([worker, shard, link_layer_header_size, sender]() {
+			PacketBatch *batch;
+			while ((batch = worker->filled.pop()) != NULL) {
+				HeaderBatch &decoded = worker->decoded;
+				decoded.clear();
+				for (uint32_t i = 0; i < batch->count; i++)
+					decoded.add(&batch->packets[i].header, batch->packets[i].data, batch->packets[i].kind, false);
+				decoded.decode(link_layer_header_size);
+
+				for (uint32_t i = 0; i < decoded.count; i++)
+					shard->processQueuedPacket(decoded, i);
+				worker->free.push(batch);
+			}
+			if (sender) {
+				if (GlobOpts::single_pass)
+					shard->processPendingAcks(0, link_layer_header_size, true);
+				shard->validateRanges();
+			}
+			else {
+				shard->joinRecvd();
+			}
+		});
+	}
+
+	pcap_pkthdr header;
+	const u_char *data;
+	llint_t count = 0;
+	bool mapped = reader.isMapped();
+
+	while ((data = reader.next(&header)) != NULL) {
+		uint8_t packet_kind = kind;
+		if (sentFilter != NULL) {
+			packet_kind = 0;
+			if (reader.match(*sentFilter, &header, data))
+				packet_kind |= PACKET_SENT;
+			if (reader.match(*ackFilter, &header, data))
+				packet_kind |= PACKET_ACK;
+			if (!packet_kind)
+				continue;
 		}
-	} while (data != NULL);
 
-	pcap_close(fd2);
+		// Throughput is relative to the first packet sent on any connection
+		if ((packet_kind & PACKET_SENT) && !first_sent_time) {
+			first_sent_time = pcap_tstamp(&header);
+			for (Dump *shard : shards)
+				shard->first_sent_time = first_sent_time;
+		}
+
+		Worker *worker = workers[getShard(data, link_layer_header_size, packet_kind)].get();
+		QueuedPacket &packet = worker->current->packets[worker->current->count++];
+		packet.header = header;
+		packet.kind = packet_kind;
+
+		// Packets read through libpcap are only valid until the next is read
+		if (mapped) {
+			packet.data = data;
+		}
+		else if (GlobOpts::look_for_get_request) {
+			// The payload is kept as well, so the whole packet is copied
+			packet.whole.assign(data, data + header.caplen);
+			packet.data = packet.whole.data();
+		}
+		else {
+			packet.header.caplen = min(header.caplen, (bpf_u_int32) sizeof(packet.copy));
+			memcpy(packet.copy, data, packet.header.caplen);
+			packet.data = packet.copy;
+		}
+
+		if (worker->current->count == PACKET_BATCH_SIZE) {
+			worker->filled.push(worker->current);
+			worker->current = worker->free.pop();
+			worker->current->count = 0;
+		}
+		count++;
+	}
+
+	for (auto &worker : workers) {
+		if (worker->current->count)
+			worker->filled.push(worker->current);
+		worker->filled.push(NULL);
+	}
+	for (auto &worker : workers)
+		worker->thr.join();
+
+	return count;
+}
+
+void Dump::processQueuedPacket(const HeaderBatch &batch, uint32_t i)
+{
+	if (batch.kind[i] & PACKET_RECVD)
+		processRecvd(batch, i);
+	else if (GlobOpts::single_pass)
+		processSenderPacket(batch, i);
+	else if (batch.kind[i] & PACKET_SENT)
+		processSent(batch, i);
+	else
+		processAcks(batch, i);
+}
+
+/* Returns the shard of the connection from srcIpAddr:srcPort to dstIpAddr:dstPort */
+size_t Dump::getSpoolShard(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort)
+{
+	ConnectionMapKey key;
+	key.ip_src = srcIpAddr;
+	key.ip_dst = dstIpAddr;
+	key.src_port = srcPort;
+	key.dst_port = dstPort;
+	return (size_t) (upper_bound(shardStart.begin(), shardStart.end(), key, ConnectionKeyComparator()) - shardStart.begin());
+}
+
+/* Bytes of a packet kept in the run files: the headers, and the payload when looking for GET requests */
+static uint32_t get_spool_caplen(const HeaderBatch &batch, uint32_t i)
+{
+	if (GlobOpts::look_for_get_request)
+		return batch.header[i].caplen;
+	return min(batch.header[i].caplen, (bpf_u_int32) (batch.link_header_size + batch.ip_hdr_len[i] + batch.tcp_hdr_len[i]));
+}
+
+/*
+  Split the sender dump, and the receiver dump, into shards of whole
+  connections written to temporary run files (--out-of-core).
+  The shards are ranges of connection keys, so analysing them in turn with
+  analyseShards() writes the connections in the same order as the
+  in-memory analysis.
+ */
+void Dump::spoolShards(string recvFn)
+{
+	spoolSender();
+
+	if (GlobOpts::withRecv)
+		spoolRecvd(recvFn);
+}
+
+/*
+  Read the sender dump twice: the first pass counts the packets of each
+  connection to split the connections into shards of about the same size,
+  the second writes the packets to the run file of their shard.
+ */
+void Dump::spoolSender()
+{
+	PacketFilter sentFilter, ackFilter;
+	setSentFilter(sentFilter);
+	setAckFilter(ackFilter);
+
+	vbprintf(1, "using pcap filter expression: '%s'\n", sentFilter.getExpression().c_str());
+	vbprintf(1, "Using pcap filter expression: '%s'\n", ackFilter.getExpression().c_str());
 
 	if (DEBUGL_SENDER(1)) {
-		printf("Finished processing acknowledgements...\n");
+		colored_printf(YELLOW, "Splitting sender trace into shards...\n");
 	}
 
-	if (GlobOpts::validate_ranges) {
-		auto it_end = conns.end();
-		for (auto it = conns.begin(); it != it_end; it++) {
-			it->second->validateRanges();
+	unique_ptr<HeaderBatch> batch(new HeaderBatch());
+	map<ConnectionMapKey, ullint_t, ConnectionKeyComparator> connPackets;
+	ullint_t total = 0;
+	{
+		PcapReader reader(filename);
+		u_int link_layer_header_size = get_link_layer_header_size(reader.getLinkType());
+
+		while (batch->read(reader, 0, link_layer_header_size)) {
+			for (uint32_t i = 0; i < batch->count; i++) {
+				if (reader.match(sentFilter, &batch->header[i], batch->data[i])) {
+					ConnectionMapKey key = { batch->ip_src[i], batch->ip_dst[i], batch->src_port[i], batch->dst_port[i] };
+					connPackets[key]++;
+					total++;
+					// Throughput is relative to the first packet sent on any connection
+					if (!first_sent_time)
+						first_sent_time = pcap_tstamp(&batch->header[i]);
+				}
+				if (reader.match(ackFilter, &batch->header[i], batch->data[i])) {
+					ConnectionMapKey key = { batch->ip_dst[i], batch->ip_src[i], batch->dst_port[i], batch->src_port[i] };
+					auto it = connPackets.find(key);
+					if (it != connPackets.end()) {
+						it->second++;
+						total++;
+					}
+				}
+			}
+		}
+	}
+
+	size_t shardCount = min(GlobOpts::out_of_core_shards, max(connPackets.size(), (size_t) 1));
+	ullint_t seen = 0;
+	for (auto &it : connPackets) {
+		if (shardStart.size() + 1 < shardCount && seen >= total * (shardStart.size() + 1) / shardCount)
+			shardStart.push_back(it.first);
+		seen += it.second;
+	}
+	connPackets.clear();
+
+	PcapReader reader(filename);
+	u_int link_layer_header_size = get_link_layer_header_size(reader.getLinkType());
+	sentSpool.reset(new ShardSpool(shardStart.size() + 1, link_layer_header_size));
+
+	while (batch->read(reader, 0, link_layer_header_size)) {
+		for (uint32_t i = 0; i < batch->count; i++) {
+			uint8_t kind = 0;
+			size_t sentShard = 0, ackShard = 0;
+			if (reader.match(sentFilter, &batch->header[i], batch->data[i])) {
+				kind |= PACKET_SENT;
+				sentShard = getSpoolShard(batch->ip_src[i], batch->ip_dst[i], batch->src_port[i], batch->dst_port[i]);
+			}
+			if (reader.match(ackFilter, &batch->header[i], batch->data[i])) {
+				kind |= PACKET_ACK;
+				ackShard = getSpoolShard(batch->ip_dst[i], batch->ip_src[i], batch->dst_port[i], batch->src_port[i]);
+			}
+
+			uint32_t caplen = get_spool_caplen(*batch, i);
+			if (kind == (PACKET_SENT | PACKET_ACK) && sentShard != ackShard) {
+				sentSpool->write(sentShard, &batch->header[i], batch->data[i], caplen, PACKET_SENT);
+				sentSpool->write(ackShard, &batch->header[i], batch->data[i], caplen, PACKET_ACK);
+			}
+			else if (kind) {
+				sentSpool->write((kind & PACKET_SENT) ? sentShard : ackShard, &batch->header[i], batch->data[i], caplen, kind);
+			}
 		}
 	}
+
+	vbprintf(1, "Split sender trace into %zu shards\n", sentSpool->size());
 }
 
+/* Write the segments in the receiver dump to the run file of their shard */
+void Dump::spoolRecvd(string recvFn)
+{
+	llint_t packetCount = 0;
+	PacketFilter filter;
+	setRecvFilter(filter);
+
+	if (DEBUGL_SENDER(1)) {
+		colored_printf(YELLOW, "Splitting receiver trace into shards...\n");
+		printf("Using filter: '%s'\n", filter.getExpression().c_str());
+	}
+
+	PcapReader reader(recvFn);
+	u_int link_layer_header_size = get_link_layer_header_size(reader.getLinkType());
+	reader.setFilter(filter);
+	recvSpool.reset(new ShardSpool(sentSpool->size(), link_layer_header_size));
+
+	unique_ptr<HeaderBatch> batch(new HeaderBatch());
+	while (batch->read(reader, PACKET_RECVD, link_layer_header_size)) {
+		for (uint32_t i = 0; i < batch->count; i++) {
+			in_addr srcIpAddr = batch->ip_src[i];
+			in_addr dstIpAddr = batch->ip_dst[i];
+			substituteNatAddrs(srcIpAddr, dstIpAddr);
+			size_t shard = getSpoolShard(srcIpAddr, dstIpAddr, batch->src_port[i], batch->dst_port[i]);
+			recvSpool->write(shard, &batch->header[i], batch->data[i], get_spool_caplen(*batch, i), PACKET_RECVD);
+		}
+		packetCount += batch->count;
+	}
+
+	if (packetCount == 0) {
+		fprintf(stderr, "No packets found in trace!\n");
+	}
+}
+
+/*
+  Analyse the shards written by spoolShards() one at a time. The connections
+  of each shard are analysed as by the in-memory analysis, then written with
+  the Statistics given to setFinishedStats(), and freed.
+ */
+void Dump::analyseShards()
+{
+	for (size_t shard = 0; shard < sentSpool->size(); shard++) {
+		vbprintf(2, "Analysing shard %zu of %zu (%llu packets)\n", shard + 1, sentSpool->size(),
+				 sentSpool->count(shard) + (recvSpool ? recvSpool->count(shard) : 0));
+
+		analyseShard(shard);
+
+		calculateRetransAndRDBStats();
+
+		if (GlobOpts::withRecv && (GlobOpts::withCDF || GlobOpts::oneway_delay_variance || GlobOpts::print_packets))
+			calculateLatencyVariation();
+
+		if (GlobOpts::print_packets)
+			printPacketDetails();
+
+		finishedStats->finishShard();
+
+		for (auto &it : conns) {
+			freedRanges.add(it.second);
+			delete it.second;
+		}
+		conns.clear();
+	}
+}
+
+/* Process the packets of a shard the same way as analyseSender() and processRecvd() */
+void Dump::analyseShard(size_t shard)
+{
+	unique_ptr<HeaderBatch> batch(new HeaderBatch());
+
+	sentSpool->rewind(shard);
+	if (GlobOpts::single_pass) {
+		while (sentSpool->read(shard, *batch)) {
+			for (uint32_t i = 0; i < batch->count; i++)
+				processSenderPacket(*batch, i);
+		}
+		processPendingAcks(0, sentSpool->getLinkHeaderSize(), true);
+	}
+	else {
+		while (sentSpool->read(shard, *batch)) {
+			for (uint32_t i = 0; i < batch->count; i++) {
+				if (batch->kind[i] & PACKET_SENT)
+					processSent(*batch, i);
+			}
+		}
+		validateRanges();
+
+		sentSpool->rewind(shard);
+		while (sentSpool->read(shard, *batch)) {
+			for (uint32_t i = 0; i < batch->count; i++) {
+				if (batch->kind[i] & PACKET_ACK)
+					processAcks(*batch, i);
+			}
+		}
+	}
+	sentSpool->close(shard);
+	validateRanges();
+
+	if (recvSpool) {
+		recvSpool->rewind(shard);
+		while (recvSpool->read(shard, *batch)) {
+			for (uint32_t i = 0; i < batch->count; i++)
+				processRecvd(*batch, i);
+		}
+		recvSpool->close(shard);
+		joinRecvd();
+	}
+}
+
+/* Hold back the ACK, with the connection it is for, or NULL if the connection is not seen yet */
+void Dump::deferAck(const HeaderBatch &batch, uint32_t i, Connection *conn)
+{
+	deque<PendingAck> &acks = conn != NULL ? pendingAcks : orphanAcks;
+	acks.push_back(PendingAck());
+	PendingAck &pending = acks.back();
+	pending.header = batch.header[i];
+	pending.header.caplen = min(batch.header[i].caplen, (bpf_u_int32) sizeof(pending.data));
+	memcpy(pending.data, batch.data[i], pending.header.caplen);
+	pending.conn = conn;
+	pending.key = connTupleKey(batch.ip_dst[i], batch.ip_src[i], batch.dst_port[i], batch.src_port[i]);
+	pending.ack = batch.ack[i];
+	pending.processed = false;
+
+	if (conn != NULL) {
+		pendingConnAcks[conn].push_back(&pending);
+		pendingAckCount++;
+	}
+	else {
+		orphanConnAcks[pending.key].push_back(&pending);
+		orphanAckCount++;
+	}
+}
+
+/* Process a deferred ACK, which must be the first held back for its connection */
+void Dump::processPendingAck(PendingAck &pending, u_int link_layer_header_size)
+{
+	pendingBatch->clear();
+	pendingBatch->add(&pending.header, pending.data, PACKET_ACK, false);
+	pendingBatch->decode(link_layer_header_size);
+	processAcks(*pendingBatch, 0);
+	pending.processed = true;
+
+	if (pending.conn != NULL) {
+		pendingAckCount--;
+		map<Connection*, deque<PendingAck*> >::iterator it = pendingConnAcks.find(pending.conn);
+		it->second.pop_front();
+		if (it->second.empty())
+			pendingConnAcks.erase(it);
+	}
+	else {
+		orphanAckCount--;
+		map<ConnTupleKey, deque<PendingAck*> >::iterator it = orphanConnAcks.find(pending.key);
+		it->second.pop_front();
+		if (it->second.empty())
+			orphanConnAcks.erase(it);
+	}
+}
+
+/* Process the ACKs held back for the connection, up to the first that acknowledges data not yet registered */
+void Dump::processReadyAcks(Connection *conn, u_int link_layer_header_size)
+{
+	map<Connection*, deque<PendingAck*> >::iterator it;
+	while ((it = pendingConnAcks.find(conn)) != pendingConnAcks.end() &&
+		   ackIsReady(conn, it->second.front()->ack)) {
+		processPendingAck(*it->second.front(), link_layer_header_size);
+	}
+}
+
+/*
+  The ACKs held back before the connection was seen are moved to the
+  ACKs held back for the connection. They precede any ACK held back
+  for it, which were all read after the connection was seen.
+ */
+void Dump::adoptOrphanAcks(Connection *conn, const ConnTupleKey &key)
+{
+	map<ConnTupleKey, deque<PendingAck*> >::iterator it = orphanConnAcks.find(key);
+	if (it == orphanConnAcks.end())
+		return;
+
+	deque<PendingAck*> &connAcks = pendingConnAcks[conn];
+	for (PendingAck *orphan : it->second) {
+		pendingAcks.push_back(*orphan);
+		pendingAcks.back().conn = conn;
+		connAcks.push_back(&pendingAcks.back());
+		orphan->processed = true;
+		orphanAckCount--;
+		pendingAckCount++;
+	}
+	orphanConnAcks.erase(it);
+}
+
+/*
+  Process the oldest deferred ACKs of the buffer that are older than the
+  reorder window, or pushed out of it, whether their data is registered
+  or not. With flush, all are processed.
+ */
+void Dump::expirePendingAcks(deque<PendingAck> &acks, size_t count, tstamp_t now, u_int link_layer_header_size, bool flush)
+{
+	size_t overflow = 0;
+	if (count > MAX_PENDING_ACKS)
+		overflow = count - MAX_PENDING_ACKS;
+
+	while (!acks.empty()) {
+		PendingAck &pending = acks.front();
+		if (!pending.processed) {
+			bool expired = flush || overflow > 0 || TS_TO_MS(now - pcap_tstamp(&pending.header)) > PENDING_ACK_WINDOW_MS;
+			if (!expired)
+				break;
+
+			// The ACKs captured before it on the connection are already processed
+			Connection *conn = pending.conn;
+			processPendingAck(pending, link_layer_header_size);
+			if (conn != NULL)
+				processReadyAcks(conn, link_layer_header_size);
+			if (overflow > 0)
+				overflow--;
+		}
+		acks.pop_front();
+	}
+}
+
+/*
+  Process the deferred ACKs that have expired. The ACKs that are ready are
+  processed by processReadyAcks() as soon as their data is registered, so
+  only the oldest ACKs are looked at. ACKs for connections not seen yet are
+  kept in their own buffer, so they do not push the others out.
+ */
+void Dump::processPendingAcks(tstamp_t now, u_int link_layer_header_size, bool flush)
+{
+	expirePendingAcks(orphanAcks, orphanAckCount, now, link_layer_header_size, flush);
+	expirePendingAcks(pendingAcks, pendingAckCount, now, link_layer_header_size, flush);
+}
 
 void Dump::parseTCPOptions(DataSeg* data, uint8_t* opts, uint option_length,
 						   Connection* tmpConn = NULL,
@@ -324,12 +1100,12 @@ void Dump::parseTCPOptions(DataSeg* data, uint8_t* opts, uint option_length,
 		if (_opt->kind == 5 && seq_type != RELSEQ_NONE) {  /* SACK */
 			int blocks = (_opt->size - 2) / 8;
 			data->sacks = true;
-			for (int i = 0; i < blocks; i++) {
-				seq32_t leftin = ntohl(*(((uint32_t*) (opts + offset + 2 + (4 * blocks * i)))));
-				seq32_t rightin = ntohl(*(((uint32_t*) (opts + offset + 6  + (4 * blocks * i)))));
+			for (int i = 0; i < blocks && !data->tcp_sacks.full(); i++) {
+				seq32_t leftin = ntohl(*(((uint32_t*) (opts + offset + 2 + (8 * i)))));
+				seq32_t rightin = ntohl(*(((uint32_t*) (opts + offset + 6 + (8 * i)))));
 				seq64_t left = tmpConn->getRelativeSequenceNumber(leftin, RELSEQ_SEND_ACK);
 				seq64_t right = tmpConn->getRelativeSequenceNumber(rightin, RELSEQ_SEND_ACK);
-				data->tcp_sacks.push_back(pair<uint64_t, uint32_t>(left, right));
+				data->tcp_sacks.push_back(left, right);
 			}
 		}
 		offset += _opt->size;
@@ -337,23 +1113,14 @@ void Dump::parseTCPOptions(DataSeg* data, uint8_t* opts, uint option_length,
 }
 
 /* Process outgoing packets */
-void Dump::processSent(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size) {
-	//const sniff_ethernet *ethernet; /* The ethernet header */
-	const sniff_ip *ip; /* The IP header */
-	const sniff_tcp *tcp; /* The TCP header */
-	u_int ipSize;
-	u_int ipHdrLen;
-	u_int tcpHdrLen;
-
-	/* Finds the different headers+payload */
-	//ethernet = (sniff_ethernet*) data;
-	ip = (sniff_ip*) (data + link_layer_header_size);
-	ipSize = ntohs(ip->ip_len);
-	ipHdrLen = IP_HL(ip) * 4;
-	tcp = (sniff_tcp*) (data + link_layer_header_size + ipHdrLen);
-	tcpHdrLen = TH_OFF(tcp) * 4;
+void Dump::processSent(const HeaderBatch &batch, uint32_t i) {
+	const pcap_pkthdr *header = &batch.header[i];
+	u_int link_layer_header_size = batch.link_header_size;
+	u_int ipSize = batch.ip_len[i];
+	u_int ipHdrLen = batch.ip_hdr_len[i];
+	u_int tcpHdrLen = batch.tcp_hdr_len[i];
 
-	Connection* tmpConn = getConn(ip->ip_src, ip->ip_dst, &tcp->th_sport, &tcp->th_dport, &tcp->th_seq);
+	Connection* tmpConn = getConn(batch.ip_src[i], batch.ip_dst[i], &batch.src_port[i], &batch.dst_port[i], &batch.seq[i]);
 
 	/* Prepare packet data struct */
 	sendData sd;
@@ -363,17 +1130,17 @@ void Dump::processSent(const pcap_pkthdr* header, const u_char *data, u_int link
 	sd.tcpHdrLen           = tcpHdrLen;
 	sd.tcpOptionLen        = tcpHdrLen - 20;
 	sd.data.payloadSize    = static_cast<uint16_t>(sd.totalSize - (ipHdrLen + tcpHdrLen + link_layer_header_size));
-	sd.data.tstamp_pcap    = header->ts;
-	sd.data.seq_absolute   = ntohl(tcp->th_seq);
+	sd.data.tstamp_pcap    = pcap_tstamp(header);
+	sd.data.seq_absolute   = batch.seq[i];
 	sd.data.seq            = tmpConn->getRelativeSequenceNumber(sd.data.seq_absolute, RELSEQ_SEND_OUT);
 	sd.data.endSeq         = sd.data.seq + sd.data.payloadSize;
 	sd.data.retrans        = false;
 	sd.data.is_rdb         = false;
 	sd.data.sacks          = false;
 	sd.data.rdb_end_seq    = 0;
-	sd.data.flags          = tcp->th_flags;
-	sd.data.tstamp_tcp      = 0;
-	sd.data.tstamp_tcp_echo = 0;
+	sd.data.flags          = batch.flags[i];
+	sd.data.tstamp_tcp      = batch.tstamp_tcp[i];
+	sd.data.tstamp_tcp_echo = batch.tstamp_tcp_echo[i];
 
 	uint32_t payloadSize = ipSize - (ipHdrLen + tcpHdrLen); // This gives incorrect result on some packets where the ipSize is wrong (0 in a test trace)
 	if (sd.data.payloadSize != payloadSize) {
@@ -408,18 +1175,18 @@ void Dump::processSent(const pcap_pkthdr* header, const u_char *data, u_int link
 		return;
 	}
 
-	if (first_sent_time.tv_sec == 0 && first_sent_time.tv_usec == 0) {
-		first_sent_time = header->ts;
+	if (!first_sent_time) {
+		first_sent_time = sd.data.tstamp_pcap;
 	}
 
-	uint8_t* opt = (uint8_t*) tcp + 20;
-	parseTCPOptions(&sd.data, opt, sd.tcpOptionLen);
+	if (batch.parse_options[i])
+		parseTCPOptions(&sd.data, batch.getOptions(i), sd.tcpOptionLen);
 
 	/* define/compute tcp payload (segment) offset */
 	//sd.data.data = (u_char *) (data + link_layer_header_size + ipHdrLen + tcpHdrLen);
 
 	if (GlobOpts::look_for_get_request)
-		look_for_get_request(header, data, link_layer_header_size);
+		look_for_get_request(header, batch.data[i], link_layer_header_size);
 
 	sentPacketCount++;
 	sentBytesCount += sd.data.payloadSize;
@@ -435,49 +1202,46 @@ void Dump::processSent(const pcap_pkthdr* header, const u_char *data, u_int link
 	}
 
 	if (tmpConn->registerSent(&sd)) {
+		seq32_t sentSeqEnd = sd.data.seq_absolute + sd.data.payloadSize + !!(sd.data.flags & (TH_SYN | TH_FIN));
+		if (after(sentSeqEnd, tmpConn->sentSeqEndAbsolute))
+			tmpConn->sentSeqEndAbsolute = sentSeqEnd;
+
 		tmpConn->registerRange(&sd);
 
 		if (GlobOpts::withThroughput) {
-			tmpConn->registerPacketSize(first_sent_time, header->ts, header->len, sd.data.payloadSize, sd.data.retrans);
+			tmpConn->registerPacketSize(first_sent_time, sd.data.tstamp_pcap, header->len, sd.data.payloadSize, sd.data.retrans);
 		}
 	}
+	checkFinished(tmpConn, batch, i, true);
 }
 
 
 
 /* Process incoming ACKs */
-void Dump::processAcks(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size) {
-	static const sniff_ip *ip; /* The IP header */
-	static const sniff_tcp *tcp; /* The TCP header */
-	static u_int ipHdrLen;
-	static seq32_t ack;
-	//static u_long eff_win;        /* window after scaling */
-	static bool ret;
-	ip = (sniff_ip*) (data + link_layer_header_size);
-	ipHdrLen = IP_HL(ip) * 4;
-	tcp = (sniff_tcp*) (data + link_layer_header_size + ipHdrLen);
-
-	static u_int tcpHdrLen;
-	static uint tcpOptionLen;
-	tcpHdrLen = TH_OFF(tcp) * 4;
-	tcpOptionLen = tcpHdrLen - 20;
+void Dump::processAcks(const HeaderBatch &batch, uint32_t i) {
+	seq32_t ack;
+	//u_long eff_win;        /* window after scaling */
+	bool ret;
+	uint tcpOptionLen = batch.getOptionLen(i);
 
-	Connection *tmpConn = getConn(ip->ip_dst, ip->ip_src, &tcp->th_dport, &tcp->th_sport, NULL);
+	Connection *tmpConn = getReverseConn(batch.ip_src[i], batch.ip_dst[i], &batch.src_port[i], &batch.dst_port[i]);
 
 	// It should not be possible that the connection is not yet created
 	// If lingering ack arrives for a closed connection, this may happen
 	if (tmpConn == NULL) {
-		cerr << "Ack for unregistered connection found. Ignoring. Conn: " << makeConnKey(ip->ip_src, ip->ip_dst, &tcp->th_sport, &tcp->th_dport) << endl;
+		cerr << "Ack for unregistered connection found. Ignoring. Conn: " << makeConnKey(batch.ip_src[i], batch.ip_dst[i], &batch.src_port[i], &batch.dst_port[i]) << endl;
 		return;
 	}
-	ack = ntohl(tcp->th_ack);
+	ack = batch.ack[i];
 
 	DataSeg seg;
 	memset(&seg, 0, sizeof(DataSeg));
 	seg.ack         = tmpConn->getRelativeSequenceNumber(ack, RELSEQ_SEND_ACK);
-	seg.tstamp_pcap = header->ts;
-	seg.window = ntohs(tcp->th_win);
-	seg.flags  = tcp->th_flags;
+	seg.tstamp_pcap = pcap_tstamp(&batch.header[i]);
+	seg.window = batch.window[i];
+	seg.flags  = batch.flags[i];
+	seg.tstamp_tcp      = batch.tstamp_tcp[i];
+	seg.tstamp_tcp_echo = batch.tstamp_tcp_echo[i];
 
 	if (seg.ack == std::numeric_limits<ulong>::max()) {
 		if (tmpConn->closed) {
@@ -487,11 +1251,12 @@ void Dump::processAcks(const pcap_pkthdr* header, const u_char *data, u_int link
 			dclfprintf(stderr, DSENDER, 1, RED, "Invalid sequence number for ACK(%u)! (SYN=%d) on connection: %s\n",
 					   ack, !!(seg.flags & TH_SYN), tmpConn->getConnKey().c_str());
 		}
+		checkFinished(tmpConn, batch, i, false);
 		return;
 	}
 
-	uint8_t* opt = (uint8_t*) tcp + 20;
-	parseTCPOptions(&seg, opt, tcpOptionLen, tmpConn, RELSEQ_SEND_ACK);
+	if (batch.parse_options[i])
+		parseTCPOptions(&seg, batch.getOptions(i), tcpOptionLen, tmpConn, RELSEQ_SEND_ACK);
 
 	ret = tmpConn->registerAck(&seg);
 	if (!ret) {
@@ -506,165 +1271,266 @@ void Dump::processAcks(const pcap_pkthdr* header, const u_char *data, u_int link
 		tmpConn->lastLargestAckSeq = seg.ack;
 	}
 	ackCount++;
+	checkFinished(tmpConn, batch, i, false);
 }
 
 /* Analyse receiver dump */
-void Dump::processRecvd(string recvFn) {
-	int packetCount = 0;
+/* Set up the filter for the incoming tcp packets with correct IP and port numbers */
+void Dump::setRecvFilter(PacketFilter &filter)
+{
 	string tmpSrcIp = filterSrcIp;
 	string tmpDstIp = filterDstIp;
-	char errbuf[PCAP_ERRBUF_SIZE];
-	pcap_pkthdr h;
-	const u_char *data;
+
+	if (!GlobOpts::sendNatIP.empty())
+		tmpSrcIp = GlobOpts::sendNatIP;
+	if (!GlobOpts::recvNatIP.empty())
+		tmpDstIp = GlobOpts::recvNatIP;
+
+	if (!tmpSrcIp.empty())
+		filter.addSrcHost(tmpSrcIp);
+	if (!tmpDstIp.empty())
+		filter.addDstHost(tmpDstIp);
+	if (!filterTCPIp.empty())
+		filter.addHost(filterTCPIp);
+
+	if (!filterSrcPort.empty())
+		filter.addSrcPort(filterSrcPort);
+	if (!filterDstPort.empty())
+		filter.addDstPort(filterDstPort);
+
+	//filterExp << " && (ip[2:2] - ((ip[0]&0x0f)<<2) - (tcp[12]>>2)) >= 1";
+}
+
+/* Connections are keyed on the addresses before NAT, so replace the NAT addresses seen in the receiver dump */
+void Dump::substituteNatAddrs(in_addr &srcIpAddr, in_addr &dstIpAddr)
+{
+	if (!GlobOpts::sendNatIP.empty())
+		srcIpAddr = filterSrcAddr;
+	if (!GlobOpts::recvNatIP.empty())
+		dstIpAddr = filterDstAddr;
+}
+
+/*
+  Start reading the receiver dump on a thread of its own, so it is decoded
+  while the sender dump is analysed. processRecvd() processes the segments.
+  Looking for GET requests needs the payload, so the receiver dump is then
+  left to processRecvd() to read.
+ */
+void Dump::startRecvd(string recvFn) {
+	if (GlobOpts::look_for_get_request)
+		return;
+
+	recvStaging.reset(new RecvdStaging());
+	recvStaging->reader.reset(new PcapReader(recvFn));
+	recvStaging->filter.reset(new PacketFilter());
+	setRecvFilter(*recvStaging->filter);
+	recvStaging->reader->setFilter(*recvStaging->filter);
+	recvStaging->count = 0;
+	recvStaging->thr = thread(&Dump::stageRecvd, this);
+}
+
+/*
+  Runs on the staging thread: decode the receiver dump and sort the segments
+  into shards. Stops once MAX_STAGED_RECVD_SEGMENTS are staged, leaving the
+  reader at the first segment not staged.
+ */
+void Dump::stageRecvd() {
+	RecvdStaging &staging = *recvStaging;
+	staging.link_header_size = get_link_layer_header_size(staging.reader->getLinkType());
+	size_t shard_count = (size_t) GlobOpts::threads;
+	staging.shard_segs.resize(shard_count);
+
+	unique_ptr<HeaderBatch> batch(new HeaderBatch());
+	while (staging.count < MAX_STAGED_RECVD_SEGMENTS) {
+		if (!batch->read(*staging.reader, PACKET_RECVD, staging.link_header_size)) {
+			// The whole dump is staged
+			staging.reader.reset();
+			staging.filter.reset();
+			break;
+		}
+
+		for (uint32_t i = 0; i < batch->count; i++) {
+			size_t shard = 0;
+			if (shard_count > 1) {
+				in_addr srcIpAddr = batch->ip_src[i];
+				in_addr dstIpAddr = batch->ip_dst[i];
+				substituteNatAddrs(srcIpAddr, dstIpAddr);
+				shard = ConnectionTable::hash(srcIpAddr, dstIpAddr, batch->src_port[i], batch->dst_port[i]) % shard_count;
+			}
+			staging.shard_segs[shard].push_back(RecvdSegment());
+			getRecvdSegment(*batch, i, staging.shard_segs[shard].back());
+		}
+		staging.count += batch->count;
+	}
+}
+
+/* Process the segments staged by the staging thread, one worker thread per shard */
+void Dump::processStagedRecvd(bool join) {
+	RecvdStaging &staging = *recvStaging;
+
+	if (GlobOpts::threads > 1) {
+		vector<thread> workers;
+		for (size_t k = 0; k < shards.size(); k++) {
+			workers.push_back(thread([this, &staging, k, join]() {
+				for (const RecvdSegment &seg : staging.shard_segs[k])
+					shards[k]->processRecvd(seg, staging.link_header_size, NULL, NULL);
+				if (join)
+					shards[k]->joinRecvd();
+			}));
+		}
+		for (thread &worker : workers)
+			worker.join();
+	}
+	else {
+		for (const RecvdSegment &seg : staging.shard_segs[0])
+			processRecvd(seg, staging.link_header_size, NULL, NULL);
+	}
+
+	// Released before the rest of the dump is read
+	vector<deque<RecvdSegment> >().swap(staging.shard_segs);
+}
+
+void Dump::processRecvd(string recvFn) {
+	llint_t packetCount = 0;
 
 	if (DEBUGL_SENDER(1)) {
 		colored_printf(YELLOW, "Processing receiver trace...\n");
 	}
 
 	if (!GlobOpts::sendNatIP.empty()) {
-		tmpSrcIp = GlobOpts::sendNatIP;
 		dfprintf(stderr, DRECEIVER, 1, "Sender side NATing handled. srcIp: %s, tmpSrcIp: %s\n",
-				 filterSrcIp.c_str(), tmpSrcIp.c_str());
+				 filterSrcIp.c_str(), GlobOpts::sendNatIP.c_str());
 	}
 
 	if (!GlobOpts::recvNatIP.empty()) {
-		tmpDstIp = GlobOpts::recvNatIP;
 		dfprintf(stderr, DRECEIVER, 1, "Receiver side NATing handled. filterDstIp: %s, tmpDstIp: %s\n",
-				 filterDstIp.c_str(), tmpDstIp.c_str());
+				 filterDstIp.c_str(), GlobOpts::recvNatIP.c_str());
 	}
 
-	pcap_t *fd = pcap_open_offline(recvFn.c_str(), errbuf);
-	if (fd == NULL) {
-		cerr << "pcap: Could not open file: " << recvFn << endl;
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
-	}
-
-	int type = pcap_datalink(fd);
-	u_int link_layer_header_size;
-
-	switch (type) {
-	case DLT_EN10MB: {
-		link_layer_header_size = SIZE_ETHERNET;
-		break;
-	}
-	case DLT_LINUX_SLL: {
-		link_layer_header_size = SIZE_HEADER_LINUX_COOKED_MODE;
-		break;
-	}
-	default: {
-		fprintf(stderr, "Unsupported link layer type: %d ('%s')\n", type, pcap_datalink_val_to_name(type));
-		exit(1);
-	}
-	}
-
-
 	/* Set up pcap filter to include only incoming tcp
 	   packets with correct IP and port numbers.
 	   We exclude packets with no TCP payload. */
-	bpf_program compFilter;
-	stringstream filterExp;
+	PacketFilter filter;
+	setRecvFilter(filter);
 
-	bool src_port_range = !isNumeric(filterSrcPort.c_str(), 10);
-	bool dst_port_range = !isNumeric(filterDstPort.c_str(), 10);
-
-	filterExp.str("");
-	filterExp << "tcp";
-	if (!tmpSrcIp.empty())
-		filterExp << " && src host " << tmpSrcIp;
-	if (!tmpDstIp.empty())
-		filterExp << " && dst host " << tmpDstIp;
-	if (!filterTCPIp.empty())
-		filterExp << " && host " << filterTCPIp;
-
-	if (!filterSrcPort.empty())
-		filterExp << " && src " << (src_port_range ? "portrange " : "port ") << filterSrcPort;
-	if (!filterDstPort.empty())
-		filterExp << " && dst " << (dst_port_range ? "portrange " : "port ") << filterDstPort;
-
-	//filterExp << " && (ip[2:2] - ((ip[0]&0x0f)<<2) - (tcp[12]>>2)) >= 1";
-
-	/* Filter to get outgoing packets */
-	if (pcap_compile(fd, &compFilter, (char*)((filterExp.str()).c_str()), 0, 0) == -1) {
-		fprintf(stderr, "Couldn't parse filter '%s'. Error: %s\n", filterExp.str().c_str(), pcap_geterr(fd));
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	if (DEBUGL_SENDER(1)) {
+		printf("Using filter: '%s'\n", filter.getExpression().c_str());
 	}
 
-	if (pcap_setfilter(fd, &compFilter) == -1) {
-		fprintf(stderr, "Couldn't install filter '%s'. Error: %s\n", filterExp.str().c_str(), pcap_geterr(fd));
-		pcap_close(fd);
-		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	PcapReader *reader = NULL;
+	unique_ptr<PcapReader> recvReader;
+	if (recvStaging) {
+		recvStaging->thr.join();
+		packetCount = recvStaging->count;
+		// Left open if not all of the dump was staged
+		reader = recvStaging->reader.get();
 	}
-	pcap_freecode(&compFilter);
-
-	if (DEBUGL_SENDER(1)) {
-		printf("Using filter: '%s'\n", filterExp.str().c_str());
+	else {
+		recvReader.reset(new PcapReader(recvFn));
+		/* Filter to get outgoing packets */
+		recvReader->setFilter(filter);
+		reader = recvReader.get();
 	}
 
-	/* Sniff each sent packet in pcap tracefile: */
-	do {
-		data = (const u_char *) pcap_next(fd, &h);
-		if (data == NULL) {
-			if (packetCount == 0) {
-				fprintf(stderr, "No packets found in trace!\n");
+	if (GlobOpts::threads > 1) {
+		createShards();
+		if (recvStaging)
+			processStagedRecvd(reader == NULL);
+		if (reader != NULL)
+			packetCount += dispatchPackets(*reader, get_link_layer_header_size(reader->getLinkType()), NULL, NULL, PACKET_RECVD);
+		mergeShards();
+	}
+	else {
+		if (recvStaging)
+			processStagedRecvd(false);
+		if (reader != NULL) {
+			u_int link_layer_header_size = get_link_layer_header_size(reader->getLinkType());
+			/* Sniff each sent packet in pcap tracefile: */
+			unique_ptr<HeaderBatch> batch(new HeaderBatch());
+			while (batch->read(*reader, PACKET_RECVD, link_layer_header_size)) {
+				for (uint32_t i = 0; i < batch->count; i++)
+					processRecvd(*batch, i); /* Sniff packet */
+				packetCount += batch->count;
 			}
-			//pcap_perror(fd, errMsg);
-		} else {
-			processRecvd(&h, data, link_layer_header_size); /* Sniff packet */
-			packetCount++;
 		}
-	} while(data != NULL);
+		joinRecvd();
+	}
+	recvStaging.reset();
 
-	pcap_close(fd);
+	if (packetCount == 0) {
+		fprintf(stderr, "No packets found in trace!\n");
+	}
 
 	if (DEBUGL_SENDER(1)) {
 		printf("Finished processing receiver trace...\n");
 	}
 }
 
+/* Read the header fields of the received segment used by processRecvd() */
+void Dump::getRecvdSegment(const HeaderBatch &batch, uint32_t i, RecvdSegment &seg) {
+	seg.tstamp_pcap = pcap_tstamp(&batch.header[i]);
+	seg.ip_src      = batch.ip_src[i];
+	seg.ip_dst      = batch.ip_dst[i];
+	seg.src_port    = batch.src_port[i];
+	seg.dst_port    = batch.dst_port[i];
+	seg.seq         = batch.seq[i];
+	seg.len         = batch.header[i].len;
+	seg.ip_len      = batch.ip_len[i];
+	seg.ip_hdr_len  = batch.ip_hdr_len[i];
+	seg.tcp_hdr_len = batch.tcp_hdr_len[i];
+	seg.flags       = batch.flags[i];
+	seg.window      = batch.window[i];
+	seg.tstamp_tcp      = batch.tstamp_tcp[i];
+	seg.tstamp_tcp_echo = batch.tstamp_tcp_echo[i];
+
+	// Only the timestamps are read from the options of received segments
+	if (batch.parse_options[i]) {
+		DataSeg data;
+		data.tstamp_tcp      = seg.tstamp_tcp;
+		data.tstamp_tcp_echo = seg.tstamp_tcp_echo;
+		parseTCPOptions(&data, batch.getOptions(i), batch.getOptionLen(i));
+		seg.tstamp_tcp      = data.tstamp_tcp;
+		seg.tstamp_tcp_echo = data.tstamp_tcp_echo;
+	}
+}
+
 /* Process packets */
-void Dump::processRecvd(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size) {
-	//const sniff_ethernet *ethernet; /* The ethernet header */
-	const sniff_ip *ip; /* The IP header */
-	const sniff_tcp *tcp; /* The TCP header */
+void Dump::processRecvd(const HeaderBatch &batch, uint32_t i) {
+	RecvdSegment seg;
+	getRecvdSegment(batch, i, seg);
+	processRecvd(seg, batch.link_header_size, &batch.header[i], batch.data[i]);
+}
+
+/* Process a received segment. The packet header and data are only needed to look for GET requests */
+void Dump::processRecvd(const RecvdSegment &seg, u_int link_layer_header_size, const pcap_pkthdr *header, const u_char *data) {
 	Connection *tmpConn;
 
-    /* Finds the different headers+payload */
-//  ethernet = (sniff_ethernet*)(data);
-	ip = (sniff_ip*) (data + link_layer_header_size);
-	u_int ipSize = ntohs(ip->ip_len);
-	u_int ipHdrLen = IP_HL(ip)*4;
-	tcp = (sniff_tcp*) (data + link_layer_header_size + ipHdrLen);
-	u_int tcpHdrLen = TH_OFF(tcp)*4;
+	u_int ipSize = seg.ip_len;
+	u_int ipHdrLen = seg.ip_hdr_len;
+	u_int tcpHdrLen = seg.tcp_hdr_len;
 
-	in_addr srcIpAddr = ip->ip_src;
-	in_addr dstIpAddr = ip->ip_dst;
+	in_addr srcIpAddr = seg.ip_src;
+	in_addr dstIpAddr = seg.ip_dst;
 
-	if (!GlobOpts::sendNatIP.empty()) {
-		srcIpAddr = strToIp(filterSrcIp);
-	}
-
-	if (!GlobOpts::recvNatIP.empty()) {
-		dstIpAddr = strToIp(filterDstIp);
-	}
+	substituteNatAddrs(srcIpAddr, dstIpAddr);
 
-	tmpConn = getConn(srcIpAddr, dstIpAddr, &tcp->th_sport, &tcp->th_dport, NULL);
+	tmpConn = getConn(srcIpAddr, dstIpAddr, &seg.src_port, &seg.dst_port, NULL);
 
 	// It should not be possible that the connection is not yet created
 	// If lingering ack arrives for a closed connection, this may happen
 	if (tmpConn == NULL) {
-		static bool warning_printed = false;
-		if (warning_printed == false) {
-			cerr << "Connection found in recveiver trace that does not exist in sender: " << makeConnKey(ip->ip_src, ip->ip_dst, &tcp->th_sport, &tcp->th_dport);
+		static atomic<bool> warning_printed(false);
+		if (!warning_printed.exchange(true)) {
+			cerr << "Connection found in recveiver trace that does not exist in sender: " << makeConnKey(seg.ip_src, seg.ip_dst, &seg.src_port, &seg.dst_port);
 			cerr << ". Maybe NAT is in effect?" << endl;
 			warn_with_file_and_linenum(__FILE__, __LINE__);
-			warning_printed = true;
 		}
 		return;
 	}
 
 	if (tmpConn->lastLargestRecvEndSeq == 0 &&
-		ntohl(tcp->th_seq) != tmpConn->rm->firstSeq) {
-	    if (tcp->th_flags & TH_SYN) {
+		seg.seq != tmpConn->rm->firstSeq) {
+	    if (seg.flags & TH_SYN) {
 			if (DEBUGL_RECEIVER(1)) {
 				fprintf(stderr, "Invalid sequence number in SYN packet. This is probably an old connection - discarding...\n");
 			}
@@ -674,25 +1540,25 @@ void Dump::processRecvd(const pcap_pkthdr* header, const u_char *data, u_int lin
 
 	/* Prepare packet data struct */
 	sendData sd;
-	sd.totalSize         = header->len;
+	sd.totalSize         = seg.len;
 	sd.ipSize            = ipSize;
 	sd.ipHdrLen          = ipHdrLen;
 	sd.tcpHdrLen         = tcpHdrLen;
 	sd.tcpOptionLen      = tcpHdrLen - 20;
 	sd.data.payloadSize  = static_cast<uint16_t>(sd.totalSize - (ipHdrLen + tcpHdrLen + link_layer_header_size));
-	sd.data.seq_absolute = ntohl(tcp->th_seq);
+	sd.data.seq_absolute = seg.seq;
 	sd.data.seq          = tmpConn->getRelativeSequenceNumber(sd.data.seq_absolute, RELSEQ_RECV_INN);
 	sd.data.endSeq       = sd.data.seq + sd.data.payloadSize;
-	sd.data.tstamp_pcap  = header->ts;
+	sd.data.tstamp_pcap  = seg.tstamp_pcap;
 	sd.data.is_rdb       = false;
 	sd.data.sacks        = false;
 	sd.data.rdb_end_seq  = 0;
 	sd.data.retrans      = 0;
 	sd.data.in_sequence  = 0;
-	sd.data.flags        = tcp->th_flags;
-	sd.data.window       = ntohs(tcp->th_win);
-	sd.data.tstamp_tcp      = 0;
-	sd.data.tstamp_tcp_echo = 0;
+	sd.data.flags        = seg.flags;
+	sd.data.window       = seg.window;
+	sd.data.tstamp_tcp      = seg.tstamp_tcp;
+	sd.data.tstamp_tcp_echo = seg.tstamp_tcp_echo;
 
 	uint32_t payloadSize = ipSize - (ipHdrLen + tcpHdrLen); // This gives incorrect result on some packets where the ipSize is wrong (0 in a test trace)
 	if (sd.data.payloadSize != payloadSize) {
@@ -732,20 +1598,26 @@ void Dump::processRecvd(const pcap_pkthdr* header, const u_char *data, u_int lin
 		return;
 	}
 
-	uint8_t* opt = (uint8_t*) tcp + 20;
-	parseTCPOptions(&sd.data, opt, sd.tcpOptionLen);
-
 	/* define/compute tcp payload (segment) offset */
 	//sd.data.data = (u_char *) (data + link_layer_header_size + ipHdrLen + tcpHdrLen);
 	recvPacketCount++;
 	recvBytesCount += sd.data.payloadSize;
 
-	if (GlobOpts::look_for_get_request)
+	if (GlobOpts::look_for_get_request && data != NULL)
 		look_for_get_request(header, data, link_layer_header_size);
 
 	tmpConn->registerRecvd(&sd);
 }
 
+/* Insert the received segments kept on the connections (--recv-join) */
+void Dump::joinRecvd() {
+	if (!GlobOpts::recv_join)
+		return;
+	for (auto it = conns.begin(); it != conns.end(); it++) {
+		it->second->rm->joinReceivedRanges();
+	}
+}
+
 void Dump::calculateSojournTime() {
 
 	std::ifstream file(GlobOpts::sojourn_time_file);
@@ -806,8 +1678,8 @@ void Dump::calculateSojournTime() {
 		tmpSeg.seq = tmpConn->getRelativeSequenceNumber(tmpSeg.seq_absolute, RELSEQ_SOJ_SEQ);
 		tmpSeg.payloadSize = static_cast<uint16_t>(std::stoul(size));
 		tmpSeg.endSeq       = tmpSeg.seq + tmpSeg.payloadSize;
-		tmpSeg.tstamp_pcap.tv_sec = std::stoi(k_time.substr(0, k_time.find(".")));
-		tmpSeg.tstamp_pcap.tv_usec = std::stoi(k_time.substr(k_time.find(".") + 1)) / 1000;
+		tmpSeg.tstamp_pcap = std::stoll(k_time.substr(0, k_time.find("."))) * NSEC_PER_SEC
+			+ std::stoll(k_time.substr(k_time.find(".") + 1));
 
 		/*
 		if (seq != seq2) {
@@ -816,7 +1688,7 @@ void Dump::calculateSojournTime() {
 		*/
 
 		try {
-			bool ret = tmpConn->rm->insertByteRange(tmpSeg.seq, tmpSeg.endSeq, INSERT_SOJOURN, &tmpSeg, 0);
+			bool ret = tmpConn->rm->insertByteRange(tmpSeg.seq, tmpSeg.endSeq, INSERT_SOJOURN, &tmpSeg);
 			if (!ret) {
 				break;
 			}
@@ -854,6 +1726,32 @@ void Dump::calculateLatencyVariation() {
 	}
 }
 
+/* Methods for class RangeCounts */
+RangeCounts::RangeCounts()
+	: ranges_count(0), ranges_sent(0), ranges_lost(0)
+	, arena_ranges(0), arena_capacity(0), arena_slabs(0), arena_bytes(0)
+	, appended(0), inserted(0), parts(0), retired(0), retired_late(0)
+	, recv_joined(0), recv_split(0)
+{}
+
+void RangeCounts::add(Connection *conn) {
+	const ByteRangeArena &arena = conn->rm->getRangeArena();
+	ranges_count += conn->rm->getByteRangesCount();
+	ranges_sent += conn->rm->getByteRangesSent();
+	ranges_lost += conn->rm->getByteRangesLost();
+	arena_ranges += arena.size();
+	arena_capacity += arena.capacity();
+	arena_slabs += arena.slabCount();
+	arena_bytes += arena.footprint();
+	appended += conn->rm->insert_append_count;
+	inserted += conn->rm->insert_count;
+	parts += conn->rm->insert_part_count;
+	retired += conn->rm->retired_count;
+	retired_late += conn->rm->retired_late_count;
+	recv_joined += conn->rm->recv_joined_count;
+	recv_split += conn->rm->recv_split_count;
+}
+
 static void look_for_get_request(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size)
 {
 	const sniff_ip *ip; /* The IP header */
@@ -9,67 +9,93 @@
 #include <limits>
 #include <arpa/inet.h>
 #include <iomanip>
+#include <set>
+#include <map>
+#include <deque>
+#include <thread>
 #include "Connection.h"
+#include "ConnectionTable.h"
 #include "fourTuple.h"
 
 #include <stdexcept>      // std::invalid_argument
 
 /* Forward declarations */
 class Connection;
+class PacketFilter;
+class PcapReader;
+struct HeaderBatch;
 class Statistics;
+class ShardSpool;
+
+/* Max number of ACKs held back in single-pass mode, waiting for the data they acknowledge */
+#define MAX_PENDING_ACKS 1024
+/* ACKs held back longer than this (capture time) are processed regardless */
+#define PENDING_ACK_WINDOW_MS 1000
+/* Size of the packet data stored for a deferred ACK (link, IP and TCP headers) */
+#define PENDING_ACK_DATA_SIZE (SIZE_HEADER_LINUX_COOKED_MODE + 60 + 60)
+/* Max number of received segments staged while the sender dump is analysed (48 bytes each) */
+#define MAX_STAGED_RECVD_SEGMENTS (1 << 20)
+/* Capture time the 4-tuple of an evicted connection is remembered, so late packets do not make a new connection */
+#define EVICTED_CONN_LINGER_MS 60000
+
+/* 4-tuple of a connection: the addresses, and the ports */
+typedef pair<uint64_t, uint32_t> ConnTupleKey;
+
+/* ACK read before the data it acknowledges in single-pass mode */
+struct PendingAck {
+	pcap_pkthdr header;
+	Connection *conn;       // The connection the ACK is for, NULL until the connection is seen
+	ConnTupleKey key;       // 4-tuple of that connection
+	seq32_t ack;
+	bool processed;         // Processed (or moved once its connection is seen) before the ACKs captured ahead of it
+	u_char data[PENDING_ACK_DATA_SIZE];
+};
 
-struct ConnectionMapKey {
+/* Header fields of a received segment, as used by processRecvd() */
+struct RecvdSegment {
+	tstamp_t tstamp_pcap;
 	in_addr ip_src, ip_dst;
-	u_short src_port, dst_port;
+	uint16_t src_port, dst_port;    // Network byte order
+	seq32_t seq;
+	uint32_t len;                   // Length of the packet, as captured on the wire
+	uint16_t ip_len;
+	uint8_t ip_hdr_len, tcp_hdr_len;
+	uint8_t flags;
+	uint16_t window;
+	uint32_t tstamp_tcp, tstamp_tcp_echo;
 };
 
-struct ConnectionKeyComparator {
-	bool operator()(const ConnectionMapKey*  left, const ConnectionMapKey* right) const {
-		//if (GlobOpts::debugLevel) {
-		//	printf("Compare left  (%15p) : src ip: %ul, dst ip: %ul, src port: %u, dst port: %u\n", left, left->ip_src.s_addr, left->ip_dst.s_addr, left->src_port, left->dst_port);
-		//	printf("Compare right (%15p) : src ip: %ul, dst ip: %ul, src port: %u, dst port: %u\n", right, right->ip_src.s_addr, right->ip_dst.s_addr, right->src_port, right->dst_port);
-		//}
-		bool ret;
-		if (left->ip_src.s_addr != right->ip_src.s_addr)
-			ret = left->ip_src.s_addr < right->ip_src.s_addr;
-		else if (left->src_port != right->src_port)
-			ret = left->src_port < right->src_port;
-		else if (left->ip_dst.s_addr != right->ip_dst.s_addr)
-			ret = left->ip_dst.s_addr < right->ip_dst.s_addr;
-		else if (left->dst_port != right->dst_port)
-			ret = left->dst_port < right->dst_port;
-		else
-			ret = false;
-		return ret;
-	}
+/*
+  Receiver dump read and decoded on a thread of its own while the sender
+  dump is analysed. The segments are processed once the sender analysis
+  has created the connections. At most MAX_STAGED_RECVD_SEGMENTS are
+  staged, the rest of the dump is then read by processRecvd() as usual.
+ */
+struct RecvdStaging {
+	unique_ptr<PcapReader> reader;          // Left open when the staging stopped at the limit
+	unique_ptr<PacketFilter> filter;
+	vector<deque<RecvdSegment> > shard_segs;   // The segments of each shard
+	u_int link_header_size;
+	llint_t count;
+	thread thr;
 };
 
-// Sort by converting ports with ntohs
-struct SortedConnectionKeyComparator {
-	bool operator()(const ConnectionMapKey*  left, const ConnectionMapKey* right) const {
-		//printf("Compare left  (%15p) : src ip: %ul, dst ip: %ul, src port: %us, dst port: %us\n", left, left->ip_src.s_addr, left->ip_dst.s_addr, left->src_port, left->dst_port);
-		//printf("Compare right (%15p) : src ip: %ul, dst ip: %ul, src port: %u, dst port: %u\n", right, right->ip_src.s_addr, right->ip_dst.s_addr, right->src_port, right->dst_port);
-		bool ret;
-		if (left->ip_src.s_addr != right->ip_src.s_addr)
-			ret = left->ip_src.s_addr < right->ip_src.s_addr;
-		else if (ntohs(left->src_port) != ntohs(right->src_port))
-			ret = ntohs(left->src_port) < ntohs(right->src_port);
-		else if (left->ip_dst.s_addr != right->ip_dst.s_addr)
-			ret = left->ip_dst.s_addr < right->ip_dst.s_addr;
-		else if (ntohs(left->dst_port) != ntohs(right->dst_port))
-			ret = ntohs(left->dst_port) < ntohs(right->dst_port);
-		else
-			ret = false;
-		return ret;
-	}
-};
+/* Range counts of the connections in a dump, as printed by Statistics::printDumpStats() */
+struct RangeCounts {
+	long ranges_count, ranges_sent, ranges_lost;
+	size_t arena_ranges, arena_capacity, arena_slabs, arena_bytes;
+	ullint_t appended, inserted, parts, retired, retired_late;
+	ullint_t recv_joined, recv_split;
 
+	RangeCounts();
+	void add(Connection *conn);
+};
 
 /* Represents one dump, and keeps globally relevant information */
 class Dump
 {
 private:
-	timeval first_sent_time;
+	tstamp_t first_sent_time;
 	string filename;
 
 	string filterSrcIp;
@@ -78,6 +104,8 @@ private:
 	string filterSrcPort; /* specify tcp.src in filter */
 	string filterDstPort; /* specify tcp.dst in filter */
 	string filterTCPPort; /* specify tcp.port in filter */
+	in_addr filterSrcAddr; /* filterSrcIp and filterDstIp, substituted for the NAT addresses in the receiver dump */
+	in_addr filterDstAddr;
 	vector<four_tuple_t> _connections;
 
 	llint_t sentPacketCount;
@@ -86,11 +114,63 @@ private:
 	ullint_t recvBytesCount;
 	ullint_t ackCount;
 	uint32_t max_payload_size;
-	map<ConnectionMapKey*, Connection*, ConnectionKeyComparator> conns;
-
-	void processSent(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size);
-	void processRecvd(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size);
-	void processAcks(const pcap_pkthdr* header, const u_char *data, u_int link_layer_header_size);
+	ConnectionTable conns;
+	deque<PendingAck> pendingAcks;          // In capture order, until the ACKs ahead of them are processed
+	map<Connection*, deque<PendingAck*> > pendingConnAcks;  // The ACKs not yet processed, for each connection
+	size_t pendingAckCount;                 // ACKs not yet processed
+	deque<PendingAck> orphanAcks;           // ACKs for connections not seen yet, in capture order
+	map<ConnTupleKey, deque<PendingAck*> > orphanConnAcks;  // The orphan ACKs not yet processed, for each 4-tuple
+	size_t orphanAckCount;                  // Orphan ACKs not yet processed
+	unique_ptr<HeaderBatch> pendingBatch;   // Used to decode the pending ACK being processed
+	vector<Dump*> shards;   // Connections analysed by each worker thread
+	unique_ptr<RecvdStaging> recvStaging;
+	Statistics *finishedStats;                       // Writes the connections evicted with --evict-closed
+	vector<Connection*> finishedConns;               // Finished connections waiting to be evicted
+	map<ConnTupleKey, tstamp_t> evictedConns;        // Tuples of the evicted connections, and when they were evicted
+	deque<pair<tstamp_t, ConnTupleKey> > evictedOrder;
+	ullint_t evictedConnCount;
+	ullint_t evictedPacketCount;                     // Packets of evicted connections ignored
+	RangeCounts freedRanges;                         // Ranges of the connections freed before the end
+	vector<ConnectionMapKey> shardStart;             // First connection key of each shard but the first (--out-of-core)
+	unique_ptr<ShardSpool> sentSpool;
+	unique_ptr<ShardSpool> recvSpool;
+
+	void setSentFilter(PacketFilter &filter);
+	void setAckFilter(PacketFilter &filter);
+	void setRecvFilter(PacketFilter &filter);
+	void substituteNatAddrs(in_addr &srcIpAddr, in_addr &dstIpAddr);
+	void stageRecvd();
+	void processStagedRecvd(bool join);
+	void analyseSenderSinglePass();
+	void analyseSenderParallel();
+	void processSenderPacket(const HeaderBatch &batch, uint32_t i);
+	void createShards();
+	void mergeShards();
+	size_t getShard(const u_char *data, u_int link_layer_header_size, uint8_t kind);
+	llint_t dispatchPackets(PcapReader &reader, u_int link_layer_header_size, PacketFilter *sentFilter, PacketFilter *ackFilter, uint8_t kind);
+	void processQueuedPacket(const HeaderBatch &batch, uint32_t i);
+	void deferAck(const HeaderBatch &batch, uint32_t i, Connection *conn);
+	void processPendingAck(PendingAck &pending, u_int link_layer_header_size);
+	void processReadyAcks(Connection *conn, u_int link_layer_header_size);
+	void adoptOrphanAcks(Connection *conn, const ConnTupleKey &key);
+	void expirePendingAcks(deque<PendingAck> &acks, size_t count, tstamp_t now, u_int link_layer_header_size, bool flush);
+	void processPendingAcks(tstamp_t now, u_int link_layer_header_size, bool flush);
+	void checkFinished(Connection *conn, const HeaderBatch &batch, uint32_t i, bool sent);
+	bool isEvicted(const HeaderBatch &batch, uint32_t i, tstamp_t now);
+	void evictConn(Connection *conn, tstamp_t now, u_int link_layer_header_size);
+	void evictFinished(tstamp_t now, u_int link_layer_header_size);
+	void validateRanges();
+	size_t getSpoolShard(const in_addr &srcIpAddr, const in_addr &dstIpAddr, uint16_t srcPort, uint16_t dstPort);
+	void spoolSender();
+	void spoolRecvd(string recvFn);
+	void analyseShard(size_t shard);
+
+	void processSent(const HeaderBatch &batch, uint32_t i);
+	void processRecvd(const HeaderBatch &batch, uint32_t i);
+	void processRecvd(const RecvdSegment &seg, u_int link_layer_header_size, const pcap_pkthdr *header, const u_char *data);
+	void getRecvdSegment(const HeaderBatch &batch, uint32_t i, RecvdSegment &seg);
+	void joinRecvd();
+	void processAcks(const HeaderBatch &batch, uint32_t i);
 	void registerRecvd(const pcap_pkthdr* header, const u_char *data);
 
 public:
@@ -109,6 +189,10 @@ public:
 	~Dump();
 
 	void analyseSender();
+	void setFinishedStats(Statistics *stats) { finishedStats = stats; }
+	void spoolShards(string recvFn);
+	void analyseShards();
+	void startRecvd(string fn);
 	void processRecvd(string fn);
 	void calculateRetransAndRDBStats();
 	void printPacketDetails();
@@ -117,6 +201,7 @@ public:
 
 	Connection* getConn(const in_addr &srcIpAddr, const in_addr &dstIpAddr, const uint16_t *srcPort, const uint16_t *dstPort, const seq32_t *seq);
 	Connection* getConn(string &srcIpStr, string &dstIpStr, string &srcPortStr, string &dstPortStr);
+	Connection* getReverseConn(const in_addr &srcIpAddr, const in_addr &dstIpAddr, const uint16_t *srcPort, const uint16_t *dstPort);
 	void calculateLatencyVariation();
 	void calculateSojournTime();
 	friend class Statistics;
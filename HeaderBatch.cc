@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "HeaderBatch.h"
+#include "PcapReader.h"
+
+/* NOP, NOP, Timestamp (kind 8, length 10): the option layout used by most TCP stacks */
+#define TCPOPT_NOP_NOP_TS 0x0101080a
+
+static inline uint32_t read32(const u_char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Methods for class HeaderBatch */
+
+/*
+  Add a packet to the batch. Unless copy_data is set, the packet data
+  must be valid until the batch is cleared.
+ */
+void HeaderBatch::add(const pcap_pkthdr *hdr, const u_char *packet, uint8_t packet_kind, bool copy_data) {
+	uint32_t i = count++;
+	header[i] = *hdr;
+	kind[i] = packet_kind;
+	if (copy_data && GlobOpts::look_for_get_request) {
+		// The payload is kept as well, so the whole packet is copied
+		if (whole.empty())
+			whole.resize(HEADER_BATCH_SIZE);
+		whole[i].assign(packet, packet + hdr->caplen);
+		data[i] = whole[i].data();
+	}
+	else if (copy_data) {
+		if (copy.empty())
+			copy.resize(HEADER_BATCH_SIZE * HEADER_BATCH_COPY_SIZE);
+		u_char *buf = &copy[i * HEADER_BATCH_COPY_SIZE];
+		header[i].caplen = min(hdr->caplen, (bpf_u_int32) HEADER_BATCH_COPY_SIZE);
+		memcpy(buf, packet, header[i].caplen);
+		data[i] = buf;
+	}
+	else {
+		data[i] = packet;
+	}
+}
+
+/*
+  Decode the IP and TCP headers of the packets in the batch.
+  The TCP timestamp is read directly when the options are NOP,NOP,TS.
+ */
+void HeaderBatch::decode(u_int link_layer_header_size) {
+	link_header_size = link_layer_header_size;
+
+	for (uint32_t i = 0; i < count; i++) {
+		const sniff_ip *ip = (const sniff_ip*) (data[i] + link_layer_header_size);
+		uint8_t ipHdrLen = (uint8_t) (IP_HL(ip) * 4);
+		const sniff_tcp *tcp = (const sniff_tcp*) ((const u_char*) ip + ipHdrLen);
+		uint8_t tcpHdrLen = (uint8_t) (TH_OFF(tcp) * 4);
+		const u_char *opts = (const u_char*) tcp + 20;
+
+		ip_src[i] = ip->ip_src;
+		ip_dst[i] = ip->ip_dst;
+		ip_len[i] = ntohs(ip->ip_len);
+		ip_hdr_len[i] = ipHdrLen;
+		src_port[i] = tcp->th_sport;
+		dst_port[i] = tcp->th_dport;
+		seq[i] = ntohl(tcp->th_seq);
+		ack[i] = ntohl(tcp->th_ack);
+		tcp_hdr_len[i] = tcpHdrLen;
+		flags[i] = tcp->th_flags;
+		window[i] = ntohs(tcp->th_win);
+
+		if (tcpHdrLen == 32 && read32(opts) == htonl(TCPOPT_NOP_NOP_TS)) {
+			tstamp_tcp[i] = ntohl(read32(opts + 4));
+			tstamp_tcp_echo[i] = ntohl(read32(opts + 8));
+			parse_options[i] = false;
+		}
+		else {
+			tstamp_tcp[i] = 0;
+			tstamp_tcp_echo[i] = 0;
+			parse_options[i] = tcpHdrLen != 20;
+		}
+	}
+}
+
+/*
+  Read the next batch of packets from the reader, and decode them.
+  Returns false when there are no more packets.
+ */
+bool HeaderBatch::read(PcapReader &reader, uint8_t packet_kind, u_int link_layer_header_size) {
+	pcap_pkthdr hdr;
+	const u_char *packet;
+	bool copy_data = !reader.isMapped();
+
+	clear();
+	while (!full() && (packet = reader.next(&hdr)) != NULL) {
+		add(&hdr, packet, packet_kind, copy_data);
+	}
+	decode(link_layer_header_size);
+	return count > 0;
+}
@@ -0,0 +1,55 @@
+#ifndef HEADERBATCH_H
+#define HEADERBATCH_H
+
+#include "common.h"
+
+class PcapReader;
+
+/* Packets decoded at a time */
+#define HEADER_BATCH_SIZE 256
+/* Size of the packet data copied when the dump is not mapped (link, IP and TCP headers, and some payload) */
+#define HEADER_BATCH_COPY_SIZE 256
+
+/*
+  The IP and TCP header fields of a batch of packets, one array per field.
+  Packets are added with the pcap header and data, and decode() then fills
+  in the header fields of the whole batch in one go.
+ */
+struct HeaderBatch {
+	uint32_t count;
+	pcap_pkthdr header[HEADER_BATCH_SIZE];
+	const u_char *data[HEADER_BATCH_SIZE];
+	uint8_t kind[HEADER_BATCH_SIZE];            // PACKET_SENT / PACKET_ACK / PACKET_RECVD
+
+	in_addr ip_src[HEADER_BATCH_SIZE];
+	in_addr ip_dst[HEADER_BATCH_SIZE];
+	uint16_t src_port[HEADER_BATCH_SIZE];       // Network byte order
+	uint16_t dst_port[HEADER_BATCH_SIZE];       // Network byte order
+	seq32_t seq[HEADER_BATCH_SIZE];
+	seq32_t ack[HEADER_BATCH_SIZE];
+	uint16_t ip_len[HEADER_BATCH_SIZE];
+	uint8_t ip_hdr_len[HEADER_BATCH_SIZE];
+	uint8_t tcp_hdr_len[HEADER_BATCH_SIZE];
+	uint8_t flags[HEADER_BATCH_SIZE];
+	uint16_t window[HEADER_BATCH_SIZE];
+	uint32_t tstamp_tcp[HEADER_BATCH_SIZE];
+	uint32_t tstamp_tcp_echo[HEADER_BATCH_SIZE];
+	bool parse_options[HEADER_BATCH_SIZE];      // Options other than NOP,NOP,TS must be parsed with parseTCPOptions
+
+	vector<u_char> copy;                        // Packet data copied by add(), allocated on first use
+	vector<vector<u_char> > whole;              // Whole packets copied by add() when looking for GET requests
+	u_int link_header_size;
+
+	HeaderBatch() : count(0), link_header_size(0) {}
+
+	void clear() { count = 0; }
+	bool full() const { return count == HEADER_BATCH_SIZE; }
+	void add(const pcap_pkthdr *hdr, const u_char *packet, uint8_t packet_kind, bool copy_data);
+	void decode(u_int link_layer_header_size);
+	bool read(PcapReader &reader, uint8_t packet_kind, u_int link_layer_header_size);
+
+	uint8_t* getOptions(uint32_t i) const { return (uint8_t*) data[i] + link_header_size + ip_hdr_len[i] + 20; }
+	uint32_t getOptionLen(uint32_t i) const { return tcp_hdr_len[i] - 20U; }
+};
+
+#endif /* HEADERBATCH_H */
@@ -0,0 +1,19 @@
+#include "PacketQueue.h"
+
+/* Methods for class BatchQueue */
+void BatchQueue::push(PacketBatch *batch) {
+	{
+		lock_guard<mutex> guard(lock);
+		batches.push_back(batch);
+	}
+	cond.notify_one();
+}
+
+/* Waits until a batch is available */
+PacketBatch* BatchQueue::pop() {
+	unique_lock<mutex> guard(lock);
+	cond.wait(guard, [this] { return !batches.empty(); });
+	PacketBatch *batch = batches.front();
+	batches.pop_front();
+	return batch;
+}
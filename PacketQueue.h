@@ -0,0 +1,48 @@
+#ifndef PACKETQUEUE_H
+#define PACKETQUEUE_H
+
+#include <condition_variable>
+#include <mutex>
+#include "common.h"
+
+/* Packets handed from the reader thread to a worker in one go */
+#define PACKET_BATCH_SIZE 256
+/* Batches allocated per worker, which bounds the packets queued up for a worker */
+#define PACKET_BATCHES_PER_WORKER 8
+/* Size of the packet data copied when the dump is not mapped (link, IP and TCP headers) */
+#define QUEUED_PACKET_DATA_SIZE (SIZE_HEADER_LINUX_COOKED_MODE + 60 + 60)
+
+/* What the packet is to the sender dump analysis */
+#define PACKET_SENT  0x1
+#define PACKET_ACK   0x2
+#define PACKET_RECVD 0x4
+
+struct QueuedPacket {
+	pcap_pkthdr header;
+	const u_char *data;     // Points into the mapped dump, or to copy
+	uint8_t kind;
+	u_char copy[QUEUED_PACKET_DATA_SIZE];
+	vector<u_char> whole;   // The whole packet, copied when looking for GET requests
+};
+
+struct PacketBatch {
+	uint32_t count;
+	QueuedPacket packets[PACKET_BATCH_SIZE];
+};
+
+/*
+  Blocking queue of packet batches, used between the reader thread and a worker.
+  The queue itself is unbounded, the number of batches in circulation bounds it.
+ */
+class BatchQueue {
+private:
+	mutex lock;
+	condition_variable cond;
+	deque<PacketBatch*> batches;
+
+public:
+	void push(PacketBatch *batch);
+	PacketBatch* pop();
+};
+
+#endif /* PACKETQUEUE_H */
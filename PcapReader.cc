@@ -0,0 +1,506 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <thread>
+
+#include "PcapReader.h"
+#include "util.h"
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NSEC     0xa1b23c4d
+#define PCAP_FILE_HDR_SIZE  24
+#define PCAP_REC_HDR_SIZE   16
+#define PCAP_MAX_CAPLEN     262144
+
+/* Bytes of the mapped dump parsed at a time when parsing in parallel */
+#define PCAP_PARSE_WINDOW      (64 * 1024 * 1024)
+/* Smallest chunk worth parsing in a thread of its own */
+#define PCAP_MIN_CHUNK         (1024 * 1024)
+/* Number of consecutive plausible record headers taken as a record boundary */
+#define PCAP_RESYNC_RECORDS    4
+/* Max distance in seconds from the first record for a plausible timestamp */
+#define PCAP_RESYNC_MAX_DRIFT  (365 * 24 * 3600)
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define SIZE_IPV6 40
+
+static inline uint16_t read16(const u_char *p) { return (uint16_t) ((p[0] << 8) | p[1]); }
+
+static inline uint32_t read32(const u_char *p, bool swapped) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static inline bool in_range(uint16_t port, uint16_t low, uint16_t high) {
+	return port >= low && port <= high;
+}
+
+/* Methods for class PacketFilter */
+PacketFilter::PacketFilter()
+	: native(true)
+	, compiled(false)
+	, src_host_set(false), dst_host_set(false), host_set(false)
+	, src_port_set(false), dst_port_set(false), port_set(false)
+	, src_port_low(0), src_port_high(0)
+	, dst_port_low(0), dst_port_high(0)
+	, port_low(0), port_high(0)
+	, ack_flag(false)
+{
+	filterExp << "tcp";
+}
+
+PacketFilter::~PacketFilter() {
+	if (compiled)
+		pcap_freecode(&program);
+}
+
+bool PacketFilter::parseHost(const string &str, in_addr *addr) {
+	if (inet_pton(AF_INET, str.c_str(), addr) != 1) {
+		// Host names and IPv6 addresses are left to libpcap
+		native = false;
+		return false;
+	}
+	return true;
+}
+
+/* Parse a port (<port>) or port range (<start>-<end>) */
+bool PacketFilter::parsePort(const string &str, uint16_t *low, uint16_t *high) {
+	size_t sep = str.find('-');
+	string first = str.substr(0, sep);
+	string last = sep == string::npos ? first : str.substr(sep + 1);
+
+	if (first.empty() || last.empty() || !isNumeric(first.c_str(), 10) || !isNumeric(last.c_str(), 10)
+		|| first.length() > 5 || last.length() > 5 || stoul(first) > 65535 || stoul(last) > 65535) {
+		native = false;
+		return false;
+	}
+	*low = static_cast<uint16_t>(stoul(first));
+	*high = static_cast<uint16_t>(stoul(last));
+	if (*low > *high)
+		swap(*low, *high);
+	return true;
+}
+
+void PacketFilter::addSrcHost(const string &ip) {
+	filterExp << " && src host " << ip;
+	src_host_set = parseHost(ip, &src_host);
+}
+
+void PacketFilter::addDstHost(const string &ip) {
+	filterExp << " && dst host " << ip;
+	dst_host_set = parseHost(ip, &dst_host);
+}
+
+void PacketFilter::addHost(const string &ip) {
+	filterExp << " && host " << ip;
+	host_set = parseHost(ip, &host);
+}
+
+void PacketFilter::addSrcPort(const string &port) {
+	filterExp << " && src " << (isNumeric(port.c_str(), 10) ? "port " : "portrange ") << port;
+	src_port_set = parsePort(port, &src_port_low, &src_port_high);
+}
+
+void PacketFilter::addDstPort(const string &port) {
+	filterExp << " && dst " << (isNumeric(port.c_str(), 10) ? "port " : "portrange ") << port;
+	dst_port_set = parsePort(port, &dst_port_low, &dst_port_high);
+}
+
+void PacketFilter::addPort(const string &port) {
+	filterExp << " && tcp port " << port;
+	port_set = isNumeric(port.c_str(), 10) && parsePort(port, &port_low, &port_high);
+	if (!port_set)
+		native = false;
+}
+
+void PacketFilter::addAckFlag() {
+	filterExp << " && ((tcp[tcpflags] & tcp-ack) == tcp-ack)";
+	ack_flag = true;
+}
+
+/* Use an arbitrary pcap filter expression, which is always matched by libpcap */
+void PacketFilter::setExpression(const string &str) {
+	filterExp.str(str);
+	native = false;
+}
+
+/*
+  Match the packet the way the pcap filter expression does.
+  The expression only matches TCP on IPv4 and IPv6 (without extension headers),
+  IPv4 host addresses never match IPv6 packets, and ports and TCP flags are only
+  available in the first fragment.
+ */
+bool PacketFilter::matchNative(const pcap_pkthdr *header, const u_char *data, int linktype) const {
+	u_int link_layer_header_size;
+	uint16_t ethertype;
+
+	if (linktype == DLT_EN10MB) {
+		link_layer_header_size = SIZE_ETHERNET;
+		if (header->caplen < link_layer_header_size)
+			return false;
+		ethertype = read16(data + 12);
+	}
+	else {
+		link_layer_header_size = SIZE_HEADER_LINUX_COOKED_MODE;
+		if (header->caplen < link_layer_header_size)
+			return false;
+		ethertype = read16(data + 14);
+	}
+
+	const u_char *ip = data + link_layer_header_size;
+	u_int caplen = header->caplen - link_layer_header_size;
+	const u_char *tcp;
+	bool first_fragment;
+
+	if (ethertype == ETHERTYPE_IPV4) {
+		if (caplen < 10 || ip[9] != IPPROTO_TCP)
+			return false;
+
+		if (src_host_set || dst_host_set || host_set) {
+			if (caplen < 20)
+				return false;
+			uint32_t src, dst;
+			memcpy(&src, ip + 12, sizeof(src));
+			memcpy(&dst, ip + 16, sizeof(dst));
+			if (src_host_set && src != src_host.s_addr)
+				return false;
+			if (dst_host_set && dst != dst_host.s_addr)
+				return false;
+			if (host_set && src != host.s_addr && dst != host.s_addr)
+				return false;
+		}
+		first_fragment = caplen >= 8 && (read16(ip + 6) & 0x1fff) == 0;
+		tcp = ip + (ip[0] & 0x0f) * 4;
+	}
+	else if (ethertype == ETHERTYPE_IPV6) {
+		if (caplen < 7 || ip[6] != IPPROTO_TCP)
+			return false;
+		if (src_host_set || dst_host_set || host_set || ack_flag)
+			return false;
+		first_fragment = true;
+		tcp = ip + SIZE_IPV6;
+	}
+	else {
+		return false;
+	}
+
+	u_int tcp_offset = (u_int) (tcp - ip);
+	u_int tcp_caplen = caplen > tcp_offset ? caplen - tcp_offset : 0;
+
+	if (src_port_set || dst_port_set || port_set) {
+		if (!first_fragment || tcp_caplen < 4)
+			return false;
+		uint16_t sport = read16(tcp);
+		uint16_t dport = read16(tcp + 2);
+		if (src_port_set && !in_range(sport, src_port_low, src_port_high))
+			return false;
+		if (dst_port_set && !in_range(dport, dst_port_low, dst_port_high))
+			return false;
+		if (port_set && sport != port_low && dport != port_low)
+			return false;
+	}
+
+	if (ack_flag) {
+		if (!first_fragment || tcp_caplen < 14 || !(tcp[13] & TH_ACK))
+			return false;
+	}
+	return true;
+}
+
+/* Methods for class PcapReader */
+PcapReader::PcapReader(const string &fn)
+	: filename(fn)
+	, pcap(NULL)
+	, mapped(false)
+	, map_start(NULL)
+	, map_size(0)
+	, offset(PCAP_FILE_HDR_SIZE)
+	, swapped(false)
+	, nsec(false)
+	, linktype(0)
+	, filter(NULL)
+	, parse_threads(1)
+	, first_tstamp(0)
+	, chunk_index(0)
+	, record_index(0)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	compression_type compression;
+
+	if (openMapped()) {
+		pcap = pcap_open_dead(linktype, PCAP_MAX_CAPLEN);
+		parse_threads = GlobOpts::threads;
+	}
+	else if ((compression = Decompressor::detect(filename)) != COMPRESSION_NONE) {
+		decompressor.reset(new Decompressor(filename, compression));
+		pcap = pcap_fopen_offline_with_tstamp_precision(decompressor->getFile(), PCAP_TSTAMP_PRECISION_NANO, errbuf);
+		if (pcap != NULL)
+			linktype = pcap_datalink(pcap);
+	}
+	else {
+		pcap = pcap_open_offline_with_tstamp_precision(filename.c_str(), PCAP_TSTAMP_PRECISION_NANO, errbuf);
+		if (pcap != NULL)
+			linktype = pcap_datalink(pcap);
+	}
+
+	if (pcap == NULL) {
+		cerr << "pcap: Could not open file: " << filename << endl;
+		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	}
+}
+
+PcapReader::~PcapReader() {
+	if (mapped)
+		munmap((void*) map_start, map_size);
+	// Closes the pipe from the decompressor before it is destroyed
+	pcap_close(pcap);
+}
+
+/*
+  Map the dump into memory if it is a plain pcap file with a supported link type.
+  Returns false if the dump must be read with libpcap.
+ */
+bool PcapReader::openMapped() {
+	// Pipes must be left unopened, as they can only be read once
+	struct stat sb;
+	if (stat(filename.c_str(), &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size < PCAP_FILE_HDR_SIZE)
+		return false;
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	void *addr = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return false;
+
+	map_start = (const u_char*) addr;
+	map_size = (size_t) sb.st_size;
+
+	uint32_t magic = read32(map_start, false);
+	if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+		swapped = false;
+	}
+	else if (magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+		swapped = true;
+	}
+	else {
+		munmap(addr, map_size);
+		return false;
+	}
+	nsec = read32(map_start, swapped) == PCAP_MAGIC_NSEC;
+
+	// The upper bits of the link type field may hold FCS information
+	linktype = (int) (read32(map_start + 20, swapped) & 0x03FFFFFF);
+	if (linktype != DLT_EN10MB && linktype != DLT_LINUX_SLL) {
+		munmap(addr, map_size);
+		return false;
+	}
+
+	if (map_size >= PCAP_FILE_HDR_SIZE + PCAP_REC_HDR_SIZE)
+		first_tstamp = read32(map_start + PCAP_FILE_HDR_SIZE, swapped);
+
+	madvise(addr, map_size, MADV_SEQUENTIAL);
+	mapped = true;
+	return true;
+}
+
+void PcapReader::compileFilter(PacketFilter &f) {
+	if (f.native || f.compiled)
+		return;
+
+	string filterExp = f.getExpression();
+	if (pcap_compile(pcap, &f.program, (char*) filterExp.c_str(), 0, 0) == -1) {
+		fprintf(stderr, "Couldn't parse filter '%s'. Error: %s\n", filterExp.c_str(), pcap_geterr(pcap));
+		exit_with_file_and_linenum(1, __FILE__, __LINE__);
+	}
+	f.compiled = true;
+}
+
+/* Only packets matching the filter are returned by next() */
+void PcapReader::setFilter(PacketFilter &f) {
+	compileFilter(f);
+	filter = &f;
+}
+
+bool PcapReader::match(PacketFilter &f, const pcap_pkthdr *header, const u_char *data) {
+	if (f.native)
+		return f.matchNative(header, data, linktype);
+
+	compileFilter(f);
+	return pcap_offline_filter(&f.program, header, data) != 0;
+}
+
+/*
+  Read the header of the record at off, which must be within the dump.
+  Returns false if the record is truncated or corrupt.
+ */
+bool PcapReader::readRecord(size_t off, pcap_pkthdr *header) {
+	const u_char *rec = map_start + off;
+	header->ts.tv_sec = read32(rec, swapped);
+	header->ts.tv_usec = read32(rec + 4, swapped);
+	header->caplen = read32(rec + 8, swapped);
+	header->len = read32(rec + 12, swapped);
+
+	if (!nsec)
+		header->ts.tv_usec *= 1000;
+
+	return header->caplen <= PCAP_MAX_CAPLEN && header->caplen <= map_size - off - PCAP_REC_HDR_SIZE;
+}
+
+/* Returns true if a chain of plausible record headers starts at off */
+bool PcapReader::isRecordBoundary(size_t off) {
+	for (int i = 0; i < PCAP_RESYNC_RECORDS; i++) {
+		// The dump may end right after a record
+		if (off == map_size)
+			return i > 0;
+		if (off + PCAP_REC_HDR_SIZE > map_size)
+			return false;
+
+		const u_char *rec = map_start + off;
+		uint32_t sec = read32(rec, swapped);
+		uint32_t frac = read32(rec + 4, swapped);
+		uint32_t caplen = read32(rec + 8, swapped);
+		uint32_t len = read32(rec + 12, swapped);
+		uint32_t drift = sec > first_tstamp ? sec - first_tstamp : first_tstamp - sec;
+
+		if (frac >= (nsec ? 1000000000U : 1000000U) || drift > PCAP_RESYNC_MAX_DRIFT)
+			return false;
+		if (caplen == 0 || caplen > len || len > PCAP_MAX_CAPLEN || caplen > map_size - off - PCAP_REC_HDR_SIZE)
+			return false;
+		off += PCAP_REC_HDR_SIZE + caplen;
+	}
+	return true;
+}
+
+/* Returns the first record boundary in [start, limit), or limit if there is none */
+size_t PcapReader::findRecordBoundary(size_t start, size_t limit) {
+	for (size_t off = start; off < limit; off++) {
+		if (isRecordBoundary(off))
+			return off;
+	}
+	return limit;
+}
+
+/* Parse the records from start up to the limit of the chunk */
+void PcapReader::parseChunk(PcapChunk &chunk, size_t start) {
+	pcap_pkthdr header;
+	size_t off = start;
+
+	chunk.start = start;
+	chunk.truncated = false;
+	chunk.records.clear();
+
+	while (off < chunk.limit && off + PCAP_REC_HDR_SIZE <= map_size) {
+		if (!readRecord(off, &header)) {
+			chunk.truncated = true;
+			break;
+		}
+		const u_char *data = map_start + off + PCAP_REC_HDR_SIZE;
+		off += PCAP_REC_HDR_SIZE + header.caplen;
+
+		if (filter == NULL || match(*filter, &header, data)) {
+			PcapRecord record = { header, data };
+			chunk.records.push_back(record);
+		}
+	}
+	chunk.next = off;
+}
+
+/*
+  Parse the next window of the dump in chunks, one per thread.
+  The first chunk starts at the current offset, the others at the first
+  record boundary found in their byte range. As the boundary may be wrong,
+  it is checked against where the previous chunk ended, and the chunk is
+  parsed again from there when they differ. The chunks are returned in file
+  order, which is the order the records are read in without threads.
+ */
+void PcapReader::parseWindow() {
+	size_t begin = offset;
+	size_t end = min(map_size, begin + PCAP_PARSE_WINDOW);
+	size_t count = min((size_t) parse_threads, max((size_t) 1, (end - begin) / PCAP_MIN_CHUNK));
+	size_t chunk_size = (end - begin) / count;
+
+	chunks.resize(count);
+	for (size_t i = 0; i < count; i++)
+		chunks[i].limit = i == count - 1 ? end : begin + (i + 1) * chunk_size;
+
+	vector<thread> threads;
+	for (size_t i = 1; i < count; i++) {
+		threads.push_back(thread([this, i, begin, chunk_size]() {
+			PcapChunk &chunk = chunks[i];
+			parseChunk(chunk, findRecordBoundary(begin + i * chunk_size, chunk.limit));
+		}));
+	}
+	parseChunk(chunks[0], begin);
+	for (thread &t : threads)
+		t.join();
+
+	for (size_t i = 1; i < count; i++) {
+		if (chunks[i - 1].truncated) {
+			chunks.resize(i);
+			break;
+		}
+		if (chunks[i].start != chunks[i - 1].next)
+			parseChunk(chunks[i], chunks[i - 1].next);
+	}
+
+	// Truncated or corrupt record ends the dump, as with libpcap
+	offset = chunks.back().truncated ? map_size : chunks.back().next;
+	chunk_index = 0;
+	record_index = 0;
+}
+
+/*
+  Returns the next packet matching the filter, or NULL at the end of the dump.
+  When the dump is mapped, the data points into the mapped file, and is
+  valid until the reader is destroyed.
+ */
+const u_char* PcapReader::next(pcap_pkthdr *header) {
+	const u_char *data;
+
+	if (!mapped) {
+		while ((data = pcap_next(pcap, header)) != NULL) {
+			if (filter == NULL || match(*filter, header, data))
+				return data;
+		}
+		return NULL;
+	}
+
+	if (parse_threads > 1) {
+		for (;;) {
+			if (chunk_index < chunks.size()) {
+				vector<PcapRecord> &records = chunks[chunk_index].records;
+				if (record_index < records.size()) {
+					*header = records[record_index].header;
+					return records[record_index++].data;
+				}
+				chunk_index++;
+				record_index = 0;
+				continue;
+			}
+			if (offset + PCAP_REC_HDR_SIZE > map_size)
+				return NULL;
+			parseWindow();
+		}
+	}
+
+	while (offset + PCAP_REC_HDR_SIZE <= map_size) {
+		// Truncated or corrupt record ends the dump, as with libpcap
+		if (!readRecord(offset, header)) {
+			offset = map_size;
+			return NULL;
+		}
+
+		data = map_start + offset + PCAP_REC_HDR_SIZE;
+		offset += PCAP_REC_HDR_SIZE + header->caplen;
+
+		if (filter == NULL || match(*filter, header, data))
+			return data;
+	}
+	return NULL;
+}
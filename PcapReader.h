@@ -0,0 +1,122 @@
+#ifndef PCAPREADER_H
+#define PCAPREADER_H
+
+#include "common.h"
+#include "Decompressor.h"
+
+/*
+  Filter on the TCP packets read from a dump.
+  The filter is built both as a pcap filter expression and, when the values
+  allow it, as addresses and port ranges that are matched natively.
+  Filters that cannot be matched natively (e.g. host names) are compiled
+  with libpcap and matched with pcap_offline_filter.
+ */
+class PacketFilter {
+private:
+	stringstream filterExp;
+	bool native;
+	bool compiled;
+	bpf_program program;
+
+	bool src_host_set, dst_host_set, host_set;
+	in_addr src_host, dst_host, host;
+	bool src_port_set, dst_port_set, port_set;
+	uint16_t src_port_low, src_port_high;
+	uint16_t dst_port_low, dst_port_high;
+	uint16_t port_low, port_high;
+	bool ack_flag;
+
+	bool parseHost(const string &str, in_addr *addr);
+	bool parsePort(const string &str, uint16_t *low, uint16_t *high);
+	bool matchNative(const pcap_pkthdr *header, const u_char *data, int linktype) const;
+	friend class PcapReader;
+
+public:
+	PacketFilter();
+	~PacketFilter();
+
+	void addSrcHost(const string &ip);
+	void addDstHost(const string &ip);
+	void addHost(const string &ip);
+	void addSrcPort(const string &port);
+	void addDstPort(const string &port);
+	void addPort(const string &port);
+	void addAckFlag();
+	void setExpression(const string &str);
+
+	string getExpression() { return filterExp.str(); }
+	bool isNative() { return native; }
+};
+
+/*
+  The packet headers handed out by PcapReader hold nanoseconds in ts.tv_usec,
+  as libpcap does for dumps opened with PCAP_TSTAMP_PRECISION_NANO.
+ */
+inline tstamp_t pcap_tstamp(const pcap_pkthdr *header) {
+	return (tstamp_t) header->ts.tv_sec * NSEC_PER_SEC + header->ts.tv_usec;
+}
+
+/* Packet found when parsing a chunk of the mapped dump */
+struct PcapRecord {
+	pcap_pkthdr header;
+	const u_char *data;
+};
+
+/* Byte range of the mapped dump, and the packets in it matching the filter */
+struct PcapChunk {
+	size_t start;           // First record in the chunk
+	size_t limit;           // Records starting at or after limit belong to the next chunk
+	size_t next;            // Offset of the record following the chunk
+	bool truncated;         // The dump ends with a truncated record in this chunk
+	vector<PcapRecord> records;
+};
+
+/*
+  Reads the packets in a pcap dump.
+  Plain pcap files are mapped into memory, and the packet data is handed
+  out as pointers straight into the mapped file. Other formats (e.g. pcapng)
+  are read with libpcap, and compressed dumps are read with libpcap from
+  a Decompressor.
+  With more than one thread (--threads), the mapped dump is parsed a window
+  at a time, with the window split into chunks that are parsed in parallel.
+ */
+class PcapReader {
+private:
+	string filename;
+	pcap_t *pcap;           // The opened dump, or a dead handle used to compile filters
+	bool mapped;
+	const u_char *map_start;
+	size_t map_size;
+	size_t offset;
+	bool swapped;
+	bool nsec;
+	int linktype;
+	PacketFilter *filter;
+	unique_ptr<Decompressor> decompressor;
+
+	int parse_threads;
+	uint32_t first_tstamp;  // Seconds of the first record, used when looking for record boundaries
+	vector<PcapChunk> chunks;
+	size_t chunk_index;
+	size_t record_index;
+
+	bool openMapped();
+	bool readRecord(size_t off, pcap_pkthdr *header);
+	bool isRecordBoundary(size_t off);
+	size_t findRecordBoundary(size_t start, size_t limit);
+	void parseChunk(PcapChunk &chunk, size_t start);
+	void parseWindow();
+
+public:
+	PcapReader(const string &fn);
+	~PcapReader();
+
+	void compileFilter(PacketFilter &f);
+	void setFilter(PacketFilter &f);
+	bool match(PacketFilter &f, const pcap_pkthdr *header, const u_char *data);
+	const u_char* next(pcap_pkthdr *header);
+	int getLinkType() { return linktype; }
+	bool isMapped() { return mapped; }
+};
+
+#endif /* PCAPREADER_H */
@@ -1,5 +1,6 @@
 #include <memory>
 #include <stdexcept>
+#include <algorithm>
 
 #include "RangeManager.h"
 #include "Connection.h"
@@ -8,19 +9,11 @@
 #include "color_print.h"
 
 
-#define RECURSION_LEVEL 1500
+/* Most parts the data of one segment is inserted in, when it overlaps existing ranges */
+#define MAX_INSERT_LEVEL 1500
 
 const char *received_type_str[] = {"DEF", "DTA", "RDB", "RTR"};
 
-RangeManager::~RangeManager() {
-	map<seq64_t, ByteRange*>::iterator it, it_end;
-	it = ranges.begin();
-	it_end = ranges.end();
-	for (; it != it_end; it++) {
-		delete it->second;
-	}
-}
-
 
 #define STR_ABSOLUTE_SEQNUM_PAIR(seq_start, seq_end) absolute_seq_pair_str(seq_start, END_SEQ(seq_end)).c_str()
 #define STR_SEQNUM_PAIR(seq_start, seq_end) seq_pair_str(seq_start, seq_end).c_str()
@@ -65,6 +58,7 @@ seq64_t RangeManager::get_print_seq(seq64_t seq) {
 void RangeManager::insertSentRange(sendData *sd) {
 	seq64_t startSeq = sd->data.seq;
 	seq64_t endSeq = sd->data.endSeq;
+	ack_frontier_valid = false;
 
 #ifdef DEBUG
 	int debug_print = 0;
@@ -75,7 +69,7 @@ void RangeManager::insertSentRange(sendData *sd) {
 			   STR_SEQNUM_PAIR(startSeq, endSeq), sd->data.retrans, sd->data.is_rdb);
 	}
 #endif
-	insertByteRange(startSeq, endSeq, INSERT_SENT, &(sd->data), 0);
+	insertByteRange(startSeq, endSeq, INSERT_SENT, &(sd->data));
 
 	if (sd->data.payloadSize == 0) { /* First or second packet in stream */
 #ifdef DEBUG
@@ -164,18 +158,36 @@ void RangeManager::insertSentRange(sendData *sd) {
 	}
 }
 
+static void makeRecvRecord(sendData *sd, RecvRecord &rec, uint32_t index) {
+	rec.seq = sd->data.seq;
+	rec.endSeq = sd->data.endSeq;
+	rec.tstamp_pcap = sd->data.tstamp_pcap;
+	rec.tstamp_tcp = sd->data.tstamp_tcp;
+	rec.payloadSize = sd->data.payloadSize;
+	rec.window = sd->data.window;
+	rec.flags = sd->data.flags;
+	rec.index = index;
+}
+
 void RangeManager::insertReceivedRange(sendData *sd) {
+	RecvRecord rec;
+	makeRecvRecord(sd, rec, 0);
+	insertRecvRecord(rec);
+}
+
+void RangeManager::insertRecvRecord(const RecvRecord &rec) {
 	DataSeg tmpSeg;
-	tmpSeg.seq = sd->data.seq;
-	tmpSeg.endSeq = sd->data.endSeq;
-	tmpSeg.tstamp_pcap = (sd->data.tstamp_pcap);
+	ack_frontier_valid = false;
+	tmpSeg.seq = rec.seq;
+	tmpSeg.endSeq = rec.endSeq;
+	tmpSeg.tstamp_pcap = rec.tstamp_pcap;
 	//tmpSeg.data = sd->data.data;
-	tmpSeg.payloadSize = sd->data.payloadSize;
-	tmpSeg.is_rdb = sd->data.is_rdb;
-	tmpSeg.retrans = sd->data.retrans;
-	tmpSeg.tstamp_tcp = sd->data.tstamp_tcp;
-	tmpSeg.window = sd->data.window;
-	tmpSeg.flags = sd->data.flags;
+	tmpSeg.payloadSize = rec.payloadSize;
+	tmpSeg.is_rdb = false;
+	tmpSeg.retrans = 0;
+	tmpSeg.tstamp_tcp = rec.tstamp_tcp;
+	tmpSeg.window = rec.window;
+	tmpSeg.flags = rec.flags;
 
 	if (DEBUGL_RECEIVER(5)) {
 		cerr << "Inserting receive data: startSeq=" << get_print_seq(tmpSeg.seq)
@@ -185,22 +197,155 @@ void RangeManager::insertReceivedRange(sendData *sd) {
 		}
 	}
 	/* Insert all packets into data structure */
-	insertByteRange(tmpSeg.seq, tmpSeg.endSeq, INSERT_RECV, &tmpSeg, 0);
+	insertByteRange(tmpSeg.seq, tmpSeg.endSeq, INSERT_RECV, &tmpSeg);
+}
+
+/* Keeps a received segment for joinReceivedRanges() (--recv-join) */
+void RangeManager::deferReceivedRange(sendData *sd) {
+	RecvRecord rec;
+	makeRecvRecord(sd, rec, static_cast<uint32_t>(recv_records.size()));
+	recv_records.push_back(rec);
+}
+
+static bool recvRecordHasData(const RecvRecord &rec) {
+	return rec.seq < rec.endSeq;
+}
+
+static bool recvRecordLess(const RecvRecord &a, const RecvRecord &b) {
+	return a.seq < b.seq;
+}
+
+/*
+  Inserts the received segments kept by deferReceivedRange(). The segments
+  with data are sorted on seq and merged with the ranges in one sweep, which
+  splits a range only where a segment starts or ends inside it. Splits copy
+  the receive state, and the receive times are those of the segment captured
+  first, so the ranges end up as inserting in capture order leaves them.
+  The segments without data are inserted after, in capture order.
+ */
+void RangeManager::joinReceivedRanges() {
+	if (recv_records.empty())
+		return;
+
+	ack_frontier_valid = false;
+	vector<RecvRecord>::iterator data_end = std::stable_partition(recv_records.begin(), recv_records.end(), recvRecordHasData);
+	if (!std::is_sorted(recv_records.begin(), data_end, recvRecordLess))
+		std::stable_sort(recv_records.begin(), data_end, recvRecordLess);
+
+	// The first range that ends after the current segment starts
+	RangeMap::iterator it = ranges.begin();
+	for (vector<RecvRecord>::iterator rec = recv_records.begin(); rec != data_end; rec++) {
+		if (DEBUGL_RECEIVER(5)) {
+			cerr << "Joining receive data: startSeq=" << get_print_seq(rec->seq)
+				 << ", endSeq=" << get_print_seq(rec->endSeq) << endl;
+		}
+		while (it != ranges.end() && it->second->endSeq <= rec->seq)
+			it++;
+		// Data that was not sent
+		if (it == ranges.end() || it->second->startSeq > rec->seq) {
+			warn_with_file_and_linenum(__FILE__, __LINE__);
+			continue;
+		}
+		if (it->second->startSeq < rec->seq) {
+			warn_with_file_and_linenum(__FILE__, __LINE__);
+			splitRangeEnd(it->second, rec->seq, INSERT_RECV);
+			recv_split_count++;
+			it++;
+		}
+		recv_joined_count++;
+
+		for (RangeMap::iterator part = it; ; ) {
+			ByteRange *br = part->second;
+			if (br->endSeq > rec->endSeq) {
+				splitRangeEnd(br, rec->endSeq, INSERT_RECV);
+				recv_split_count++;
+			}
+			br->increase_received(rec->tstamp_tcp, rec->tstamp_pcap, false, rec->index);
+			if (part == it)
+				br->packet_received_count++;
+			if (br->endSeq == rec->endSeq)
+				break;
+			// The rest of the segment is in a gap between the ranges
+			if (++part == ranges.end() || part->second->startSeq != br->endSeq) {
+				warn_with_file_and_linenum(__FILE__, __LINE__);
+				break;
+			}
+		}
+	}
+
+	for (vector<RecvRecord>::iterator rec = data_end; rec != recv_records.end(); rec++)
+		insertRecvRecord(*rec);
+	vector<RecvRecord>().swap(recv_records);
 }
 
 /*
   This inserts the the data into the ranges map.
   It's called both with sent end received data ranges.
+  New data following the last range is appended without any lookups. Other
+  data is inserted a part at a time, as each part may end where an existing
+  range ends.
 */
-bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_type itype, DataSeg *data_seg, int level) {
+bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_type itype, DataSeg *data_seg) {
+	// The retired ranges are already in the statistics, so late copies of their data are left out
+	if (start_seq < retired_seq) {
+		if (end_seq <= retired_seq) {
+			retired_late_count++;
+			return true;
+		}
+		start_seq = retired_seq;
+	}
+
+	if (itype == INSERT_SENT && start_seq < end_seq && start_seq >= lastSeq && !(data_seg->flags & TH_SYN) &&
+		(ranges.empty() || ranges.back().first < start_seq)) {
+		bool this_is_rdb_data = data_seg->is_rdb && data_seg->rdb_end_seq > start_seq;
+		ranges.append(pair<seq64_t, ByteRange*>(start_seq, createSentRange(start_seq, end_seq, data_seg, this_is_rdb_data)));
+		insert_append_count++;
+		return true;
+	}
+
+	insert_count++;
+	for (int level = 0; ; level++) {
+		seq64_t next_seq;
+		bool ret = insertByteRangePart(start_seq, end_seq, itype, data_seg, level, next_seq);
+		if (next_seq == end_seq)
+			return ret;
+		insert_part_count++;
+		start_seq = next_seq;
+	}
+}
+
+/* Range for new data in a sent segment */
+ByteRange* RangeManager::createSentRange(seq64_t start_seq, seq64_t end_seq, DataSeg *data_seg, bool this_is_rdb_data) {
+	ByteRange *br = range_arena.create(start_seq, end_seq);
+	br->original_payload_size = data_seg->payloadSize;
+	br->original_packet_is_rdb = data_seg->is_rdb;
+
+	br->increase_sent(data_seg->tstamp_tcp, data_seg->tstamp_tcp_echo, data_seg->tstamp_pcap, this_is_rdb_data, data_seg->is_rdb ? ST_NONE : ST_PKT);
+	if (data_seg->flags & TH_SYN) {
+		assert("SYN" && 0);
+		br->syn = 1;
+	}
+	else if (data_seg->flags & TH_FIN) {
+		br->fin = 1;
+	}
+	return br;
+}
+
+/*
+  Inserts the data from start_seq, up to the end of the first existing range
+  it overlaps. next_seq is set to where the rest of the data starts, or to
+  end_seq when all the data is inserted.
+*/
+bool RangeManager::insertByteRangePart(seq64_t start_seq, seq64_t end_seq, insert_type itype, DataSeg *data_seg, int level, seq64_t &next_seq) {
 	ByteRange *last_br = NULL;
-	map<seq64_t, ByteRange*>::iterator brIt, brIt_end;
+	next_seq = end_seq;
+	RangeMap::iterator brIt, brIt_end;
 	brIt_end = ranges.end();
 	brIt = brIt_end;
 
 #ifdef DEBUG
 	int debug_print = 0;
-	//if (TV_TO_MS(data_seg->tstamp_pcap) == 1396710194676) {
+	//if (TS_TO_MS(data_seg->tstamp_pcap) == 1396710194676) {
 	//	printf("\n\nHEEEEEEI sent:%d level:%d\n\n", sent, level);
 	//	printf("%s\n", conn->getConnKey().c_str());
 	//	debug_print = 1;
@@ -315,7 +460,7 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 				indent_print2("Create range with 0 len\n");
 			}
 #endif
-			last_br = new ByteRange(start_seq, end_seq);
+			last_br = range_arena.create(start_seq, end_seq);
 			last_br->packet_retrans_count += data_seg->retrans;
 			last_br->rdb_count += data_seg->is_rdb;
 			if (data_seg->flags & TH_SYN) {
@@ -352,7 +497,7 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 			return true;
 		}
 
-		map<seq64_t, ByteRange*>::iterator lowIt, highIt;
+		RangeMap::iterator lowIt, highIt;
 		highIt = ranges.upper_bound(end_seq);
 		seq64_t new_end_seq = end_seq;
 
@@ -407,7 +552,7 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 						ByteRange *range_received;
 						ByteRange *new_br;
 						if (start_matches) {
-							new_br = cur_br->splitEnd(end_seq, cur_br->endSeq);
+							new_br = splitRangeEnd(cur_br, end_seq, itype);
 							if (data_seg->flags & TH_FIN) {
 								cur_br->fin += 1;
 							}
@@ -422,8 +567,8 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 							range_received = cur_br;
 						}
 						else if (end_matches) {
-							new_br = cur_br->splitEnd(start_seq, cur_br->endSeq);
-							if (data_seg->flags & TH_FIN) {
+							new_br = splitRangeEnd(cur_br, start_seq, itype);
+							if (itype == INSERT_SENT && (data_seg->flags & TH_FIN)) {
 								new_br->fin = 1;
 							}
 #ifdef DEBUG
@@ -437,13 +582,14 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 						// New data fits into current range
 						else if (end_seq < cur_br->endSeq) {
 							// Split in the middle
-							new_br = cur_br->splitEnd(start_seq, cur_br->endSeq);
-							if (data_seg->flags & TH_FIN) {
+							new_br = splitRangeEnd(cur_br, start_seq, itype);
+							if (itype == INSERT_SENT && (data_seg->flags & TH_FIN)) {
 								new_br->fin = 1;
 							}
-							ByteRange *new_last = new_br->splitEnd(end_seq, new_br->endSeq);
+							splitRangeEnd(new_br, end_seq, itype);
 #ifdef DEBUG
 							if (debug_print) {
+								ByteRange *new_last = ranges[end_seq];
 								indent_print("New Range 1      : %s (%d)\n",
 											 STR_ABSOLUTE_SEQNUM_PAIR(cur_br->startSeq, cur_br->endSeq), cur_br->getNumBytes());
 								indent_print("New Range 2      : %s (%d)\n",
@@ -452,12 +598,11 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 											 STR_ABSOLUTE_SEQNUM_PAIR(new_last->startSeq, new_last->endSeq), new_last->getNumBytes());
 							}
 #endif
-							ranges.insert(pair<seq64_t, ByteRange*>(new_last->startSeq, new_last));
 							range_received = new_br;
 						}
 						// New data spans beyond current range
 						else {
-							new_br = cur_br->splitEnd(start_seq, cur_br->endSeq);
+							new_br = splitRangeEnd(cur_br, start_seq, itype);
 							range_received = new_br;
 							insert_more_recursively = 1;
 #ifdef DEBUG
@@ -468,7 +613,6 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 							}
 #endif
 						}
-						ranges.insert(pair<seq64_t, ByteRange*>(new_br->startSeq, new_br));
 
 						if (itype == INSERT_SENT) {
 							sent_type s_type = ST_NONE;
@@ -519,7 +663,8 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 						}
 						if (insert_more_recursively) {
 							//indent_print("Recursive call2: brIt->endseq: %llu, endseq: %llu\n", brIt->second->endSeq, end_seq);
-							return insertByteRange(new_br->endSeq, end_seq, itype, data_seg, level +1);
+							next_seq = new_br->endSeq;
+							return true;
 						}
 					}// END if (itype != INSERT_SOJOURN)
 					else {
@@ -560,7 +705,8 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 						}
 						if (insert_more_recursively) {
 							//indent_print("Sojourn recursive call2: brIt->endseq: %llu, endseq: %llu\n", cur_br->endSeq, end_seq);
-							return insertByteRange(cur_br->endSeq, end_seq, itype, data_seg, level +1);
+							next_seq = cur_br->endSeq;
+							return true;
 						}
 					}
 					return true;
@@ -577,18 +723,7 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 				indent_print("data_seg->rdb_end_seq > start_seq: %llu > %llu: %d\n", get_print_seq(data_seg->rdb_end_seq), get_print_seq(start_seq), data_seg->rdb_end_seq > start_seq);
 			}
 #endif
-			last_br = new ByteRange(start_seq, new_end_seq);
-			last_br->original_payload_size = data_seg->payloadSize;
-			last_br->original_packet_is_rdb = data_seg->is_rdb;
-
-			last_br->increase_sent(data_seg->tstamp_tcp, data_seg->tstamp_tcp_echo, data_seg->tstamp_pcap, this_is_rdb_data, data_seg->is_rdb ? ST_NONE : ST_PKT);
-			if (data_seg->flags & TH_SYN) {
-				assert("SYN" && 0);
-				last_br->syn = 1;
-			}
-			else if (data_seg->flags & TH_FIN) {
-				last_br->fin = 1;
-			}
+			last_br = createSentRange(start_seq, new_end_seq, data_seg, this_is_rdb_data);
 #ifdef DEBUG
 			if (data_seg->retrans || this_is_rdb_data) {
 				if (debug_print) {
@@ -618,7 +753,7 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 		else if (itype == INSERT_RECV) {
 			// This data is only in the receiver dump
 			if (start_seq > lastSeq) {
-				last_br = new ByteRange(start_seq, end_seq);
+				last_br = range_arena.create(start_seq, end_seq);
 				last_br->original_payload_size = data_seg->payloadSize;
 				last_br->increase_received(data_seg->tstamp_tcp, data_seg->tstamp_pcap, data_seg->in_sequence);
 				if (!level) {
@@ -772,7 +907,8 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 							brIt->second->increase_sent(data_seg->tstamp_tcp, data_seg->tstamp_tcp_echo, data_seg->tstamp_pcap, this_is_rdb_data, ST_PKT);
 							if (brIt->second->endSeq < end_seq) {
 								// The gap was filled, but more data remains to be added
-								return insertByteRange(brIt->second->endSeq, end_seq, itype, data_seg, level +1);
+								next_seq = brIt->second->endSeq;
+								return true;
 							}
 							else {
 								// The segment filled the gap either fully or partially
@@ -787,7 +923,8 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 							//brIt->second->original_payload_size = brIt->second->byte_count;
 							brIt->second->increase_sent(data_seg->tstamp_tcp, data_seg->tstamp_tcp_echo, data_seg->tstamp_pcap, this_is_rdb_data, ST_PKT);
 							if (brIt->second->endSeq < end_seq) {
-								return insertByteRange(brIt->second->endSeq, end_seq, itype, data_seg, level +1);
+								next_seq = brIt->second->endSeq;
+								return true;
 							}
 							else {
 								return true;
@@ -828,12 +965,12 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 					}
 #ifdef DEBUG
 					if (debug_print) {
-						indent_print("received_tstamp_tcp: %d\n", brIt->second->received_tstamp_tcp);
+						indent_print("received_tstamp_tcp: %d\n", brIt->second->recv->received_tstamp_tcp);
 						indent_print("Conn: %s\n", conn->getConnKey().c_str());
 						indent_print("Range: %s\n", STR_ABSOLUTE_SEQNUM_PAIR(brIt->second->startSeq, brIt->second->endSeq));
 					}
 #endif
-					assert(brIt->second->received_tstamp_tcp && "TEST\n");
+					assert(brIt->second->recv->received_tstamp_tcp && "TEST\n");
 				}
 				else if (itype == INSERT_SOJOURN) {
 					bool ret = brIt->second->addSegmentEnteredKernelTime(brIt->second->endSeq, data_seg->tstamp_pcap);
@@ -850,25 +987,27 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 					}
 				}
 
-				if (level > RECURSION_LEVEL) {
-					throw std::logic_error(strfmt("Recurse level too high: %d in insertByteRange: start seq: %llu, end seq: %llu, size: %llu, Type: %d\n",
-												  RECURSION_LEVEL, start_seq, end_seq, end_seq - start_seq, itype));
+				if (level > MAX_INSERT_LEVEL) {
+					throw std::logic_error(strfmt("Insert level too high: %d in insertByteRange: start seq: %llu, end seq: %llu, size: %llu, Type: %d\n",
+												  MAX_INSERT_LEVEL, start_seq, end_seq, end_seq - start_seq, itype));
 				}
-				// Recursive call to insert the remaining data
+				// Continue with the remaining data
 #ifdef DEBUG
 				if (debug_print) {
 					indent_print("Recursive call1: brIt->endseq: %llu, endseq: %llu\n", brIt->second->endSeq, end_seq);
 					//indent_print("tstamp_tcp: %u\n", data_seg->tstamp_tcp);
 				}
 #endif
-				return insertByteRange(brIt->second->endSeq, end_seq, itype, data_seg, level +1);
+				next_seq = brIt->second->endSeq;
+				return true;
 			}
 			// Spans less than the range, split current range
 			else {
 				if (itype != INSERT_SOJOURN) {
-					ByteRange *new_br = brIt->second->splitEnd(end_seq, brIt->second->endSeq);
+					splitRangeEnd(brIt->second, end_seq, itype);
 #ifdef DEBUG
 					if (debug_print) {
+						ByteRange *new_br = ranges[end_seq];
 						indent_print("New range ends in the middle of existing\nByteRange(%s) [%llu]\n", STR_ABSOLUTE_SEQNUM_PAIR(brIt->second->startSeq, new_br->endSeq), end_seq);
 						indent_print("Split Range into: (%s), (%s)\n", STR_ABSOLUTE_SEQNUM_PAIR(brIt->second->startSeq, brIt->second->endSeq),
 									 STR_ABSOLUTE_SEQNUM_PAIR(new_br->startSeq, new_br->endSeq));
@@ -897,7 +1036,6 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 							brIt->second->packet_received_count++;
 						}
 					}
-					ranges.insert(pair<seq64_t, ByteRange*>(new_br->startSeq, new_br));
 				}
 				else {// INSERT_SOJOURN - Do not split, only register sojourn timestamp
 					bool ret = brIt->second->addSegmentEnteredKernelTime(end_seq, data_seg->tstamp_pcap);
@@ -946,8 +1084,8 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 
 #ifdef DEBUG
 				if (debug_print) {
-					printf("Setting received timestamp: %u\n", brIt->second->received_tstamp_tcp);
-					printf("tstamps: %lu, rdb-stamps: %lu", brIt->second->tstamps_tcp.size(), brIt->second->rdb_tstamps_tcp.size());
+					printf("Setting received timestamp: %u\n", brIt->second->recv->received_tstamp_tcp);
+					printf("tstamps: %lu, rdb-stamps: %lu", brIt->second->tstamps_tcp.size(), brIt->second->recv->rdb_tstamps_tcp.size());
 				}
 #endif
 			}
@@ -964,16 +1102,97 @@ bool RangeManager::insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_ty
 }
 
 
+/*
+  Split the range at seq, and insert the end part into ranges.
+  In single-pass mode ACKs are registered as they are read, so a range may
+  already be acked when a retransmission splits it. The ACK state then
+  belongs to the end part, as that is where the ACKs would have been
+  registered if the range was split before the ACKs were processed.
+ */
+ByteRange* RangeManager::splitRangeEnd(ByteRange *br, seq64_t seq, insert_type itype)
+{
+	ByteRange *new_br = br->splitEnd(seq, br->endSeq, range_arena);
+	RangeMap::iterator it = ranges.insert(pair<seq64_t, ByteRange*>(new_br->startSeq, new_br)).first;
+
+	// Both parts hold the data of the transmissions matched against the receiver dump
+	if (itype == INSERT_RECV)
+		new_br->recv->sent_tstamps_tcp = br->recv->sent_tstamps_tcp;
+	if (itype == INSERT_SENT && br->isAcked()) {
+		br->moveAckState(new_br);
+		if (highestAckedByteRangeIt != ranges.end() && highestAckedByteRangeIt->second == br)
+			highestAckedByteRangeIt = it;
+	}
+	return new_br;
+}
+
+/*
+  Find the last range that ends at or before ack, which is the range
+  ack is an ACK on if it does not ACK any new data.
+  As the ranges do not overlap, their end sequence numbers are in the
+  same order as their start sequence numbers, so this is a search in
+  the range map instead of a walk back from the highest acked range.
+  Returns ranges.end() if all the ranges end after ack.
+ */
+RangeMap::iterator RangeManager::findAckedRange(seq64_t ack) {
+	RangeMap::iterator it = ranges.upper_bound(ack);
+	if (it == ranges.begin())
+		return ranges.end();
+	it--;
+	if (it->second->getEndSeq() <= ack)
+		return it;
+	if (it == ranges.begin())
+		return ranges.end();
+	return --it;
+}
+
+/*
+  Merge the SACK blocks of the ACK into the SACK scoreboard, and register
+  the time of the ACK as the SACK time of the ranges that it makes SACKed
+  in full. Only the ranges overlapping data that was not SACKed before are
+  looked at, so repeated blocks in the following ACKs cost a lookup each.
+ */
+void RangeManager::processSacks(DataSeg *seg) {
+	if (!sack_scoreboard.empty())
+		sack_scoreboard.ack(seg->ack);
+	if (!seg->sacks)
+		return;
+
+	for (size_t i = 0; i < seg->tcp_sacks.size(); i++) {
+		const SackBlock &block = seg->tcp_sacks[i];
+		// D-SACK blocks, and the parts of blocks below the cumulative ACK, are ignored
+		if (block.right <= seg->ack)
+			continue;
+		const vector<SackBlock> &added = sack_scoreboard.add(max(block.left, seg->ack), block.right);
+
+		for (size_t j = 0; j < added.size(); j++) {
+			RangeMap::iterator it = ranges.upper_bound(added[j].left);
+			if (it != ranges.begin())
+				it--;
+			for (; it != ranges.end() && it->second->getStartSeq() < added[j].right; it++) {
+				ByteRange *br = it->second;
+				if (!br->getNumBytes() || br->isAcked() || br->getSackTime())
+					continue;
+				if (seg->tstamp_pcap < br->getSendTime())
+					continue;
+				if (sack_scoreboard.covers(br->getStartSeq(), br->getEndSeq()))
+					br->insertSackTime(seg->tstamp_pcap);
+			}
+		}
+	}
+}
+
 /* Register first ack time for all bytes.
    Organize in ranges that have common send and ack times */
 bool RangeManager::processAck(DataSeg *seg) {
 	ByteRange* tmpRange;
-	map<seq64_t, ByteRange*>::iterator it, it_end, prev;
+	RangeMap::iterator it, it_end, prev;
 	bool ret = false;
 	seq64_t ack = seg->ack;
 	it = ranges.begin();
 	it_end = ranges.end();
 	ack_count++;
+	ack_frontier_valid = false;
+	processSacks(seg);
 
 	if (highestAckedByteRangeIt == ranges.end()) {
 		it = ranges.begin();
@@ -1031,12 +1250,12 @@ bool RangeManager::processAck(DataSeg *seg) {
 							// no ACK time should be registered for this ByteRange
 						}
 						else {
-							tmpRange->insertAckTime(&seg->tstamp_pcap);
+							tmpRange->insertAckTime(seg->tstamp_pcap);
 						}
 					}
 				}
 				else {
-					tmpRange->insertAckTime(&seg->tstamp_pcap);
+					tmpRange->insertAckTime(seg->tstamp_pcap);
 				}
 			}
 			else {
@@ -1049,7 +1268,7 @@ bool RangeManager::processAck(DataSeg *seg) {
 					}
 				}
 			}
-			if (seg->sacks)
+			if (seg->sacks && GlobOpts::print_packets)
 				it->second->registerSACKS(seg);
 			it->second->ack_count++;
 			highestAckedByteRangeIt = it;
@@ -1064,7 +1283,7 @@ bool RangeManager::processAck(DataSeg *seg) {
 			if (DEBUGL_SENDER(3) && debug_print)
 				printf("  Covers more than Range(%s)\n", STR_ABSOLUTE_SEQNUM_PAIR(tmpRange->getStartSeq(), tmpRange->getEndSeq()));
 #endif
-			if (timercmp(&seg->tstamp_pcap, &(tmpRange->sent_tstamp_pcap[0].first), <)) {
+			if (seg->tstamp_pcap < tmpRange->sent_tstamp_pcap[0].first) {
 				if (DEBUGL_SENDER(1)) {
 					fprintf(stderr, "ACK TIME IS EARLIER THAN SEND TIME!\n");
 					warn_with_file_and_linenum(__FILE__, __LINE__);
@@ -1073,7 +1292,7 @@ bool RangeManager::processAck(DataSeg *seg) {
 			}
 
 			if (!tmpRange->isAcked()) {
-				tmpRange->insertAckTime(&seg->tstamp_pcap);
+				tmpRange->insertAckTime(seg->tstamp_pcap);
 #ifdef DEBUG
 				//if (tmpRange->getNumBytes() == 0) {
 				//	fprintf(stderr, "Insert acktime 2 on %s\n", tmpRange->str().c_str());
@@ -1092,8 +1311,8 @@ bool RangeManager::processAck(DataSeg *seg) {
 				printf("  Covers parts of  Range(%s)\n", STR_ABSOLUTE_SEQNUM_PAIR(tmpRange->getStartSeq(), tmpRange->getEndSeq()));
 			}
 #endif
-			ByteRange *new_br = tmpRange->splitEnd(ack, tmpRange->endSeq);
-			tmpRange->insertAckTime(&seg->tstamp_pcap);
+			ByteRange *new_br = tmpRange->splitEnd(ack, tmpRange->endSeq, range_arena);
+			tmpRange->insertAckTime(seg->tstamp_pcap);
 #ifdef DEBUG
 			if (tmpRange->getNumBytes() == 0) {
 				printf("Insert acktime 3 on %s\n", tmpRange->str().c_str());
@@ -1131,7 +1350,7 @@ bool RangeManager::processAck(DataSeg *seg) {
 					prev->second->ack_count++;
 					return true;
 				}
-				if (prev->second->packet_sent_count == prev->second->getDataSentCount())
+				if (prev->second->packet_sent_count == prev->second->getDataSentCount() || prev == ranges.begin())
 					break;
 				prev--;
 			} while (true);
@@ -1139,21 +1358,14 @@ bool RangeManager::processAck(DataSeg *seg) {
 
 		// ACK on old data, just ignore
 		if (ack < tmpRange->getEndSeq()) {
-			do {
-				//printf("ack: %llu, prev->end: %llu\n", ack, prev->second->getEndSeq());
-				if (ack == prev->second->getEndSeq()) {
-					prev->second->ack_count++;
-					return true;
-				}
-
-				if (ack > prev->second->getEndSeq()) {
-					//if (ack == prev->second->getStartSeq())
-						//printf("ack is bigger: %llu, prev->end: %llu\n", ack, prev->second->getEndSeq());
-					return true;
-				}
-			} while (prev-- != ranges.begin());
+			prev = findAckedRange(ack);
+			if (prev == it_end)
+				return false;
 
-			return false;
+			if (ack == prev->second->getEndSeq()) {
+				prev->second->ack_count++;
+			}
+			return true;
 		}
 
 		/* If we get here, something's gone wrong */
@@ -1182,126 +1394,227 @@ bool RangeManager::processAck(DataSeg *seg) {
 	}
 
 
+RangeStatsState::RangeStatsState()
+	: started(false), first_data_seq(0), first_data_ack(0), pifs(0), first_send_us(0)
+	, itt_started(false), prev_send_us(0)
+{
+	// Only the per packet and per segment stats are written from packet_stats
+	packet_stats = !GlobOpts::stream_horizon_ms || GlobOpts::genPerPacketStats || GlobOpts::genPerSegmentStats;
+}
+
 void RangeManager::genStats(PacketsStats *bs) {
-	map<seq64_t, ByteRange*>::iterator it, it_end, last_acked = ranges.end();
-	long latency;
-	uint32_t tmp_byte_count;
+	RangeMap::iterator it, it_end;
+	RangeStatsState st;
 	bs->latency.min = bs->packet_length.min = bs->itt.min = (numeric_limits<ullint_t>::max)();
-	ulong dupack_count;
-	SegmentStats psTmp;
-	int16_t pifs = 0;
+
+	// Continue after the ranges folded into the statistics by retireRanges()
+	if (retired_count) {
+		*bs = retired_stats;
+		st = retired_state;
+	}
 
 	it = analyse_range_start;
 	it_end = analyse_range_end;
 
-	for (it = analyse_range_start; it != analyse_range_end; it++) {
+	if (!st.started)
+		startStats(st, it, it_end, false);
+	if (st.started)
+		printf("Last acked set to %lld, ackTime: %lld\n", st.first_data_seq, (llint_t) TS_TO_MS(st.first_data_ack));
+
+	for (; it != it_end; it++)
+		addRangeStats(bs, st, it, it_end, false);
+
+	finishStats(bs, st);
+}
+
+/*
+  The packets in flight are counted from the first range with data. When
+  streaming, that range must also be acked, else false is returned.
+ */
+bool RangeManager::startStats(RangeStatsState &st, RangeMap::iterator it, RangeMap::iterator it_end, bool streaming) {
+	st.last_acked = ranges.end();
+	for (; it != it_end; it++) {
 		if (it->second->getOrinalPayloadSize()) {
-			last_acked = it;
-			printf("Last acked set to %lld, ackTime: %lld\n", it->second->startSeq, (llint_t) TV_TO_MS(last_acked->second->ackTime));
+			if (streaming && !it->second->isAcked())
+				return false;
+			st.last_acked = it;
+			st.first_data_seq = it->second->startSeq;
+			st.first_data_ack = it->second->ackTime;
+			st.started = true;
 			break;
 		}
 	}
+	return st.started || !streaming;
+}
 
-	it = analyse_range_start;
-	for (; it != it_end; it++) {
-		// Skip if invalid (negative) latency
-		tmp_byte_count = static_cast<uint32_t>(it->second->getOrinalPayloadSize());
-
-		if (tmp_byte_count) {
-			pifs++;
+/*
+  Adds the range at it to the stats. When streaming, the range is not added,
+  and false is returned, if the packets in flight when it was sent depend on
+  ranges that are not acked yet.
+ */
+bool RangeManager::addRangeStats(PacketsStats *bs, RangeStatsState &st, RangeMap::iterator it, RangeMap::iterator it_end, bool streaming) {
+	ByteRange *br = it->second;
+	long latency;
+	ulong dupack_count;
+	SegmentStats psTmp;
 
-			bs->packet_length.add(static_cast<ullint_t>(tmp_byte_count));
-			for (int i = 0; i < it->second->getNumRetrans(); i++) {
-				bs->packet_length.add(static_cast<ullint_t>(tmp_byte_count));
+	if (streaming && br->acked) {
+		RangeMap::iterator last_acked = st.last_acked;
+		for (size_t i = 0; i < br->sent_tstamp_pcap.size(); i++) {
+			if (br->getSentType(i) != ST_PKT)
+				continue;
+			int64_t sent_us = TS_TO_US(br->sent_tstamp_pcap[i].first);
+			while (last_acked != ranges.end() && sent_us > TS_TO_US(last_acked->second->ackTime)) {
+				if (!last_acked->second->isAcked())
+					return false;
+				last_acked++;
 			}
+			if (last_acked == ranges.end())
+				return false;
 		}
+	}
 
-		for (size_t i = 0; i < it->second->sent_tstamp_pcap.size(); i++) {
-			if (it->second->sent_tstamp_pcap[i].second) {
-				if (it->second->sent_tstamp_pcap[i].second == ST_PKT) {
-					psTmp = SegmentStats(ST_PKT, conn->getConnKey(), TV_TO_MICSEC(it->second->sent_tstamp_pcap[i].first), static_cast<uint16_t>(tmp_byte_count));
-					psTmp.sojourn_times = it->second->getSojournTimes();
-					psTmp.ack_latency_usec = static_cast<int>(it->second->getSendAckTimeDiff(this));
+	// Skip if invalid (negative) latency
+	uint32_t tmp_byte_count = static_cast<uint32_t>(br->getOrinalPayloadSize());
 
-					if (it->second->acked) {
-						int64_t sent_ms = TV_TO_MICSEC(it->second->sent_tstamp_pcap[i].first);
-						char t_but[30];
-						sprint_time_ms_prec(t_but, it->second->ackTime);
+	if (tmp_byte_count) {
+		st.pifs++;
 
-						while (last_acked != ranges.end() &&
-							   sent_ms > TV_TO_MICSEC(last_acked->second->ackTime)) {
-							pifs--;
-							last_acked++;
-						}
-					}
+		bs->packet_length.add(static_cast<ullint_t>(tmp_byte_count));
+		for (int i = 0; i < br->getNumRetrans(); i++) {
+			bs->packet_length.add(static_cast<ullint_t>(tmp_byte_count));
+		}
+	}
 
-					psTmp.pifs = pifs;
-				}
-				else if (it->second->sent_tstamp_pcap[i].second == ST_RTR) {
-					// This is a retransmit
-					// In case a collapsed retrans packet spans multiple segments, check if next range has retrans data
-					// that is not a retrans packet in itself
-
-					uint32_t tmp_byte_count2 = tmp_byte_count;
-					map<seq64_t, ByteRange*>::iterator it_tmp = it;
-					if (++it_tmp != it_end) {
-						if (it_tmp->second->packet_retrans_count < it_tmp->second->data_retrans_count) {
-							tmp_byte_count2 += it_tmp->second->data_retrans_count * it_tmp->second->byte_count;
-						}
-					}
-					psTmp = SegmentStats(ST_RTR, conn->getConnKey(), TV_TO_MICSEC(it->second->sent_tstamp_pcap[i].first), tmp_byte_count2);
-					psTmp.pifs = pifs;
-				}
-				else if (it->second->sent_tstamp_pcap[i].second == ST_PURE_ACK) {
-					psTmp = SegmentStats(ST_PURE_ACK, conn->getConnKey(), TV_TO_MICSEC(it->second->sent_tstamp_pcap[i].first), 0);
-				}
-				else if (it->second->sent_tstamp_pcap[i].second == ST_RST) {
-					psTmp = SegmentStats(ST_RST, conn->getConnKey(), TV_TO_MICSEC(it->second->sent_tstamp_pcap[i].first), 0);
-				}
-				bs->addPacketStats(psTmp);
+	for (size_t i = 0; i < br->sent_tstamp_pcap.size(); i++) {
+		if (!br->getSentType(i))
+			continue;
+		int64_t sent_us = TS_TO_US(br->sent_tstamp_pcap[i].first);
+		uint32_t size = 0;
+
+		if (br->getSentType(i) == ST_PKT) {
+			size = tmp_byte_count;
+			if (st.packet_stats) {
+				psTmp = SegmentStats(ST_PKT, conn->getConnKey(), sent_us, static_cast<uint16_t>(tmp_byte_count));
+				psTmp.sojourn_times = br->getSojournTimes();
+				psTmp.ack_latency_usec = static_cast<int>(br->getSendAckTimeDiff(this));
 			}
-		}
 
-		dupack_count = it->second->dupack_count;
+			if (br->acked) {
+				while (st.last_acked != ranges.end() &&
+					   sent_us > TS_TO_US(st.last_acked->second->ackTime)) {
+					st.pifs--;
+					st.last_acked++;
+				}
+			}
 
-		// Make sure the vector has enough space
-		for (ulong i = bs->dupacks.size(); i < dupack_count; i++) {
-			bs->dupacks.push_back(0);
+			psTmp.pifs = st.pifs;
 		}
+		else if (br->getSentType(i) == ST_RTR) {
+			// This is a retransmit
+			// In case a collapsed retrans packet spans multiple segments, check if next range has retrans data
+			// that is not a retrans packet in itself
 
-		for (ulong i = 0; i < dupack_count; i++) {
-			bs->dupacks[i]++;
+			size = tmp_byte_count;
+			RangeMap::iterator it_tmp = it;
+			if (++it_tmp != it_end) {
+				if (it_tmp->second->packet_retrans_count < it_tmp->second->data_retrans_count) {
+					size += it_tmp->second->data_retrans_count * it_tmp->second->byte_count;
+				}
+			}
+			psTmp = SegmentStats(ST_RTR, conn->getConnKey(), sent_us, size);
+			psTmp.pifs = st.pifs;
 		}
-
-		if ((latency = it->second->getSendAckTimeDiff(this))) {
-			bs->latency.add(static_cast<ullint_t>(latency));
-		} else {
-			if (!it->second->isAcked())
-				continue;
+		else if (br->getSentType(i) == ST_PURE_ACK) {
+			psTmp = SegmentStats(ST_PURE_ACK, conn->getConnKey(), sent_us, 0);
+		}
+		else if (br->getSentType(i) == ST_RST) {
+			psTmp = SegmentStats(ST_RST, conn->getConnKey(), sent_us, 0);
 		}
 
-		ulong retrans = static_cast<ulong>(it->second->getNumRetrans());
-		// Make sure the vector has enough space
-		for (ulong i = bs->retrans.size(); i < retrans; i++) {
-			bs->retrans.push_back(0);
+		if (st.packet_stats) {
+			bs->addPacketStats(psTmp);
 		}
-		for (ulong i = 0; i < retrans; i++) {
-			bs->retrans[i]++;
+		else {
+			if (!st.first_send_us || sent_us < st.first_send_us)
+				st.first_send_us = sent_us;
+			if (size)
+				st.data_send_us.push(sent_us);
 		}
 	}
 
-	std::sort(bs->packet_stats.begin(), bs->packet_stats.end());
+	dupack_count = br->dupack_count;
+
+	// Make sure the vector has enough space
+	for (ulong i = bs->dupacks.size(); i < dupack_count; i++) {
+		bs->dupacks.push_back(0);
+	}
+
+	for (ulong i = 0; i < dupack_count; i++) {
+		bs->dupacks[i]++;
+	}
+
+	if ((latency = br->getSendSackTimeDiff())) {
+		bs->sack_latency.add(static_cast<ullint_t>(latency));
+	}
+
+	if ((latency = br->getSendAckTimeDiff(this))) {
+		bs->latency.add(static_cast<ullint_t>(latency));
+	} else {
+		if (!br->isAcked())
+			return true;
+	}
+
+	ulong retrans = static_cast<ulong>(br->getNumRetrans());
+	// Make sure the vector has enough space
+	for (ulong i = bs->retrans.size(); i < retrans; i++) {
+		bs->retrans.push_back(0);
+	}
+	for (ulong i = 0; i < retrans; i++) {
+		bs->retrans[i]++;
+	}
+	return true;
+}
 
-	PacketStats prev = bs->packet_stats[0];
+/*
+  Without packet_stats: adds the ITTs of the data packets sent before
+  before_us, in send order. Only the last packet folded is kept.
+ */
+void RangeManager::foldITTs(PacketsStats *bs, RangeStatsState &st, int64_t before_us) {
+	while (!st.data_send_us.empty() && st.data_send_us.top() < before_us) {
+		int64_t sent_us = st.data_send_us.top();
+		st.data_send_us.pop();
+
+		if (!st.itt_started) {
+			st.itt_started = true;
+			st.prev_send_us = st.first_send_us;
+			if (sent_us == st.first_send_us)
+				continue;
+		}
+		// Only a packet captured out of time order is sent before the last one folded
+		bs->itt.add((ullint_t) max<int64_t>(sent_us - st.prev_send_us, 0));
+		st.prev_send_us = max(sent_us, st.prev_send_us);
+	}
+}
+
+void RangeManager::finishStats(PacketsStats *bs, RangeStatsState &st) {
 	long itt;
-	for (size_t i = 1; i < bs->packet_stats.size(); i++) {
-		// We skip pure ACKs when calculating ITTs
-		if (!bs->packet_stats[i].size)
-			continue;
-		itt = bs->packet_stats[i].send_time_us - prev.send_time_us;
-		bs->itt.add((ullint_t) itt);
-		bs->packet_stats[i].itt_usec = (int) itt;
-		prev = bs->packet_stats[i];
+	if (st.packet_stats) {
+		std::sort(bs->packet_stats.begin(), bs->packet_stats.end());
+
+		PacketStats prev = bs->packet_stats[0];
+		for (size_t i = 1; i < bs->packet_stats.size(); i++) {
+			// We skip pure ACKs when calculating ITTs
+			if (!bs->packet_stats[i].size)
+				continue;
+			itt = bs->packet_stats[i].send_time_us - prev.send_time_us;
+			bs->itt.add((ullint_t) itt);
+			bs->packet_stats[i].itt_usec = (int) itt;
+			prev = bs->packet_stats[i];
+		}
+	}
+	else {
+		foldITTs(bs, st, numeric_limits<int64_t>::max());
 	}
 
     bs->latency.makeStats();
@@ -1309,6 +1622,64 @@ void RangeManager::genStats(PacketsStats *bs) {
     bs->itt.makeStats();
 }
 
+/*
+  With --stream-horizon: folds the ranges ACKed more than the horizon before
+  now into the statistics, and frees them. A range is only retired with the
+  range following it, as its stats look at that range. The highest acked
+  range, which the ACKs are matched from, is never retired.
+ */
+void RangeManager::retireRanges(tstamp_t now) {
+	if (highestAckedByteRangeIt == ranges.end())
+		return;
+
+	const tstamp_t horizon = now - (tstamp_t) GlobOpts::stream_horizon_ms * NSEC_PER_MSEC;
+	const seq64_t highest_acked = highestAckedByteRangeIt->first;
+	ack_frontier_valid = false;
+	RangeMap::iterator it = retired_count ? retired_end : ranges.begin();
+	RangeMap::iterator next = it;
+
+	if (!retired_state.started && !startStats(retired_state, it, ranges.end(), true))
+		return;
+
+	for (; it->first < highest_acked; it = next) {
+		if (!it->second->isAcked() || it->second->ackTime > horizon)
+			break;
+		next++;
+		if (next->first >= highest_acked || !next->second->isAcked() || next->second->ackTime > horizon)
+			break;
+		if (!addRangeStats(&retired_stats, retired_state, it, ranges.end(), true))
+			break;
+		calculateRealLoss(it, next);
+
+		if (!retired_count++)
+			retired_first_send = it->second->getSendTime();
+		if (!retired_data && it->second->getNumBytes()) {
+			retired_data_seq = it->second->startSeq;
+			retired_data = true;
+		}
+		retired_seq = max(retired_seq, it->second->endSeq);
+	}
+	retired_end = it;
+
+	// Data is sent in sequence order, so the ranges not retired are sent from the first one
+	if (!retired_state.packet_stats)
+		foldITTs(&retired_stats, retired_state, TS_TO_US(it->second->getSendTime()));
+
+	// Free the retired ranges, up to the first range the packets in flight are counted from
+	RangeMap::iterator last = it;
+	if (retired_state.last_acked->first < last->first)
+		last = retired_state.last_acked;
+
+	size_t count = 0;
+	for (it = ranges.begin(); it != last; it++, count++)
+		range_arena.release(it->second);
+	ranges.pop_front(count);
+}
+
+tstamp_t RangeManager::getFirstSendTime() {
+	return retired_count ? retired_first_send : ranges.begin()->second->getSendTime();
+}
+
 /* Check that every byte from firstSeq to lastSeq is present.
    Print number of ranges.
    Print number of sent bytes (payload).
@@ -1319,7 +1690,7 @@ void RangeManager::validateContent() {
 	int numSendTimes = 0;
 	seq64_t tmpEndSeq = 0;
 
-	map<seq64_t, ByteRange*>::iterator first, it, it_end, prev;
+	RangeMap::iterator first, it, it_end, prev;
 	first = it = ranges.begin();
 	it_end = ranges.end();
 	prev = it_end;
@@ -1327,7 +1698,7 @@ void RangeManager::validateContent() {
 	/* FirstRange.startSeq == firstSeq
 	   LastRange.endSeq == lastSeq
 	   every packet in between are aligned */
-	if (it->second->getStartSeq() != 0) {
+	if (it->second->getStartSeq() != 0 && !retired_count) {
 		printf("firstSeq: %u, StartSeq: %llu\n", firstSeq, it->second->getStartSeq());
 		printf("RangeManager::validateContent: firstSeq != StartSeq (%llu != %llu)\n", get_print_seq(it->second->getStartSeq()), get_print_seq(firstSeq));
 		printf("First range (%llu, %llu)\n", get_print_seq(it->second->getStartSeq()), get_print_seq(it->second->getEndSeq()));
@@ -1452,7 +1823,7 @@ void RangeManager::printPacketDetails() {
 	this->printPacketDetails(analyse_range_start, analyse_range_end);
 }
 
-void RangeManager::printPacketDetails(map<seq64_t, ByteRange*>::iterator it, map<seq64_t, ByteRange*>::iterator it_end) {
+void RangeManager::printPacketDetails(RangeMap::iterator it, RangeMap::iterator it_end) {
 
 	int seq_char_len = (int) to_string(get_print_seq(ranges.rbegin()->second->endSeq)).length();
 	int rel_seq_char_len = (int) to_string(ranges.rbegin()->second->endSeq).length();
@@ -1509,6 +1880,8 @@ void RangeManager::printPacketDetails(map<seq64_t, ByteRange*>::iterator it, map
 		printf(", dupACKs: %d", it->second->dupack_count);
 
 		printf(", ACKtime: %.1f", (double) it->second->getSendAckTimeDiff(this) / 1000.0);
+		if (it->second->getSackTime())
+			printf(", SACKtime: %.1f", (double) it->second->getSendSackTimeDiff() / 1000.0);
 
 		if (not GlobOpts::sojourn_time_file.empty()) {
 			if (it->second->sojourn_time) {
@@ -1570,21 +1943,21 @@ void RangeManager::printPacketDetails(map<seq64_t, ByteRange*>::iterator it, map
 			printf(" FAIL (RDB hit/miss calculalation has failed)!");
 		}
 
-		if (it->second->tcp_sacks.size() > 0) {
-			for (auto &sack_blocks : it->second->tcp_sacks) {
+		if (it->second->cold && it->second->cold->tcp_sacks.size() > 0) {
+			for (auto &sack_blocks : it->second->cold->tcp_sacks) {
 				printf("\n");
 				for (size_t i = 0;  i < sack_blocks.size(); i++) {
 
 					char prefix = ' ';
-					if (i == 0 && sack_blocks[0].first < it->second->endSeq) {
+					if (i == 0 && sack_blocks[0].left < it->second->endSeq) {
 						prefix = 'D';
 					}
-					else if (i == 1 && !after(uint32_t(sack_blocks[0].second), uint32_t(sack_blocks[1].second)) && !before(uint32_t(sack_blocks[0].first), uint32_t(sack_blocks[1].first))) {
+					else if (i == 1 && !after(uint32_t(sack_blocks[0].right), uint32_t(sack_blocks[1].right)) && !before(uint32_t(sack_blocks[0].left), uint32_t(sack_blocks[1].left))) {
 						prefix = 'd';
 					}
 
 					printf("%cSACK (%4llu - %4llu) ", prefix,
-						   get_print_seq(sack_blocks[i].first), get_print_seq(sack_blocks[i].second));
+						   get_print_seq(sack_blocks[i].left), get_print_seq(sack_blocks[i].right));
 				}
 			}
 		}
@@ -1599,7 +1972,7 @@ void RangeManager::calculateRetransAndRDBStats() {
 	calculateRealLoss(analyse_range_start, analyse_range_end);
 }
 
-void RangeManager::calculateRealLoss(map<seq64_t, ByteRange*>::iterator brIt, map<seq64_t, ByteRange*>::iterator brIt_end) {
+void RangeManager::calculateRealLoss(RangeMap::iterator brIt, RangeMap::iterator brIt_end) {
 	ByteRange *prev = NULL;
 	ulong index = 0;
 	int lost_tmp = 0;
@@ -1724,13 +2097,17 @@ void RangeManager::calculateRealLoss(map<seq64_t, ByteRange*>::iterator brIt, ma
 
 				// Must check if this lost packet is the same packet as for the previous range
 				if (prev_pack_lost) {
-					for (ulong i = 0; i < brIt->second->lost_tstamps_tcp.size(); i++) {
-						for (ulong u = 0; u < prev->lost_tstamps_tcp.size(); u++) {
-							if (brIt->second->lost_tstamps_tcp[i].first == prev->lost_tstamps_tcp[u].first) {
+					const SmallVector<SentTstamp, 1> &sent = brIt->second->recv->sent_tstamps_tcp;
+					const SmallVector<SentTstamp, 1> &prev_sent = prev->recv->sent_tstamps_tcp;
+					for (ulong i = 0; i < sent.size(); i++) {
+						if (sent[i].received)
+							continue;
+						for (ulong u = 0; u < prev_sent.size(); u++) {
+							if (!prev_sent[u].received && sent[i].tstamp_tcp == prev_sent[u].tstamp_tcp) {
 								lost -= 1;
 								if (!lost) {
-									i = brIt->second->lost_tstamps_tcp.size();
-									u = prev->lost_tstamps_tcp.size();
+									i = sent.size();
+									u = prev_sent.size();
 								}
 							}
 						}
@@ -1779,29 +2156,58 @@ ByteRange* RangeManager::getHighestAcked() {
 	return highestAckedByteRangeIt->second;
 }
 
+/*
+  Find the last range with an ACK time, and count the ranges after it.
+  This is done once after the ranges were last changed, instead of for
+  each unacked range that the latency is looked up for.
+ */
+void RangeManager::findAckFrontier() {
+	RangeMap::reverse_iterator it, it_end = ranges.rend();
+	unacked_tail_count = 0;
+	for (it = ranges.rbegin(); it != it_end; it++) {
+		if (it->second->ackTime)
+			break;
+		unacked_tail_count++;
+	}
+	ack_frontier_found = it != it_end;
+	ack_frontier_seq = ack_frontier_found ? it->second->getStartSeq() : 0;
+	ack_frontier_valid = true;
+}
+
+/*
+  Returns true if br comes after the last range with an ACK time, which is
+  presumably because the dump ended before the ranges were ACKed.
+ */
+bool RangeManager::isInUnackedTail(ByteRange *br) {
+	if (!ack_frontier_valid)
+		findAckFrontier();
+	return !ack_frontier_found || br->getStartSeq() > ack_frontier_seq;
+}
+
+/* Returns the number of ranges after the last range with an ACK time */
+ullint_t RangeManager::getUnackedTailCount() {
+	if (!ack_frontier_valid)
+		findAckFrontier();
+	return unacked_tail_count;
+}
+
 /*
    Returns duration of connection (in seconds)
 */
 double RangeManager::getDuration() {
-	map<seq64_t, ByteRange*>::iterator brIt_end = ranges.end();
+	RangeMap::iterator brIt_end = ranges.end();
 	brIt_end--;
 	return getDuration(brIt_end->second);
 }
 
 inline double RangeManager::getDuration(ByteRange *brLast) {
-	return getTimeInterval(ranges.begin()->second, brLast);
+	return TS_TO_MS(brLast->getSendTime() - getFirstSendTime()) / 1000.0;
 }
 
 /* Returns the difference between the start and end
    range in seconds */
 double getTimeInterval(ByteRange *start, ByteRange *end) {
-	timeval start_tv, current, tv;
-	double time;
-	start_tv = *(start->getSendTime());
-	current = *(end->getSendTime());
-	timersub(&current, &start_tv, &tv);
-	time = (tv.tv_sec * 1000 + (tv.tv_usec / 1000)) / 1000.0;
-	return time;
+	return TS_TO_MS(end->getSendTime() - start->getSendTime()) / 1000.0;
 }
 
 
@@ -1813,10 +2219,10 @@ void RangeManager::calculateLatencyVariation() {
 
 
 void RangeManager::registerRecvDiffs() {
-	map<seq64_t, ByteRange*>::iterator it, it_end;
+	RangeMap::iterator it, it_end;
 	it = ranges.begin();
 	it_end = ranges.end();
-	timeval *last_app_layer_tstamp = NULL;
+	tstamp_t last_app_layer_tstamp = 0;
 
 	for (; it != it_end; it++) {
 		if (!it->second->getDataReceivedCount()) {
@@ -1825,7 +2231,7 @@ void RangeManager::registerRecvDiffs() {
 
 		if (!GlobOpts::transport) {
 			if (it->second->app_layer_latency_tstamp)
-				last_app_layer_tstamp = &it->second->received_tstamp_pcap;
+				last_app_layer_tstamp = it->second->recv->received_tstamp_pcap;
 		}
 
 		/* Calculate diff and check for lowest value */
@@ -1834,11 +2240,11 @@ void RangeManager::registerRecvDiffs() {
 	}
 
 	if (DEBUGL_SENDER(3)) {
-		cerr << "SendTime: " << it->second->getSendTime()->tv_sec << "."
-			 << it->second->getSendTime()->tv_usec << endl;
+		cerr << "SendTime: " << TS_TO_SEC(it->second->getSendTime()) << "."
+			 << TS_TO_US(it->second->getSendTime() % NSEC_PER_SEC) << endl;
 		cerr << "RecvTime: ";
-		if (it->second->getRecvTime() != NULL)
-			cerr << it->second->getRecvTime()->tv_sec;
+		if (it->second->getRecvTime())
+			cerr << TS_TO_SEC(it->second->getRecvTime());
 		cerr << endl;
 	}
 }
@@ -1848,7 +2254,7 @@ void RangeManager::registerRecvDiffs() {
   This code should be looked at regarding type conversions (double -> long)!
 */
 void RangeManager::doDriftCompensation() {
-	map<seq64_t, ByteRange*>::iterator it, it_end;
+	RangeMap::iterator it, it_end;
 	it = analyse_range_start;
 	it_end = analyse_range_end;
 
@@ -1869,14 +2275,12 @@ void RangeManager::doDriftCompensation() {
 
 /* Calculate clock drift on CDF */
 int RangeManager::calculateClockDrift() {
-	map<seq64_t, ByteRange*>::iterator startIt, startDriftRange;
-	map<seq64_t, ByteRange*>::reverse_iterator endIt, endDriftRange;
+	RangeMap::iterator startIt, startDriftRange;
+	RangeMap::reverse_iterator endIt, endDriftRange;
 	long minDiffStart = std::numeric_limits<long>::max();
 	long minDiffEnd = std::numeric_limits<long>::max();
-	timeval minTimeStart, minTimeEnd, tv;
+	tstamp_t minTimeStart = 0, minTimeEnd = 0;
 	double durationSec, tmpDrift;
-	timerclear(&minTimeStart);
-	timerclear(&minTimeEnd);
 
 	startIt = ranges.begin();
 
@@ -1885,7 +2289,7 @@ int RangeManager::calculateClockDrift() {
 	for (uint64_t i = 0; i < n; i++) {
 		if (startIt->second->getRecvDiff() < minDiffStart) {
 			minDiffStart = startIt->second->getRecvDiff();
-			minTimeStart = *(startIt->second->getSendTime());
+			minTimeStart = startIt->second->getSendTime();
 			startDriftRange = startIt;
 		}
 		startIt++;
@@ -1896,23 +2300,22 @@ int RangeManager::calculateClockDrift() {
 		// RecvDiff == 0 means the diff was not calculated
 		if (endIt->second->getRecvDiff() < minDiffEnd && endIt->second->getRecvDiff() != 0) {
 			minDiffEnd = endIt->second->getRecvDiff();
-			minTimeEnd = *(endIt->second->getSendTime());
+			minTimeEnd = endIt->second->getSendTime();
 			endDriftRange = endIt;
 		}
 		endIt++;
 	}
 
-	if (!timerisset(&minTimeEnd) || !timerisset(&minTimeStart)) {
+	if (!minTimeEnd || !minTimeStart) {
 		fprintf(stderr, "Timevals have not been populated! minTimeStart is zero: %s, minTimeEnd is zero: %s\n",
-				!timerisset(&minTimeStart) ? "Yes" : "No", !timerisset(&minTimeEnd) ? "Yes" : "No");
+				!minTimeStart ? "Yes" : "No", !minTimeEnd ? "Yes" : "No");
 		warn_with_file_and_linenum(__FILE__, __LINE__);
 		drift = 0;
 		return 1;
 	}
 
 	/* Get time interval between values */
-	timersub(&minTimeEnd, &minTimeStart, &tv);
-	durationSec = tv.tv_sec + tv.tv_usec / 10000000;
+	durationSec = (double) TS_TO_SEC(minTimeEnd - minTimeStart);
 	tmpDrift = (double) (minDiffEnd - minDiffStart) / durationSec;
 
 	if (DEBUGL_SENDER(4)) {
@@ -1920,9 +2323,9 @@ int RangeManager::calculateClockDrift() {
 		printf("Using end   diff of range: %s\n", STR_ABSOLUTE_SEQNUM_PAIR(endDriftRange->second->getStartSeq(), endDriftRange->second->getEndSeq()));
 
 		printf("startMin: %lu\n", minDiffStart);
-		printf("startTime: %lu.%lu\n", (ulong) minTimeStart.tv_sec, (ulong) minTimeStart.tv_usec);
+		printf("startTime: %lu.%lu\n", tstamp_pair(minTimeStart));
 		printf("endMin: %lu\n", minDiffEnd);
-		printf("endTime: %lu.%lu\n", (ulong) minTimeEnd.tv_sec, (ulong) minTimeEnd.tv_usec);
+		printf("endTime: %lu.%lu\n", tstamp_pair(minTimeEnd));
 		printf("DurationSec: %g\n", durationSec);
 		printf("Clock drift: %g ms/s\n", tmpDrift);
 	}
@@ -1931,7 +2334,7 @@ int RangeManager::calculateClockDrift() {
 }
 
 void RangeManager::makeByteLatencyVariationCDF() {
-	map<seq64_t, ByteRange*>::iterator it, it_end;
+	RangeMap::iterator it, it_end;
 	it = analyse_range_start;
 	it_end = analyse_range_end;
 	map<const long, int>::iterator element, end, endAggr;
@@ -1967,14 +2370,14 @@ void RangeManager::makeByteLatencyVariationCDF() {
 
 
 void RangeManager::writeSentTimesAndQueueingDelayVariance(const int64_t first_tstamp, vector<csv::ofstream*> streams) {
-	map<seq64_t, ByteRange*>::iterator it, it_end;
+	RangeMap::iterator it, it_end;
 	it = analyse_range_start;
 	it_end = analyse_range_end;
 	string connKey = conn->getConnKey();
 
 	for (; it != it_end; it++) {
 		long diff = it->second->getRecvDiff() - lowestRecvDiff;
-		int64_t ts = TV_TO_MS(it->second->sent_tstamp_pcap[it->second->send_tcp_stamp_recv_index].first);
+		int64_t ts = TS_TO_MS(it->second->sent_tstamp_pcap[it->second->send_tcp_stamp_recv_index].first);
 
 		//assert(diff >= 0 && "Negative diff, this shouldn't happen!");
 		if (diff >= 0) {
@@ -2003,17 +2406,17 @@ void RangeManager::writeByteLatencyVariationCDF(ofstream *stream) {
 }
 
 
-static inline uint64_t intervalIdx(const timeval& ts, int64_t first_tstamp) {
-	long relative_ts = TV_TO_MS(ts) - first_tstamp;
+static inline uint64_t intervalIdx(tstamp_t ts, int64_t first_tstamp) {
+	long relative_ts = TS_TO_MS(ts) - first_tstamp;
 	return (uint64_t) relative_ts / GlobOpts::lossAggrMs;
 }
 
 void RangeManager::calculateLossGroupedByInterval(const int64_t first_tstamp, vector<LossInterval>& all_loss, vector<LossInterval>& loss) {
 	assert(GlobOpts::withRecv && "Writing loss grouped by interval requires receiver trace");
 
-	vector<pair<uint32_t, timeval> >::iterator lossIt, lossEnd;
-	vector<pair<timeval, sent_type> >::iterator sentIt, sentEnd;
-	map<seq64_t, ByteRange*>::iterator range;
+	SmallVector<SentTstamp, 1>::const_iterator lossIt, lossEnd;
+	SmallVector<pair<tstamp_t, sent_type>, 1>::const_iterator sentIt, sentEnd;
+	RangeMap::iterator range;
 
 	// Extract total values from ranges
 	typedef vector<double> lossvec;
@@ -2058,12 +2461,14 @@ void RangeManager::calculateLossGroupedByInterval(const int64_t first_tstamp, ve
 
 	// Calculate loss values
 	for (range = analyse_range_start; range != analyse_range_end; ++range) {
-		lossIt = range->second->lost_tstamps_tcp.begin();
-		lossEnd = range->second->lost_tstamps_tcp.end();
+		lossIt = range->second->recv->sent_tstamps_tcp.begin();
+		lossEnd = range->second->recv->sent_tstamps_tcp.end();
+		while (lossIt != lossEnd && lossIt->received)
+			++lossIt;
 
 		if (lossIt != lossEnd &&
 			range->second->packet_sent_count > 0 &&
-			lossIt->second == range->second->sent_tstamp_pcap[0].first) {
+			lossIt->tstamp_pcap == range->second->sent_tstamp_pcap[0].first) {
 			uint64_t bucket_idx = intervalIdx(range->second->sent_tstamp_pcap[0].first, first_tstamp);
 
 			while (bucket_idx >= loss.size()) {
@@ -2075,7 +2480,9 @@ void RangeManager::calculateLossGroupedByInterval(const int64_t first_tstamp, ve
 
 		// Place loss values in the right bucket
 		for (; lossIt != lossEnd; ++lossIt) {
-			uint64_t bucket_idx = intervalIdx(lossIt->second, first_tstamp);
+			if (lossIt->received)
+				continue;
+			uint64_t bucket_idx = intervalIdx(lossIt->tstamp_pcap, first_tstamp);
 
 			while (bucket_idx >= loss.size()) {
 				loss.push_back(LossInterval(0, 0, 0));
@@ -2108,7 +2515,7 @@ void RangeManager::calculateLossGroupedByInterval(const int64_t first_tstamp, ve
 */
 void RangeManager::genAckLatencyData(const int64_t first_tstamp, vector<SPNS::shared_ptr<vector <LatencyItem> > > &diff_times,
 									 const string& connKey) {
-	map<seq64_t, ByteRange*>::iterator it, it_end;
+	RangeMap::iterator it, it_end;
 	it = analyse_range_start;
 	it_end = analyse_range_end;
 
@@ -2123,7 +2530,7 @@ void RangeManager::genAckLatencyData(const int64_t first_tstamp, vector<SPNS::sh
 			ack_time_ms /= 1000;
 			num_retr_tmp = (ulong) it->second->getNumRetrans();
 
-			send_time_ms = TV_TO_MS(it->second->sent_tstamp_pcap[0].first);
+			send_time_ms = TS_TO_MS(it->second->sent_tstamp_pcap[0].first);
 			send_time_ms -= first_tstamp;
 
 			if (num_retr_tmp >= diff_times.size()) {
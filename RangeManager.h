@@ -1,9 +1,14 @@
 #ifndef RANGEMANAGER_H
 #define RANGEMANAGER_H
 
+#include <queue>
+
 #include "common.h"
 #include "statistics_common.h"
 #include "time_util.h"
+#include "RangeMap.h"
+#include "ByteRangeArena.h"
+#include "SackScoreboard.h"
 
 enum received_type {DEF, DATA, RDB, RETR};
 
@@ -15,12 +20,40 @@ extern const char *received_type_str[4];
 class ByteRange;
 class Connection;
 
+/* What genStats carries from one range to the next */
+struct RangeStatsState {
+	bool started;
+	RangeMap::iterator last_acked;   // The first range that may still be in flight
+	seq64_t first_data_seq;          // The range last_acked started at, and its ACK time
+	tstamp_t first_data_ack;
+	int16_t pifs;                    // Packets in flight
+	bool packet_stats;               // Keep the stats of each packet, else only what the ITTs need
+	int64_t first_send_us;           // Without packet_stats: the first packet sent,
+	priority_queue<int64_t, vector<int64_t>, greater<int64_t> > data_send_us;  // the packets sent with data not yet folded into the ITTs,
+	bool itt_started;
+	int64_t prev_send_us;            // and the last one folded
+
+	RangeStatsState();
+};
+
+/* A segment from the receiver dump, kept in capture order until joinReceivedRanges() */
+struct RecvRecord {
+	seq64_t seq;
+	seq64_t endSeq;
+	tstamp_t tstamp_pcap;
+	uint32_t tstamp_tcp;
+	uint16_t payloadSize;
+	uint16_t window;
+	u_char flags;
+	uint32_t index;        /* Capture order on the connection */
+};
+
 /* Has responsibility for managing ranges, creating,
    inserting and resizing ranges as sent packets and ACKs
    are received */
 class RangeManager {
 private:
-	timeval highestRecvd;
+	tstamp_t highestRecvd;
 	int redundantBytes;
 	long lowestRecvDiff; /* Lowest pcap packet diff */
 	double drift; /* Clock drift (ms/s) */
@@ -28,15 +61,38 @@ private:
 	int minimum_segment_size;
 	int maximum_segment_size;
 
-	map<seq64_t, ByteRange*>::iterator highestAckedByteRangeIt;
+	RangeMap::iterator highestAckedByteRangeIt;
+	ByteRangeArena range_arena; /* Owns the ByteRanges in ranges */
+	SackScoreboard sack_scoreboard; /* The data SACKed above the cumulative ACK */
+
+	/* The last range with an ACK time, found again after the ranges change */
+	bool ack_frontier_valid;
+	bool ack_frontier_found;
+	seq64_t ack_frontier_seq;      /* Start of the last range with an ACK time */
+	ullint_t unacked_tail_count;   /* Ranges after it */
 	map<const long, int> byteLatencyVariationCDFValues;
+	vector<RecvRecord> recv_records; /* Received segments not yet inserted, with --recv-join */
+
+	/* The statistics of the retired ranges, with --stream-horizon */
+	PacketsStats retired_stats;
+	RangeStatsState retired_state;
+	tstamp_t retired_first_send;     /* Send time of the first range */
+
+	RangeMap::iterator findAckedRange(seq64_t ack);
+	void processSacks(DataSeg *seg);
+	void findAckFrontier();
+	void insertRecvRecord(const RecvRecord &rec);
+	bool startStats(RangeStatsState &st, RangeMap::iterator it, RangeMap::iterator it_end, bool streaming);
+	bool addRangeStats(PacketsStats *bs, RangeStatsState &st, RangeMap::iterator it, RangeMap::iterator it_end, bool streaming);
+	void foldITTs(PacketsStats *bs, RangeStatsState &st, int64_t before_us);
+	void finishStats(PacketsStats *bs, RangeStatsState &st);
 
 public:
-	map<seq64_t, ByteRange*> ranges;
+	RangeMap ranges;
 	seq32_t firstSeq; /* The absolute start sequence number */
 	seq64_t lastSeq;  /* Global relative end sequence number (Equals the number of unique bytes) */
 
-	map<seq64_t, ByteRange*>::iterator first_to_analyze, last_to_analyze;
+	RangeMap::iterator first_to_analyze, last_to_analyze;
 
 	// The number of RDB bytes that were redundant and not
 	int rdb_packet_misses;
@@ -54,14 +110,25 @@ public:
 		analysed_data_packet_count,
 		analysed_syn_count, analysed_fin_count, analysed_rst_count, analysed_pure_acks_count;
 	uint16_t analysed_max_range_payload;
-
-	map<seq64_t, ByteRange*>::iterator analyse_range_start, analyse_range_last, analyse_range_end;
+	ullint_t insert_append_count;  /* Segments appended after the last range */
+	ullint_t insert_count;         /* Segments inserted among the existing ranges */
+	ullint_t insert_part_count;    /* Parts, after the first, of segments overlapping more than one range */
+	ullint_t retired_count;        /* Ranges folded into the statistics by retireRanges() */
+	ullint_t retired_late_count;   /* Segments ignored as they only held data that was retired */
+	seq64_t retired_seq;           /* The end of the retired data */
+	RangeMap::iterator retired_end; /* The first range that is not retired */
+	seq64_t retired_data_seq;      /* Start of the first range with data, if retired_data */
+	bool retired_data;
+	ullint_t recv_joined_count;    /* Received segments with data inserted by joinReceivedRanges() */
+	ullint_t recv_split_count;     /* Ranges it split, where a segment starts or ends inside one */
+
+	RangeMap::iterator analyse_range_start, analyse_range_last, analyse_range_end;
 	long analyse_time_sec_start, analyse_time_sec_end;
 
 	Connection *conn;
 public:
 	RangeManager(Connection *c, seq32_t first_seq) :
-		redundantBytes(0), lastSeq(0),
+		redundantBytes(0), range_arena(ByteRangeArena::defaultProfile()), lastSeq(0),
 		rdb_packet_misses(0), rdb_packet_hits(0), rdb_byte_miss(0),
 		rdb_byte_hits(0), analysed_lost_bytes(0),
 		analysed_lost_ranges_count(0), analysed_sent_ranges_count(0),
@@ -73,23 +140,36 @@ public:
 		analysed_packet_sent_count_in_dump(0), analysed_packet_received_count(0),
 		analysed_sent_pure_ack_count(0), analysed_data_packet_count(0),
 		analysed_syn_count(0), analysed_fin_count(0), analysed_rst_count(0), analysed_pure_acks_count(0),
-		analysed_max_range_payload(0)
+		analysed_max_range_payload(0), insert_append_count(0), insert_count(0), insert_part_count(0),
+		retired_count(0), retired_late_count(0), retired_seq(0),
+		recv_joined_count(0), recv_split_count(0)
 	{
         conn = c;
         firstSeq = first_seq;
         lowestRecvDiff = std::numeric_limits<long>::max();
 		highestAckedByteRangeIt = ranges.end();
-		memset(&highestRecvd, 0, sizeof(highestRecvd));
+		ack_frontier_valid = false;
+		ack_frontier_found = false;
+		ack_frontier_seq = 0;
+		unacked_tail_count = 0;
+		highestRecvd = 0;
+		retired_first_send = 0;
+		retired_data_seq = 0;
+		retired_data = false;
 	};
 
-	~RangeManager();
-
 	void insertSentRange(sendData *sd);
 	void insertReceivedRange(sendData *sd);
+	void deferReceivedRange(sendData *sd);
+	void joinReceivedRanges();
 	bool processAck(DataSeg *seg);
 	void genStats(PacketsStats* bs);
+	void retireRanges(tstamp_t now);
+	tstamp_t getFirstSendTime();
 	ByteRange* getLastRange() {	return ranges.rbegin()->second;	}
 	ByteRange* getHighestAcked();
+	bool isInUnackedTail(ByteRange *br);
+	ullint_t getUnackedTailCount();
 	double getDuration();
 	double getDuration(ByteRange *brLast);
 	void validateContent();
@@ -100,10 +180,14 @@ public:
 	void writeSentTimesAndQueueingDelayVariance(const int64_t first_tstamp, vector<csv::ofstream*> streams);
 	int calculateClockDrift();
 	void doDriftCompensation();
-	bool insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_type type, DataSeg *data_seq, int level);
+	bool insertByteRange(seq64_t start_seq, seq64_t end_seq, insert_type type, DataSeg *data_seq);
+	bool insertByteRangePart(seq64_t start_seq, seq64_t end_seq, insert_type type, DataSeg *data_seq, int level, seq64_t &next_seq);
+	ByteRange* createSentRange(seq64_t start_seq, seq64_t end_seq, DataSeg *data_seg, bool this_is_rdb_data);
+	ByteRange* splitRangeEnd(ByteRange *br, seq64_t seq, insert_type itype);
 	void genAckLatencyData(const int64_t first_tstamp, vector<SPNS::shared_ptr<vector <LatencyItem> > > &diff_times, const string& connKey);
 	ullint_t getNumBytes() { return lastSeq; } // lastSeq is the last relative seq number
 	size_t getByteRangesCount() { return ranges.size(); }
+	const ByteRangeArena& getRangeArena() { return range_arena; }
 	size_t getAnalysedByteRangesCount() { return ranges.size(); }
 	ullint_t getByteRangesLost() { return analysed_lost_ranges_count; }
 	ullint_t getByteRangesSent() { return analysed_sent_ranges_count; }
@@ -113,12 +197,12 @@ public:
 	seq32_t absolute_seq(seq64_t seq);
 	string absolute_seq_pair_str(seq64_t start, seq64_t end);
 	string strByteRange(seq64_t start, seq64_t end);
-	void calculateRealLoss(map<seq64_t, ByteRange*>::iterator brIt, map<seq64_t, ByteRange*>::iterator brIt_end);
+	void calculateRealLoss(RangeMap::iterator brIt, RangeMap::iterator brIt_end);
 	void analyseReceiverSideData();
 	void calculateRetransAndRDBStats();
 	void calculateLossGroupedByInterval(const int64_t first_tstamp, vector<LossInterval>& aggr_loss, vector<LossInterval>& loss);
 	void printPacketDetails();
-	void printPacketDetails(map<seq64_t, ByteRange*>::iterator it, map<seq64_t, ByteRange*>::iterator it_end);
+	void printPacketDetails(RangeMap::iterator it, RangeMap::iterator it_end);
 };
 
 int seqWithPrintRange(seq64_t start, seq64_t end, size_t &print_packet_ranges_index);
@@ -0,0 +1,112 @@
+#include "RangeMap.h"
+
+/* Methods for class RangeMap */
+
+/* Returns the last chunk starting at or before key, or the first chunk */
+size_t RangeMap::findChunk(seq64_t key) const {
+	vector<seq64_t>::const_iterator it = std::upper_bound(chunk_first.begin(), chunk_first.end(), key);
+	return it == chunk_first.begin() ? 0 : (size_t) (it - chunk_first.begin()) - 1;
+}
+
+/* Finds the position of the first range with a key not less than key, END_CHUNK if there is none */
+void RangeMap::locate(seq64_t key, size_t &chunk, uint32_t &pos) const {
+	if (!count) {
+		chunk = END_CHUNK;
+		return;
+	}
+	chunk = findChunk(key);
+	const vector<value_type> &c = chunks[chunk];
+	vector<value_type>::const_iterator it = std::lower_bound(c.begin(), c.end(), key,
+		[](const value_type &v, seq64_t k) { return v.first < k; });
+	pos = (uint32_t) (it - c.begin());
+	if (pos == c.size()) {
+		pos = 0;
+		if (++chunk == chunks.size())
+			chunk = END_CHUNK;
+	}
+}
+
+RangeMap::iterator RangeMap::find(seq64_t key) {
+	iterator it = lower_bound(key);
+	if (it.chunk != END_CHUNK && it.key != key)
+		return end();
+	return it;
+}
+
+RangeMap::iterator RangeMap::lower_bound(seq64_t key) {
+	size_t chunk;
+	uint32_t pos;
+	locate(key, chunk, pos);
+	return iterator(this, chunk, pos);
+}
+
+RangeMap::iterator RangeMap::upper_bound(seq64_t key) {
+	iterator it = lower_bound(key);
+	if (it.chunk != END_CHUNK && it.key == key)
+		++it;
+	return it;
+}
+
+/* Adds a range with a key greater than all others, without moving any ranges */
+RangeMap::iterator RangeMap::append(const value_type &value) {
+	assert(!count || chunks.back().back().first < value.first);
+	if (!count || chunks.back().size() == RANGE_CHUNK_SIZE) {
+		chunks.push_back(vector<value_type>());
+		chunks.back().reserve(RANGE_CHUNK_SIZE);
+		chunk_first.push_back(value.first);
+	}
+	chunks.back().push_back(value);
+	count++;
+	return iterator(this, chunks.size() - 1, (uint32_t) chunks.back().size() - 1);
+}
+
+/* Like std::map::insert, an existing range with the same key is kept */
+pair<RangeMap::iterator, bool> RangeMap::insert(const value_type &value) {
+	if (!count || chunks.back().back().first < value.first)
+		return make_pair(append(value), true);
+
+	size_t chunk = findChunk(value.first);
+	vector<value_type> *c = &chunks[chunk];
+	uint32_t pos = (uint32_t) (std::lower_bound(c->begin(), c->end(), value.first,
+		[](const value_type &v, seq64_t k) { return v.first < k; }) - c->begin());
+	if (pos < c->size() && (*c)[pos].first == value.first)
+		return make_pair(iterator(this, chunk, pos), false);
+
+	if (c->size() == RANGE_CHUNK_SIZE) {
+		// Move the upper half into a new chunk following this one
+		const uint32_t half = RANGE_CHUNK_SIZE / 2;
+		vector<value_type> upper;
+		upper.reserve(RANGE_CHUNK_SIZE);
+		upper.assign(c->begin() + half, c->end());
+		c->resize(half);
+		chunk_first.insert(chunk_first.begin() + chunk + 1, upper.front().first);
+		chunks.insert(chunks.begin() + chunk + 1, std::move(upper));
+		if (pos > half) {
+			chunk++;
+			pos -= half;
+		}
+		c = &chunks[chunk];
+	}
+	c->insert(c->begin() + pos, value);
+	if (pos == 0)
+		chunk_first[chunk] = value.first;
+	count++;
+	version++;
+	return make_pair(iterator(this, chunk, pos), true);
+}
+
+/* Removes the first n ranges */
+void RangeMap::pop_front(size_t n) {
+	assert(n <= count);
+	count -= n;
+	size_t whole = 0;
+	while (whole < chunks.size() && n >= chunks[whole].size())
+		n -= chunks[whole++].size();
+	chunks.erase(chunks.begin(), chunks.begin() + whole);
+	chunk_first.erase(chunk_first.begin(), chunk_first.begin() + whole);
+	if (n) {
+		chunks[0].erase(chunks[0].begin(), chunks[0].begin() + n);
+		chunk_first[0] = chunks[0].front().first;
+	}
+	version++;
+}
@@ -0,0 +1,138 @@
+#ifndef RANGEMAP_H
+#define RANGEMAP_H
+
+#include <iterator>
+#include "common.h"
+
+class ByteRange;
+
+/* Ranges per chunk. A full chunk is split in two by inserts in the middle */
+#define RANGE_CHUNK_SIZE 64
+
+/*
+  The ByteRanges of a connection ordered on the start sequence number.
+  Nearly all ranges are appended at the end as new data is sent, so the
+  ranges are kept in a list of sorted chunks: appending is O(1), and lookups
+  binary search the first sequence number of each chunk, and then the chunk.
+  Iteration walks the chunks contiguously.
+
+  Like std::map iterators, the iterators stay valid when ranges are inserted.
+  Appending does not move any ranges, and an iterator finds its range again
+  by its key if a range was inserted in the middle since it was last used.
+  Removing ranges from the front only invalidates the iterators to them.
+ */
+class RangeMap {
+public:
+	typedef seq64_t key_type;
+	typedef pair<seq64_t, ByteRange*> value_type;
+
+	class iterator {
+	public:
+		typedef std::bidirectional_iterator_tag iterator_category;
+		typedef RangeMap::value_type value_type;
+		typedef ptrdiff_t difference_type;
+		typedef value_type* pointer;
+		typedef value_type& reference;
+
+	private:
+		friend class RangeMap;
+		// The chunk and position are a cache, only key is reliable after a middle insert
+		RangeMap *map;
+		mutable size_t chunk;   // END_CHUNK for end()
+		mutable uint32_t pos;
+		mutable uint32_t version;
+		seq64_t key;
+
+		iterator(RangeMap *m, size_t c, uint32_t p)
+			: map(m), chunk(c), pos(p), version(m->version), key(c == END_CHUNK ? 0 : m->chunks[c][p].first) {}
+
+		void sync() const {
+			if (version != map->version) {
+				map->locate(key, chunk, pos);
+				version = map->version;
+			}
+		}
+
+	public:
+		iterator() : map(NULL), chunk(END_CHUNK), pos(0), version(0), key(0) {}
+
+		reference operator*() const { sync(); return map->chunks[chunk][pos]; }
+		pointer operator->() const { return &**this; }
+
+		iterator& operator++() {
+			sync();
+			if (++pos == map->chunks[chunk].size()) {
+				pos = 0;
+				if (++chunk == map->chunks.size())
+					chunk = END_CHUNK;
+			}
+			if (chunk != END_CHUNK)
+				key = map->chunks[chunk][pos].first;
+			return *this;
+		}
+
+		iterator& operator--() {
+			if (chunk == END_CHUNK) {
+				chunk = map->chunks.size() - 1;
+				pos = (uint32_t) map->chunks[chunk].size();
+				version = map->version;
+			}
+			else
+				sync();
+			if (pos == 0) {
+				// Decrementing begin() gives end()
+				if (chunk == 0) {
+					chunk = END_CHUNK;
+					return *this;
+				}
+				pos = (uint32_t) map->chunks[--chunk].size();
+			}
+			key = map->chunks[chunk][--pos].first;
+			return *this;
+		}
+
+		iterator operator++(int) { iterator tmp = *this; ++*this; return tmp; }
+		iterator operator--(int) { iterator tmp = *this; --*this; return tmp; }
+
+		bool operator==(const iterator &other) const {
+			if (chunk == END_CHUNK || other.chunk == END_CHUNK)
+				return chunk == other.chunk;
+			return key == other.key;
+		}
+		bool operator!=(const iterator &other) const { return !(*this == other); }
+	};
+
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+
+private:
+	static const size_t END_CHUNK = SIZE_MAX;
+
+	vector<vector<value_type> > chunks;
+	vector<seq64_t> chunk_first;   // Key of the first range in each chunk
+	size_t count;
+	uint32_t version;              // Increased when ranges are moved by a middle insert
+
+	size_t findChunk(seq64_t key) const;
+	void locate(seq64_t key, size_t &chunk, uint32_t &pos) const;
+
+public:
+	RangeMap() : count(0), version(0) {}
+
+	iterator begin() { return count ? iterator(this, 0, 0) : end(); }
+	iterator end() { return iterator(this, END_CHUNK, 0); }
+	reverse_iterator rbegin() { return reverse_iterator(end()); }
+	reverse_iterator rend() { return reverse_iterator(begin()); }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	iterator find(seq64_t key);
+	iterator lower_bound(seq64_t key);
+	iterator upper_bound(seq64_t key);
+	pair<iterator, bool> insert(const value_type &value);
+	iterator append(const value_type &value);
+	void pop_front(size_t n);
+	value_type& back() { return chunks.back().back(); }
+	ByteRange*& operator[](seq64_t key) { return insert(value_type(key, NULL)).first->second; }
+};
+
+#endif /* RANGEMAP_H */
@@ -0,0 +1,62 @@
+#include "SackScoreboard.h"
+
+/* Methods for class SackScoreboard */
+
+/*
+  Merge the block [left, right) with the intervals it overlaps or touches.
+  Returns the parts of the block that were not SACKed before, which are
+  valid until the next call.
+ */
+const vector<SackBlock>& SackScoreboard::add(seq64_t left, seq64_t right) {
+	added.clear();
+	if (left >= right)
+		return added;
+
+	map<seq64_t, seq64_t>::iterator it = intervals.upper_bound(left);
+	if (it != intervals.begin()) {
+		map<seq64_t, seq64_t>::iterator prev = it;
+		prev--;
+		if (prev->second >= left)
+			it = prev;
+	}
+
+	seq64_t start = left, end = right, pos = left;
+	while (it != intervals.end() && it->first <= right) {
+		if (it->first > pos) {
+			SackBlock gap = { pos, it->first };
+			added.push_back(gap);
+		}
+		pos = max(pos, it->second);
+		start = min(start, it->first);
+		end = max(end, it->second);
+		intervals.erase(it++);
+	}
+	if (pos < right) {
+		SackBlock gap = { pos, right };
+		added.push_back(gap);
+	}
+	intervals.insert(it, pair<seq64_t, seq64_t>(start, end));
+	return added;
+}
+
+/* Drop the data below the cumulative ACK */
+void SackScoreboard::ack(seq64_t cum_ack) {
+	while (!intervals.empty() && intervals.begin()->first < cum_ack) {
+		map<seq64_t, seq64_t>::iterator it = intervals.begin();
+		seq64_t end = it->second;
+		intervals.erase(it);
+		if (end > cum_ack) {
+			intervals.insert(pair<seq64_t, seq64_t>(cum_ack, end));
+			break;
+		}
+	}
+}
+
+/* Returns true if all of [start, end) is SACKed */
+bool SackScoreboard::covers(seq64_t start, seq64_t end) const {
+	map<seq64_t, seq64_t>::const_iterator it = intervals.upper_bound(start);
+	if (it == intervals.begin())
+		return false;
+	it--;
+	return it->second >= end;
+}
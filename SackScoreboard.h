@@ -0,0 +1,27 @@
+#ifndef SACKSCOREBOARD_H
+#define SACKSCOREBOARD_H
+
+#include "common.h"
+
+/*
+  The data SACKed by the receiver above the cumulative ACK of a connection,
+  kept as a sorted set of disjoint intervals (start -> end). The SACK blocks
+  are merged into the set as the ACKs arrive, and the intervals below the
+  cumulative ACK are dropped, so the set only describes the current holes.
+  Adding a block and checking if a range is covered are O(log n).
+ */
+class SackScoreboard {
+private:
+	map<seq64_t, seq64_t> intervals;
+	vector<SackBlock> added;        // The parts of the last block added that were not SACKed before
+
+public:
+	const vector<SackBlock>& add(seq64_t left, seq64_t right);
+	void ack(seq64_t cum_ack);
+	bool covers(seq64_t start, seq64_t end) const;
+
+	size_t size() const { return intervals.size(); }
+	bool empty() const { return intervals.empty(); }
+};
+
+#endif /* SACKSCOREBOARD_H */
@@ -0,0 +1,96 @@
+#include <string.h>
+#include <errno.h>
+
+#include "ShardSpool.h"
+#include "HeaderBatch.h"
+
+/* Methods for class ShardSpool */
+
+/* Creates the run files in $TMPDIR, or /tmp */
+ShardSpool::ShardSpool(size_t shards, u_int link_layer_header_size)
+	: counts(shards, 0)
+	, bytes(0)
+	, link_header_size(link_layer_header_size)
+	, buffer(HEADER_BATCH_SIZE * HEADER_BATCH_COPY_SIZE)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	string pattern = string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/analyseTCP-shard-XXXXXX";
+
+	for (size_t i = 0; i < shards; i++) {
+		vector<char> path(pattern.begin(), pattern.end());
+		path.push_back('\0');
+		int fd = mkstemp(&path[0]);
+		FILE *file = fd == -1 ? NULL : fdopen(fd, "w+b");
+		if (file == NULL) {
+			fprintf(stderr, "Failed to create run file '%s': %s\n", &path[0], strerror(errno));
+			exit(1);
+		}
+		unlink(&path[0]);
+		files.push_back(file);
+	}
+}
+
+ShardSpool::~ShardSpool() {
+	for (size_t i = 0; i < files.size(); i++)
+		close(i);
+}
+
+/* Append a packet to the run file of the shard, keeping caplen bytes of the data */
+void ShardSpool::write(size_t shard, const pcap_pkthdr *header, const u_char *data, uint32_t caplen, uint8_t kind) {
+	SpoolRecord rec;
+	rec.tstamp = (int64_t) header->ts.tv_sec * NSEC_PER_SEC + header->ts.tv_usec;
+	rec.len = header->len;
+	rec.caplen = (uint16_t) min(caplen, (uint32_t) HEADER_BATCH_COPY_SIZE);
+	rec.kind = kind;
+	rec.unused = 0;
+
+	if (fwrite(&rec, sizeof(rec), 1, files[shard]) != 1 ||
+		fwrite(data, rec.caplen, 1, files[shard]) != 1) {
+		fprintf(stderr, "Failed to write run file of shard %zu: %s\n", shard, strerror(errno));
+		exit(1);
+	}
+	counts[shard]++;
+	bytes += sizeof(rec) + rec.caplen;
+}
+
+/* Start reading the run file of the shard from the first packet */
+void ShardSpool::rewind(size_t shard) {
+	if (fflush(files[shard]) || fseek(files[shard], 0, SEEK_SET)) {
+		fprintf(stderr, "Failed to rewind run file of shard %zu: %s\n", shard, strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+  Read the next batch of packets from the run file of the shard, and decode them.
+  The packet data is valid until the next batch is read.
+  Returns false when there are no more packets.
+ */
+bool ShardSpool::read(size_t shard, HeaderBatch &batch) {
+	SpoolRecord rec;
+	pcap_pkthdr header;
+
+	batch.clear();
+	while (!batch.full() && fread(&rec, sizeof(rec), 1, files[shard]) == 1) {
+		u_char *data = &buffer[batch.count * HEADER_BATCH_COPY_SIZE];
+		if (fread(data, rec.caplen, 1, files[shard]) != 1) {
+			fprintf(stderr, "Truncated run file of shard %zu\n", shard);
+			exit(1);
+		}
+		header.ts.tv_sec = rec.tstamp / NSEC_PER_SEC;
+		header.ts.tv_usec = rec.tstamp % NSEC_PER_SEC;
+		header.caplen = rec.caplen;
+		header.len = rec.len;
+		batch.add(&header, data, rec.kind, false);
+	}
+	batch.decode(link_header_size);
+	return batch.count > 0;
+}
+
+/* Close and remove the run file of a shard that is done with */
+void ShardSpool::close(size_t shard) {
+	if (files[shard] != NULL) {
+		fclose(files[shard]);
+		files[shard] = NULL;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef SHARDSPOOL_H
+#define SHARDSPOOL_H
+
+#include "common.h"
+
+struct HeaderBatch;
+
+/* Max number of shards, each of which keeps a run file open while the dumps are split */
+#define MAX_SPOOL_SHARDS 256
+
+/* Header of a packet in a run file, followed by caplen bytes of packet data */
+struct SpoolRecord {
+	int64_t tstamp;         // Nanoseconds, as returned by pcap_tstamp()
+	uint32_t len;
+	uint16_t caplen;
+	uint8_t kind;           // PACKET_SENT / PACKET_ACK / PACKET_RECVD
+	uint8_t unused;
+};
+
+/*
+  Temporary run files holding the packets of each shard in capture order,
+  used by the out-of-core analysis (--out-of-core).
+  Only the link, IP and TCP headers of the packets are stored, and they are
+  read back a HeaderBatch at a time. The files are unlinked as soon as they
+  are created, so they are gone once closed, however the program exits.
+ */
+class ShardSpool {
+private:
+	vector<FILE*> files;
+	vector<ullint_t> counts;
+	ullint_t bytes;
+	u_int link_header_size;
+	vector<u_char> buffer;  // Packet data of the batch last read
+
+public:
+	ShardSpool(size_t shards, u_int link_layer_header_size);
+	~ShardSpool();
+
+	void write(size_t shard, const pcap_pkthdr *header, const u_char *data, uint32_t caplen, uint8_t kind);
+	void rewind(size_t shard);
+	bool read(size_t shard, HeaderBatch &batch);
+	void close(size_t shard);
+
+	size_t size() const { return files.size(); }
+	ullint_t count(size_t shard) const { return counts[shard]; }
+	ullint_t footprint() const { return bytes; }
+	u_int getLinkHeaderSize() const { return link_header_size; }
+};
+
+#endif /* SHARDSPOOL_H */
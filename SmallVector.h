@@ -0,0 +1,168 @@
+#ifndef SMALLVECTOR_H
+#define SMALLVECTOR_H
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <stdint.h>
+
+/*
+  A vector storing up to N elements inline, which only allocates on the heap
+  when it grows past them. The inline storage is at least the size of the
+  heap pointer it shares space with, so small elements may fit more than N.
+  With N = 0, it is a vector with a smaller header than std::vector.
+
+  Copies share the heap storage, which is copied on the first change to
+  either copy (copy-on-write). Elements are therefore only reachable as
+  const, and are changed with push_back(), set() and erase(). The reference count
+  is not atomic, so copies of a vector must be used by one thread.
+  Elements must be trivially destructible, as they are never destroyed.
+ */
+template <typename T, size_t N>
+class SmallVector {
+	static_assert(std::is_trivially_destructible<T>::value, "SmallVector does not destroy its elements");
+
+	/* Heap storage, followed by the elements */
+	struct alignas(alignof(T) > alignof(uint32_t) ? alignof(T) : alignof(uint32_t)) Block {
+		uint32_t refs;
+	};
+
+	static const size_t INLINE_BYTES = N * sizeof(T) > sizeof(Block*) ? N * sizeof(T) : sizeof(Block*);
+
+public:
+	typedef T value_type;
+	typedef const T* const_iterator;
+	static const uint32_t INLINE_CAPACITY = INLINE_BYTES / sizeof(T);
+
+private:
+	uint32_t count;
+	uint32_t cap;
+	union {
+		Block *heap;                                 // When cap > INLINE_CAPACITY
+		alignas(T) unsigned char buf[INLINE_BYTES];
+	};
+
+	bool onHeap() const { return cap > INLINE_CAPACITY; }
+	T* elements() { return onHeap() ? reinterpret_cast<T*>(heap + 1) : reinterpret_cast<T*>(buf); }
+
+	void release() {
+		if (onHeap() && --heap->refs == 0)
+			::operator delete(heap);
+	}
+
+	/* Moves the elements into private heap storage with room for new_cap */
+	void grow(uint32_t new_cap) {
+		Block *b = static_cast<Block*>(::operator new(sizeof(Block) + new_cap * sizeof(T)));
+		b->refs = 1;
+		std::uninitialized_copy(begin(), end(), reinterpret_cast<T*>(b + 1));
+		release();
+		heap = b;
+		cap = new_cap;
+	}
+
+	/* Called before changing the elements */
+	void unshare(uint32_t min_cap) {
+		if (min_cap > cap)
+			grow(std::max(min_cap, cap * 2));
+		else if (onHeap() && heap->refs > 1)
+			grow(cap);
+	}
+
+	void copyFrom(const SmallVector &other) {
+		if (other.onHeap()) {
+			other.heap->refs++;
+			release();
+			heap = other.heap;
+			cap = other.cap;
+		}
+		else {
+			release();
+			cap = INLINE_CAPACITY;
+			std::uninitialized_copy(other.begin(), other.end(), reinterpret_cast<T*>(buf));
+		}
+		count = other.count;
+	}
+
+	void moveFrom(SmallVector &other) {
+		if (other.onHeap()) {
+			release();
+			heap = other.heap;
+			cap = other.cap;
+			count = other.count;
+			other.cap = INLINE_CAPACITY;
+			other.count = 0;
+		}
+		else {
+			copyFrom(other);
+		}
+	}
+
+public:
+	SmallVector() : count(0), cap(INLINE_CAPACITY) {}
+	SmallVector(const SmallVector &other) : count(0), cap(INLINE_CAPACITY) { copyFrom(other); }
+	SmallVector(SmallVector &&other) : count(0), cap(INLINE_CAPACITY) { moveFrom(other); }
+	~SmallVector() { release(); }
+
+	SmallVector& operator=(const SmallVector &other) {
+		if (this != &other)
+			copyFrom(other);
+		return *this;
+	}
+
+	SmallVector& operator=(SmallVector &&other) {
+		if (this != &other)
+			moveFrom(other);
+		return *this;
+	}
+
+	const T* data() const { return onHeap() ? reinterpret_cast<const T*>(heap + 1) : reinterpret_cast<const T*>(buf); }
+	const_iterator begin() const { return data(); }
+	const_iterator end() const { return data() + count; }
+
+	size_t size() const { return count; }
+	size_t capacity() const { return cap; }
+	bool empty() const { return count == 0; }
+	bool shared() const { return onHeap() && heap->refs > 1; }
+	const T& operator[](size_t i) const { return data()[i]; }
+	const T& front() const { return data()[0]; }
+	const T& back() const { return data()[count - 1]; }
+
+	void reserve(size_t n) {
+		if (n > cap)
+			grow((uint32_t) n);
+	}
+
+	void push_back(const T &value) {
+		// value may be an element of this vector
+		T copy = value;
+		unshare(count + 1);
+		new (elements() + count) T(copy);
+		count++;
+	}
+
+	void set(size_t i, const T &value) {
+		T copy = value;
+		unshare(count);
+		elements()[i] = copy;
+	}
+
+	const_iterator erase(const_iterator pos) {
+		size_t i = pos - begin();
+		unshare(count);
+		T *e = elements();
+		std::copy(e + i + 1, e + count, e + i);
+		count--;
+		return begin() + i;
+	}
+
+	void clear() { count = 0; }
+
+	void swap(SmallVector &other) {
+		SmallVector tmp(std::move(other));
+		other = std::move(*this);
+		*this = std::move(tmp);
+	}
+};
+
+#endif /* SMALLVECTOR_H */
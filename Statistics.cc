@@ -1,13 +1,21 @@
 #include "Dump.h"
 #include "Statistics.h"
+#include "ShardSpool.h"
 #include "color_print.h"
 
 Statistics::Statistics(Dump &d)
     : dump(d)
+    , aggrConnStats()
+    , conn_count(0)
 {}
 
+Statistics::~Statistics() {
+	for (StatsWriter *writer : writers)
+		delete writer;
+}
+
 void Statistics::fillWithSortedConns(map<ConnectionMapKey*, Connection*, SortedConnectionKeyComparator> &sortedConns) {
-	map<ConnectionMapKey*, Connection*>::iterator it, it_end;
+	ConnectionTable::iterator it, it_end;
 	it_end = dump.conns.end();
 	for (it = dump.conns.begin(); it != it_end; it++) {
 		sortedConns.insert(pair<ConnectionMapKey*, Connection*>(it->first, it->second));
@@ -89,25 +97,37 @@ void Statistics::printDumpStats() {
 
 	cout << endl;
 
+	// The connections already freed are counted in freedRanges
+	RangeCounts rc = dump.freedRanges;
+	for (auto &it : dump.conns)
+		rc.add(it.second);
+
 	if (GlobOpts::withRecv) {
-		map<ConnectionMapKey*, Connection*>::iterator cIt, cItEnd;
-		long ranges_count = 0;
-		long ranges_lost = 0;
-		long ranges_sent = 0;
-		for (cIt = dump.conns.begin(); cIt != dump.conns.end(); cIt++) {
-			ranges_count += cIt->second->rm->getByteRangesCount();
-			ranges_sent += cIt->second->rm->getByteRangesSent();
-			ranges_lost += cIt->second->rm->getByteRangesLost();
-		}
 		cout << "  Received Bytes        : " << dump.recvBytesCount << endl;
 		if ((dump.sentPacketCount - dump.recvPacketCount) < 0) {
 			colored_printf(YELLOW, "Negative loss values is probably caused by GSO/TSO on sender side (see readme)\n");
 		}
 		cout << "  Packets Lost          : " << (dump.sentPacketCount - dump.recvPacketCount) << endl;
 		cout << "  Packet Loss           : " << ((double) (dump.sentPacketCount - dump.recvPacketCount) / dump.sentPacketCount) * 100 <<  " %" << endl;
-		cout << "  Ranges Count          : " << (ranges_count) << endl;
-		cout << "  Ranges Sent           : " << (ranges_sent) << endl;
-		cout << "  Ranges Lost           : " << (ranges_lost) << endl;
+		cout << "  Ranges Count          : " << (rc.ranges_count) << endl;
+		cout << "  Ranges Sent           : " << (rc.ranges_sent) << endl;
+		cout << "  Ranges Lost           : " << (rc.ranges_lost) << endl;
+	}
+
+	if (GlobOpts::verbose > 1) {
+		printf("  Range arena           : %zu ranges in %zu slabs, %.1f MB (%.1f%% used)\n", rc.arena_ranges, rc.arena_slabs,
+			   rc.arena_bytes / (1024.0 * 1024.0), safe_div(rc.arena_ranges, rc.arena_capacity) * 100);
+		printf("  Range inserts         : %llu appended, %llu inserted (%llu more parts for overlaps)\n", rc.appended, rc.inserted, rc.parts);
+		if (GlobOpts::stream_horizon_ms)
+			printf("  Ranges retired        : %llu (%llu later segments with retired data ignored)\n", rc.retired, rc.retired_late);
+		if (GlobOpts::recv_join)
+			printf("  Received segments     : %llu joined in sequence order (%llu ranges split)\n", rc.recv_joined, rc.recv_split);
+		if (GlobOpts::evict_closed)
+			printf("  Connections evicted   : %llu (%llu later packets on evicted connections ignored)\n",
+				   dump.evictedConnCount, dump.evictedPacketCount);
+		if (GlobOpts::out_of_core_shards)
+			printf("  Out-of-core shards    : %zu (%.1f MB of run files)\n", dump.sentSpool->size(),
+				   (dump.sentSpool->footprint() + (dump.recvSpool ? dump.recvSpool->footprint() : 0)) / (1024.0 * 1024.0));
 	}
 }
 
@@ -126,63 +146,72 @@ void printStatsSeparator(bool final) {
 
 
 void Statistics::printStatistics() {
-	ConnStats csAggregated = ConnStats();
-	AggrPacketsStats psAggregated;
+	// With --evict-closed and --out-of-core, the connections were printed as they were finished
+	if (!GlobOpts::evict_closed && !GlobOpts::out_of_core_shards) {
+		// Print stats for each connection or aggregated
+		map<ConnectionMapKey*, Connection*, SortedConnectionKeyComparator> sortedConns;
+		fillWithSortedConns(sortedConns);
+		map<ConnectionMapKey*, Connection*>::iterator cIt;
+		for (cIt = sortedConns.begin(); cIt != sortedConns.end(); cIt++) {
+			printConnStatistics(*cIt->second);
+		}
+	}
+	printAggrStatistics();
+}
 
-	// Print stats for each connection or aggregated
-	map<ConnectionMapKey*, Connection*, SortedConnectionKeyComparator> sortedConns;
-	fillWithSortedConns(sortedConns);
-	map<ConnectionMapKey*, Connection*>::iterator cIt, cItEnd;
-	for (cIt = sortedConns.begin(); cIt != sortedConns.end(); cIt++) {
-		ConnStats cs = ConnStats();
-		cIt->second->addConnStats(&cs);
-		cIt->second->addConnStats(&csAggregated);
+/* Print the stats of one connection, and add them to the aggregated stats */
+void Statistics::printConnStatistics(Connection &conn) {
+	ConnStats cs = ConnStats();
+	conn.addConnStats(&cs);
+	conn.addConnStats(&aggrConnStats);
+	conn_count++;
 
-		PacketsStats *packetsStats = cIt->second->getBytesLatencyStats();
+	PacketsStats *packetsStats = conn.getBytesLatencyStats();
 
-		if (!GlobOpts::aggOnly) {
-			colored_printf(YELLOW, "STATS FOR CONN: %s -> %s", cIt->second->getSenderKey().c_str(), cIt->second->getReceiverKey().c_str());
+	if (!GlobOpts::aggOnly) {
+		colored_printf(YELLOW, "STATS FOR CONN: %s -> %s", conn.getSenderKey().c_str(), conn.getReceiverKey().c_str());
 
-			if (GlobOpts::analyse_start || GlobOpts::analyse_end || GlobOpts::analyse_duration) {
-				colored_printf(YELLOW, " (Interval analysed (sec): %d-%d)", cIt->second->rm->analyse_time_sec_start, cIt->second->rm->analyse_time_sec_end);
-			}
-			printf("\n");
-			printPacketsStats(&cs);
-			printStatsSeparator(false);
-			printPayloadStats(packetsStats);
+		if (GlobOpts::analyse_start || GlobOpts::analyse_end || GlobOpts::analyse_duration) {
+			colored_printf(YELLOW, " (Interval analysed (sec): %d-%d)", conn.rm->analyse_time_sec_start, conn.rm->analyse_time_sec_end);
 		}
+		printf("\n");
+		printPacketsStats(&cs);
+		printStatsSeparator(false);
+		printPayloadStats(packetsStats);
+	}
 
-		if (!GlobOpts::aggOnly) {
-			printBytesLatencyStatsConn(packetsStats);
+	if (!GlobOpts::aggOnly) {
+		printBytesLatencyStatsConn(packetsStats);
 
-			// ITT stats
-			printPacketITTStats(packetsStats);
-			printStatsSeparator(true);
-		}
+		// ITT stats
+		printPacketITTStats(packetsStats);
+		printStatsSeparator(true);
+	}
 
-		if (GlobOpts::aggregate) {
-			psAggregated.add(*packetsStats);
-		}
+	if (GlobOpts::aggregate) {
+		aggrPacketsStats.add(*packetsStats);
 	}
+}
 
+void Statistics::printAggrStatistics() {
 	if (GlobOpts::aggregate) {
-		if (csAggregated.nrPacketsSent) {
-			csAggregated.duration /= sortedConns.size();
+		if (aggrConnStats.nrPacketsSent) {
+			aggrConnStats.duration /= conn_count;
 
-			psAggregated.aggregated.latency.makeStats();
-			psAggregated.aggregated.packet_length.makeStats();
-			psAggregated.aggregated.itt.makeStats();
+			aggrPacketsStats.aggregated.latency.makeStats();
+			aggrPacketsStats.aggregated.packet_length.makeStats();
+			aggrPacketsStats.aggregated.itt.makeStats();
 
-			cout << "\nAggregated Statistics for " << sortedConns.size() << " connections:" << endl;
-			printPacketsStats(&csAggregated);
+			cout << "\nAggregated Statistics for " << conn_count << " connections:" << endl;
+			printPacketsStats(&aggrConnStats);
 			printStatsSeparator(false);
-			printPayloadStatsAggr(&csAggregated, psAggregated);
+			printPayloadStatsAggr(&aggrConnStats, aggrPacketsStats);
 
 			/* Print Aggregate bytewise latency */
-			printBytesLatencyStatsAggr(&csAggregated, psAggregated);
+			printBytesLatencyStatsAggr(&aggrConnStats, aggrPacketsStats);
 
 			// ITT stats
-			printPacketITTStatsAggr(&csAggregated, psAggregated);
+			printPacketITTStatsAggr(&aggrConnStats, aggrPacketsStats);
 			printStatsSeparator(true);
 		}
 	}
@@ -346,6 +375,7 @@ void printBytesLatencyStatsAggr(ConnStats *cs, AggrPacketsStats &aggrStats) {
 			   "Maximum max: The biggest value of all the maximum latencies for each connection\n"
 			);
 	}
+	printSackLatencyStats(aggrStats.aggregated.sack_latency);
 	printBytesLatencyStats(&aggrStats.aggregated);
 }
 
@@ -353,9 +383,20 @@ void printBytesLatencyStatsConn(PacketsStats* bs) {
 	printStatsSeparator(false);
 	printf("Latency stats:\n");
 	printStats("latency", "usec", bs->latency);
+	printSackLatencyStats(bs->sack_latency);
 	printBytesLatencyStats(bs);
 }
 
+/* Print the latency until the ranges were SACKed, if any were */
+void printSackLatencyStats(BaseStats &bs) {
+	if (!bs.get_counter())
+		return;
+	printf("  Ranges SACKed before they were ACKed          : %10u\n", bs.get_counter());
+	printf("  Minimum SACK latency                          : %10lld usec\n", bs.min);
+	printf("  Average SACK latency                          : %10.0f usec\n", bs.get_avg());
+	printf("  Maximum SACK latency                          : %10lld usec\n", bs.max);
+}
+
 /* Print latency statistics */
 void printBytesLatencyStats(PacketsStats* bs) {
 
@@ -402,7 +443,7 @@ void Statistics::writeByteLatencyVariationCDF() {
 	cdffn << GlobOpts::prefix << "latency-variation-cdf.dat";
 	cdf_f.open((char*)((cdffn.str()).c_str()), ios::out);
 
-	map<ConnectionMapKey*, Connection*>::iterator cIt, cItEnd;
+	ConnectionTable::iterator cIt, cItEnd;
 	for (cIt = dump.conns.begin(); cIt != dump.conns.end(); cIt++) {
 		cIt->second->writeByteLatencyVariationCDF(&cdf_f);
 	}
@@ -431,12 +472,37 @@ void Statistics::writeAggByteLatencyVariationCDF() {
 }
 
 void Statistics::makeByteLatencyVariationCDF() {
-	map<ConnectionMapKey*, Connection*>::iterator cIt, cItEnd;
+	ConnectionTable::iterator cIt, cItEnd;
 	for (cIt = dump.conns.begin(); cIt != dump.conns.end(); cIt++) {
 		cIt->second->makeByteLatencyVariationCDF();
 	}
 }
 
+/*
+  Makes the CDF of each connection and writes it as makeByteLatencyVariationCDF()
+  and writeByteLatencyVariationCDF() do, one connection at a time.
+  The aggregated CDF is written with writeAggByteLatencyVariationCDF().
+ */
+class ByteLatencyVariationCDFWriter : public StatsWriterBase
+{
+public:
+	ofstream stream;
+
+	virtual void begin() {
+		if (!GlobOpts::aggOnly)
+			stream.open((GlobOpts::prefix + "latency-variation-cdf.dat").c_str(), ios::out);
+	}
+	virtual void end() {
+		if (!GlobOpts::aggOnly)
+			stream.close();
+	}
+	virtual void writeStats(Connection &conn) {
+		conn.makeByteLatencyVariationCDF();
+		if (!GlobOpts::aggOnly)
+			conn.writeByteLatencyVariationCDF(&stream);
+	}
+};
+
 
 /*****************************************
  * Loss Stats
@@ -489,7 +555,10 @@ public:
 
 	LossStatsWriter(const long tstamp)
 		: first_tstamp(tstamp)
-	{}
+	{
+		write_header = true;
+		setFilenameID("loss");
+	}
 };
 
 /*
@@ -515,10 +584,8 @@ public:
  */
 void Statistics::writeLossStats() {
 	assert(GlobOpts::withRecv && "Calculating loss is only possible with receiver dump");
-	const int64_t first_tstamp = TV_TO_MS(dump.first_sent_time);
+	const int64_t first_tstamp = TS_TO_MS(dump.first_sent_time);
 	LossStatsWriter conf(first_tstamp);
-	conf.write_header = true;
-	conf.setFilenameID("loss");
 	writeStatisticsFiles(conf);
 }
 
@@ -527,6 +594,12 @@ void Statistics::writeLossStats() {
  ****************************************/
 class ConnStatsWriter : public AggrStatsWriterBase {
 public:
+	ConnStatsWriter() {
+		write_header = true;
+		setFilenameID("conn-stats");
+		aggrPostfix = "-all.dat";
+	}
+
 	void writeHeader(csv::ofstream& csv) {
 		ConnCSVItem::writeHeader(csv);
 	}
@@ -542,9 +615,6 @@ public:
 
 void Statistics::writeConnStats() {
 	ConnStatsWriter conf;
-	conf.write_header = true;
-	conf.setFilenameID("conn-stats");
-	conf.aggrPostfix = "-all.dat";
 	writeStatisticsFiles(conf);
 }
 
@@ -554,6 +624,12 @@ void Statistics::writeConnStats() {
  ****************************************/
 class PerPacketStatsWriter : public AggrStatsWriterBase {
 public:
+	PerPacketStatsWriter() {
+		write_header = true;
+		setFilenameID("per-packet-stats");
+		aggrPostfix = "-all.dat";
+	}
+
 	void writeHeader(csv::ofstream& csv) {
 		PacketStats::writeHeader(csv);
 	}
@@ -568,9 +644,6 @@ public:
 
 void Statistics::writePerPacketStats() {
 	PerPacketStatsWriter conf;
-	conf.write_header = true;
-	conf.setFilenameID("per-packet-stats");
-	conf.aggrPostfix = "-all.dat";
 	writeStatisticsFiles(conf);
 }
 
@@ -580,6 +653,12 @@ void Statistics::writePerPacketStats() {
  **************************************************************/
 class PerSegmentStatsWriter : public AggrStatsWriterBase {
 public:
+	PerSegmentStatsWriter() {
+		write_header = true;
+		setFilenameID("per-segment-stats");
+		aggrPostfix = "-all.dat";
+	}
+
 	void writeHeader(csv::ofstream& csv) {
 		SegmentStats::writeHeader(csv);
 	}
@@ -594,9 +673,6 @@ public:
 
 void Statistics::writePerSegmentStats() {
 	PerSegmentStatsWriter conf;
-	conf.write_header = true;
-	conf.setFilenameID("per-segment-stats");
-	conf.aggrPostfix = "-all.dat";
 	writeStatisticsFiles(conf);
 }
 
@@ -662,14 +738,15 @@ public:
 	}
 	AckLatencyWriter(const long tstamp)
 		: first_tstamp(tstamp)
-	{}
+	{
+		setFilenameID("latency");
+		setHeader("time,latency,stream_id");
+	}
 };
 
 void Statistics::writeAckLatency() {
-	const int64_t first_tstamp = TV_TO_MS(dump.first_sent_time);
+	const int64_t first_tstamp = TS_TO_MS(dump.first_sent_time);
 	AckLatencyWriter conf(first_tstamp);
-	conf.setFilenameID("latency");
-	conf.setHeader("time,latency,stream_id");
 	writeStatisticsFiles(conf);
 }
 
@@ -677,37 +754,43 @@ void Statistics::writeAckLatency() {
 /*****************************************
  * Sent Times And Queueing Delay Variance
  ****************************************/
+class SentTimesAndQueueingDelayVariance : public StreamStatsWriterBase {
+public:
+	const int64_t first_tstamp;
+	virtual void statsFunc(Connection &conn, vector<csv::ofstream*> streams) {
+		conn.writeSentTimesAndQueueingDelayVariance(first_tstamp, streams);
+	}
+	SentTimesAndQueueingDelayVariance(const long tstamp)
+		: first_tstamp(tstamp)
+	{
+		setHeader("time,latency_variance,stream_id");
+		setFilenameID("queueing-delay");
+	}
+};
+
 void Statistics::writeSentTimesAndQueueingDelayVariance() {
-	class SentTimesAndQueueingDelayVariance : public StreamStatsWriterBase {
-	public:
-		const int64_t first_tstamp;
-		virtual void statsFunc(Connection &conn, vector<csv::ofstream*> streams) {
-			conn.writeSentTimesAndQueueingDelayVariance(first_tstamp, streams);
-		}
-		SentTimesAndQueueingDelayVariance(const long tstamp)
-			: first_tstamp(tstamp)
-		{}
-	};
-	const int64_t first_tstamp = TV_TO_MS(dump.first_sent_time);
+	const int64_t first_tstamp = TS_TO_MS(dump.first_sent_time);
 	SentTimesAndQueueingDelayVariance conf(first_tstamp);
-	conf.setHeader("time,latency_variance,stream_id");
-	conf.setFilenameID("queueing-delay");
 	writeStatisticsFiles(conf);
 }
 
 /***********************************
  * Packet Byte Count And ITT
  **********************************/
+class PacketByteCountAndITT : public StreamStatsWriterBase {
+public:
+	PacketByteCountAndITT() {
+		setHeader("timestamp,itt,payload_size,packet_size");
+		setFilenameID("packet-byte-count-and-itt");
+	}
+
+	virtual void statsFunc(Connection &conn, vector<csv::ofstream*> streams) {
+		conn.writePacketByteCountAndITT(streams);
+	}
+};
+
 void Statistics::writePacketByteCountAndITT() {
-	class PacketByteCountAndITT : public StreamStatsWriterBase {
-	public:
-		virtual void statsFunc(Connection &conn, vector<csv::ofstream*> streams) {
-			conn.writePacketByteCountAndITT(streams);
-		}
-	};
 	PacketByteCountAndITT conf;
-	conf.setHeader("timestamp,itt,payload_size,packet_size");
-	conf.setFilenameID("packet-byte-count-and-itt");
 	writeStatisticsFiles(conf);
 }
 
@@ -720,6 +803,11 @@ class ByteCountGroupedByInterval : public StatsWriterBase
 public:
 	vector<PacketSizeGroup> aggrPacketSizeGroups;
 
+	ByteCountGroupedByInterval() {
+		setFilenameID("throughput");
+		setHeader("interval,packet_count,byte_count,payload_bytes,payload_goodput_bytes,throughput");
+	}
+
 	virtual void writeStats(Connection &conn) {
 		uint64_t idx, num;
 		csv::ofstream* connStream = NULL;
@@ -769,16 +857,90 @@ public:
 
 void Statistics::writeByteCountGroupedByInterval() {
 	ByteCountGroupedByInterval conf;
-	conf.setFilenameID("throughput");
-	conf.setHeader("interval,packet_count,byte_count,payload_bytes,payload_goodput_bytes,throughput");
 	writeStatisticsFiles(conf);
 }
 
+/*
+  Open the writers of the statistics files enabled, so the connections may be
+  written one by one with finishConn() while the dump is analysed.
+  The files of the receiver dump and the latency values are only written
+  this way with --out-of-core, --evict-closed rejects them.
+ */
+void Statistics::openWriters() {
+	const int64_t first_tstamp = TS_TO_MS(dump.first_sent_time);
+
+	if (GlobOpts::withRecv && GlobOpts::withCDF)
+		writers.push_back(new ByteLatencyVariationCDFWriter());
+	if (GlobOpts::withRecv && GlobOpts::oneway_delay_variance)
+		writers.push_back(new SentTimesAndQueueingDelayVariance(first_tstamp));
+	if (GlobOpts::genAckLatencyFiles)
+		writers.push_back(new AckLatencyWriter(first_tstamp));
+	if (GlobOpts::genPerPacketStats)
+		writers.push_back(new PerPacketStatsWriter());
+	if (GlobOpts::genPerSegmentStats)
+		writers.push_back(new PerSegmentStatsWriter());
+	if (GlobOpts::withThroughput) {
+		writers.push_back(new ByteCountGroupedByInterval());
+		writers.push_back(new PacketByteCountAndITT());
+	}
+	if (GlobOpts::withLoss)
+		writers.push_back(new LossStatsWriter(first_tstamp));
+	if (GlobOpts::writeConnDetails)
+		writers.push_back(new ConnStatsWriter());
+
+	for (StatsWriter *writer : writers)
+		writer->begin();
+}
+
+/*
+  Write the connections of a shard that is done, before they are freed
+  (--out-of-core). The files are written in the order of the connection
+  table, and the stats printed in the order of printStatistics().
+ */
+void Statistics::finishShard() {
+	for (auto &it : dump.conns) {
+		for (StatsWriter *writer : writers)
+			writer->writeStats(*it.second);
+	}
+
+	if (GlobOpts::verbose) {
+		map<ConnectionMapKey*, Connection*, SortedConnectionKeyComparator> sortedConns;
+		fillWithSortedConns(sortedConns);
+		for (auto &it : sortedConns)
+			printConnStatistics(*it.second);
+	}
+}
+
+/* Write the statistics of a connection that is done, before it is freed */
+void Statistics::finishConn(Connection &conn) {
+	for (StatsWriter *writer : writers)
+		writer->writeStats(conn);
+
+	if (GlobOpts::verbose)
+		printConnStatistics(conn);
+}
+
+/* Write the connections left in the dump, and close the writers */
+void Statistics::finishConns() {
+	map<ConnectionMapKey*, Connection*, SortedConnectionKeyComparator> sortedConns;
+	fillWithSortedConns(sortedConns);
+	map<ConnectionMapKey*, Connection*>::iterator cIt;
+	for (cIt = sortedConns.begin(); cIt != sortedConns.end(); cIt++) {
+		finishConn(*cIt->second);
+	}
+
+	for (StatsWriter *writer : writers) {
+		writer->end();
+		delete writer;
+	}
+	writers.clear();
+}
+
 /*
   The function used to write different statistics to file.
  */
 void Statistics::writeStatisticsFiles(StatsWriter &conf) {
-	map<ConnectionMapKey*, Connection*>::iterator it;
+	ConnectionTable::iterator it;
 	conf.begin();
 	for (it = dump.conns.begin(); it != dump.conns.end(); ++it) {
 		conf.writeStats(*it->second);
@@ -9,6 +9,7 @@ class Connection;
 class StatsWriter
 {
 public:
+	virtual ~StatsWriter() {}
 	// pure virtual function providing interface framework.
 	virtual void begin() = 0;
 	virtual void end() = 0;
@@ -107,6 +108,13 @@ public:
 
 class Statistics {
 	Dump &dump;
+	ConnStats aggrConnStats;
+	AggrPacketsStats aggrPacketsStats;
+	size_t conn_count;                 // Connections added to the aggregated stats
+	vector<StatsWriter*> writers;      // Writers kept open by openWriters()
+
+	void printConnStatistics(Connection &conn);
+	void printAggrStatistics();
 public:
 	void fillWithSortedConns(map<ConnectionMapKey*, Connection*, SortedConnectionKeyComparator> &sortedConns);
 
@@ -114,6 +122,11 @@ public:
 	void printConns();
 	void printStatistics();
 
+	void openWriters();
+	void finishShard();
+	void finishConn(Connection &conn);
+	void finishConns();
+
 	void makeByteLatencyVariationCDF();
 
 	void writePacketByteCountAndITT();
@@ -130,12 +143,14 @@ public:
 	void writePerSegmentStats();
 
 	Statistics(Dump &d);
+	~Statistics();
 };
 
 void printStatsAggr(string prefix, string unit, ConnStats *cs, BaseStats& bs, BaseStats& aggregatedMin,
 					BaseStats& aggregatedAvg, BaseStats& aggregatedMax);
 void printBytesLatencyStatsAggr(ConnStats *cs, AggrPacketsStats &aggrStats);
 void printBytesLatencyStatsConn(PacketsStats* bs);
+void printSackLatencyStats(BaseStats &bs);
 void printBytesLatencyStats(PacketsStats* bs);
 void printPayloadStats(PacketsStats *ps);
 void printPayloadStatsAggr(ConnStats *cs, AggrPacketsStats &aggrStats);
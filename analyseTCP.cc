@@ -28,6 +28,7 @@
 #include "common.h"
 #include "Dump.h"
 #include "Statistics.h"
+#include "ShardSpool.h"
 #include "color_print.h"
 #include "util.h"
 #include <getopt.h>
@@ -39,6 +40,12 @@
 #define OPT_ANALYSE_END 402
 #define OPT_ANALYSE_DURATION 403
 #define OPT_SOJOURN_TIME_INPUT 404
+#define OPT_SINGLE_PASS 405
+#define OPT_THREADS 406
+#define OPT_STREAM_HORIZON 407
+#define OPT_EVICT_CLOSED 408
+#define OPT_OUT_OF_CORE 409
+#define OPT_RECV_JOIN 410
 
 static option long_options[] = {
 	{"sender-dump",                 required_argument, 0, 'f'},
@@ -78,6 +85,12 @@ static option long_options[] = {
 	{"tcp-port",                    required_argument, 0, OPT_PORT},
 	{"tcp-addr",                    required_argument, 0, OPT_ADDR},
 	{"sojourn-time-input",          required_argument, 0, OPT_SOJOURN_TIME_INPUT},
+	{"single-pass",                 no_argument,       0, OPT_SINGLE_PASS},
+	{"threads",                     required_argument, 0, OPT_THREADS},
+	{"stream-horizon",              required_argument, 0, OPT_STREAM_HORIZON},
+	{"evict-closed",                no_argument,       0, OPT_EVICT_CLOSED},
+	{"out-of-core",                 required_argument, 0, OPT_OUT_OF_CORE},
+	{"recv-join",                   no_argument,       0, OPT_RECV_JOIN},
 	{0, 0, 0, 0}
 };
 
@@ -86,7 +99,7 @@ void usage(char* argv, string usage_str, int exit_status=1, int help_level=1)
 	printf("Usage: %s [%s]\n", argv, usage_str.c_str());
 
 	printf("Required options:\n");
-	printf(" -f <pcap-file>      : Sender-side dumpfile.\n");
+	printf(" -f <pcap-file>      : Sender-side dumpfile. May be compressed with gzip, zstd or lz4.\n");
 	printf("Other options:\n");
 	printf(" -s <sender ip>      : Sender ip.\n");
 	printf(" -g <pcap-file>      : Receiver-side dumpfile.\n");
@@ -178,6 +191,16 @@ void usage(char* argv, string usage_str, int exit_status=1, int help_level=1)
 	printf(" --tcp-port=<port>                : Sender or receiver port, combines -q and -p\n");
 	printf(" --tcp-addr=<address>             : Sender or receiver ip, combines -s and -r\n");
 	printf(" --sojourn-time-input=<filename>  : Text file containing timestamp and sequence number for data segments when entering the kernel.\n");
+	printf(" --single-pass                    : Read the sender-side dumpfile once, processing data and ACKs in capture order.\n");
+	printf(" --threads=<n>                    : Analyse the connections with <n> worker threads, sharded by connection.\n");
+	printf(" --stream-horizon=<ms>            : Fold the ranges ACKed more than <ms> milliseconds ago into the statistics and free them,\n"
+		   "                                    so memory follows the data in flight. Implies --single-pass.\n");
+	printf(" --evict-closed                   : Write the statistics of each connection when it is closed, and free it,\n"
+		   "                                    so memory follows the open connections. Implies --single-pass.\n");
+	printf(" --out-of-core=<shards>           : Split the dumps into <shards> run files of whole connections in $TMPDIR, and analyse\n"
+		   "                                    one at a time, so memory follows the largest shard rather than the whole dump.\n");
+	printf(" --recv-join                      : Keep the segments of the receiver dump, and insert those of each connection\n"
+		   "                                    in sequence order once the dump is read.\n");
 
 	if (help_level > 2) {
 		printf("\n");
@@ -341,6 +364,44 @@ void parse_cmd_args(int argc, char *argv[], string OPTSTRING, string usage_str)
 		case OPT_SOJOURN_TIME_INPUT:
 			GlobOpts::sojourn_time_file = string(optarg);
 			break;
+		case OPT_SINGLE_PASS:
+			GlobOpts::single_pass = true;
+			break;
+		case OPT_THREADS:
+			GlobOpts::threads = atoi(optarg);
+			if (GlobOpts::threads < 1) {
+				colored_printf(RED, "--threads must be at least 1, using 1\n");
+				GlobOpts::threads = 1;
+			}
+			break;
+		case OPT_STREAM_HORIZON: {
+			char *sptr = NULL;
+			uint64_t ret = strtoul(optarg, &sptr, 10);
+			if (ret == 0 || sptr == NULL || *sptr != '\0') {
+				colored_printf(RED, "--stream-horizon requires a valid number of milliseconds: '%s'\n", optarg);
+				usage(argv[0], usage_str);
+			}
+			GlobOpts::stream_horizon_ms = ret;
+			GlobOpts::single_pass = true;
+			break;
+		}
+		case OPT_EVICT_CLOSED:
+			GlobOpts::evict_closed = true;
+			GlobOpts::single_pass = true;
+			break;
+		case OPT_OUT_OF_CORE: {
+			char *sptr = NULL;
+			uint64_t ret = strtoul(optarg, &sptr, 10);
+			if (ret == 0 || ret > MAX_SPOOL_SHARDS || sptr == NULL || *sptr != '\0') {
+				colored_printf(RED, "--out-of-core requires a number of shards from 1 to %d: '%s'\n", MAX_SPOOL_SHARDS, optarg);
+				usage(argv[0], usage_str);
+			}
+			GlobOpts::out_of_core_shards = ret;
+			break;
+		}
+		case OPT_RECV_JOIN:
+			GlobOpts::recv_join = true;
+			break;
 		case 'e':
 			GlobOpts::connDetails = true;
 			break;
@@ -493,6 +554,53 @@ void parse_cmd_args(int argc, char *argv[], string OPTSTRING, string usage_str)
 		usage(argv[0], usage_str);
 	}
 
+	if (GlobOpts::recv_join && !GlobOpts::withRecv) {
+		printf("Option --recv-join requires option --receiver-dump\n");
+		usage(argv[0], usage_str);
+	}
+
+	if (GlobOpts::stream_horizon_ms) {
+		// The retired ranges are gone when these are produced
+		if (GlobOpts::withRecv || !GlobOpts::sojourn_time_file.empty()) {
+			printf("Option --stream-horizon cannot be combined with --receiver-dump or --sojourn-time-input\n");
+			usage(argv[0], usage_str);
+		}
+		if (GlobOpts::analyse_start || GlobOpts::analyse_end || GlobOpts::analyse_duration ||
+			GlobOpts::genAckLatencyFiles || GlobOpts::print_packets) {
+			printf("Option --stream-horizon cannot be combined with --analyse-*, --latency-values or --packet-details\n");
+			usage(argv[0], usage_str);
+		}
+	}
+
+	if (GlobOpts::evict_closed) {
+		// The evicted connections are gone when these are produced
+		if (GlobOpts::withRecv || !GlobOpts::sojourn_time_file.empty()) {
+			printf("Option --evict-closed cannot be combined with --receiver-dump or --sojourn-time-input\n");
+			usage(argv[0], usage_str);
+		}
+		if (GlobOpts::analyse_start || GlobOpts::analyse_end || GlobOpts::analyse_duration ||
+			GlobOpts::genAckLatencyFiles || GlobOpts::print_packets || GlobOpts::connDetails) {
+			printf("Option --evict-closed cannot be combined with --analyse-*, --latency-values, --packet-details or --print-conns\n");
+			usage(argv[0], usage_str);
+		}
+		if (GlobOpts::threads > 1) {
+			printf("Option --evict-closed cannot be combined with --threads\n");
+			usage(argv[0], usage_str);
+		}
+	}
+
+	if (GlobOpts::out_of_core_shards) {
+		// The connections of the other shards are gone when these are produced
+		if (!GlobOpts::sojourn_time_file.empty() || GlobOpts::connDetails) {
+			printf("Option --out-of-core cannot be combined with --sojourn-time-input or --print-conns\n");
+			usage(argv[0], usage_str);
+		}
+		if (GlobOpts::threads > 1 || GlobOpts::stream_horizon_ms || GlobOpts::evict_closed) {
+			printf("Option --out-of-core cannot be combined with --threads, --stream-horizon or --evict-closed\n");
+			usage(argv[0], usage_str);
+		}
+	}
+
 	if (GlobOpts::oneway_delay_variance) {
 		printf("Option --queueuing-delay is set, setting --transport-layer\n");
 		GlobOpts::transport = true;
@@ -540,68 +648,96 @@ int main(int argc, char *argv[]) {
 
 	/* Create Dump - object */
 	Dump *senderDump = new Dump(src_ip, dst_ip, tcp_addr, src_port, dst_port, tcp_port, sendfn);
-	senderDump->analyseSender();
+	Statistics stats(*senderDump);
+
+	/* The connections are written as they are closed */
+	if (GlobOpts::evict_closed) {
+		stats.openWriters();
+		senderDump->setFinishedStats(&stats);
+	}
 
-	if (GlobOpts::withRecv) {
-		senderDump->processRecvd(recvfn);
+	if (GlobOpts::out_of_core_shards) {
+		/* The dumps are split into shards of connections on disk, and the shards analysed in turn */
+		senderDump->spoolShards(recvfn);
+		stats.openWriters();
+		senderDump->setFinishedStats(&stats);
+		senderDump->analyseShards();
 	}
+	else {
+		/* The receiver dump is read while the sender dump is analysed */
+		if (GlobOpts::withRecv) {
+			senderDump->startRecvd(recvfn);
+		}
+		senderDump->analyseSender();
 
-	if (not GlobOpts::sojourn_time_file.empty())
-		senderDump->calculateSojournTime();
+		if (GlobOpts::withRecv) {
+			senderDump->processRecvd(recvfn);
+		}
 
-	/* Traverse ranges in senderDump and compare to
-	   corresponding bytes / ranges in receiver ranges
-	   place timestamp diffs in buckets */
-	senderDump->calculateRetransAndRDBStats();
+		if (not GlobOpts::sojourn_time_file.empty())
+			senderDump->calculateSojournTime();
 
-	Statistics stats(*senderDump);
+		/* Traverse ranges in senderDump and compare to
+		   corresponding bytes / ranges in receiver ranges
+		   place timestamp diffs in buckets */
+		senderDump->calculateRetransAndRDBStats();
 
-	if (GlobOpts::withRecv && (GlobOpts::withCDF || GlobOpts::oneway_delay_variance || GlobOpts::print_packets)) {
+		if (GlobOpts::withRecv && (GlobOpts::withCDF || GlobOpts::oneway_delay_variance || GlobOpts::print_packets)) {
 
-		assert((!GlobOpts::oneway_delay_variance || (GlobOpts::oneway_delay_variance && GlobOpts::transport))
-				&& "One-way delay variance was chosen, but delay is set to application layer");
+			assert((!GlobOpts::oneway_delay_variance || (GlobOpts::oneway_delay_variance && GlobOpts::transport))
+					&& "One-way delay variance was chosen, but delay is set to application layer");
 
-		senderDump->calculateLatencyVariation();
+			senderDump->calculateLatencyVariation();
 
-		if (GlobOpts::withCDF) {
-			stats.makeByteLatencyVariationCDF();
+			if (GlobOpts::withCDF) {
+				stats.makeByteLatencyVariationCDF();
 
-			if (!GlobOpts::aggOnly) {
-				stats.writeByteLatencyVariationCDF();
-			}
-			if (GlobOpts::aggregate) {
-				stats.writeAggByteLatencyVariationCDF();
+				if (!GlobOpts::aggOnly) {
+					stats.writeByteLatencyVariationCDF();
+				}
+				if (GlobOpts::aggregate) {
+					stats.writeAggByteLatencyVariationCDF();
+				}
 			}
-		}
 
-		if (GlobOpts::oneway_delay_variance) {
-			stats.writeSentTimesAndQueueingDelayVariance();
+			if (GlobOpts::oneway_delay_variance) {
+				stats.writeSentTimesAndQueueingDelayVariance();
+			}
 		}
 	}
 
-	if (GlobOpts::genAckLatencyFiles) {
-		stats.writeAckLatency();
-	}
+	if (GlobOpts::evict_closed || GlobOpts::out_of_core_shards) {
+		stats.finishConns();
 
-	if (GlobOpts::genPerPacketStats) {
-		stats.writePerPacketStats();
+		if (GlobOpts::withRecv && GlobOpts::withCDF && GlobOpts::aggregate) {
+			stats.writeAggByteLatencyVariationCDF();
+		}
 	}
+	else {
+		if (GlobOpts::genAckLatencyFiles) {
+			stats.writeAckLatency();
+		}
 
-	if (GlobOpts::genPerSegmentStats) {
-		stats.writePerSegmentStats();
-	}
+		if (GlobOpts::genPerPacketStats) {
+			stats.writePerPacketStats();
+		}
 
-	if (GlobOpts::withThroughput) {
-		stats.writeByteCountGroupedByInterval();
-		stats.writePacketByteCountAndITT();
-	}
+		if (GlobOpts::genPerSegmentStats) {
+			stats.writePerSegmentStats();
+		}
 
-	if (GlobOpts::withLoss) {
-		stats.writeLossStats();
-	}
+		if (GlobOpts::withThroughput) {
+			stats.writeByteCountGroupedByInterval();
+			stats.writePacketByteCountAndITT();
+		}
 
-	if (GlobOpts::writeConnDetails) {
-		stats.writeConnStats();
+		if (GlobOpts::withLoss) {
+			stats.writeLossStats();
+		}
+
+		if (GlobOpts::writeConnDetails) {
+			stats.writeConnStats();
+		}
 	}
 
 	if (GlobOpts::connDetails) {
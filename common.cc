@@ -36,21 +36,23 @@ long GlobOpts::analyse_duration         = 0;
 string GlobOpts::sojourn_time_file      = "";
 bool GlobOpts::oneway_delay_variance    = false;
 bool GlobOpts::look_for_get_request     = false;
+bool GlobOpts::single_pass              = false;
+int GlobOpts::threads                   = 1;
+uint64_t GlobOpts::stream_horizon_ms     = 0;
+bool GlobOpts::evict_closed             = false;
+size_t GlobOpts::out_of_core_shards     = 0;
+bool GlobOpts::recv_join                = false;
 vector <pair<uint64_t, uint64_t> > GlobOpts::print_packets_pairs;
 bool GlobOpts::conn_key_debug           = false;
 	/* Debug warning prints */
-bool GlobOpts::print_payload_mismatch_warn = true;
-bool GlobOpts::print_timestamp_mismatch_warn = true;
-bool GlobOpts::print_missing_byterange_warn = true;
+atomic<bool> GlobOpts::print_payload_mismatch_warn(true);
+atomic<bool> GlobOpts::print_timestamp_mismatch_warn(true);
+atomic<bool> GlobOpts::print_missing_byterange_warn(true);
 
 in_addr GlobOpts::sendNatAddr;
 in_addr GlobOpts::recvNatAddr;
 
 
-bool operator==(const timeval& lhs, const timeval& rhs) {
-	return lhs.tv_sec == rhs.tv_sec && lhs.tv_usec == rhs.tv_usec;
-}
-
 void print_with_file_and_linenum(string type, string file, int linenum) {
 	cerr << type << " at file: " << file << " Line: " << linenum  << endl;
 }
@@ -27,6 +27,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <ctype.h>
 #include <deque>
@@ -66,14 +67,12 @@
 using namespace std;
 
 #include "color_print.h"
+#include "time_util.h"
 
 #define safe_div(x, y) ((y) != 0 ? ((double) (x)) / (y) : 0.0)
 
 enum sent_type {ST_NONE, ST_PKT, ST_RTR, ST_PURE_ACK, ST_RST};
 
-/* Compare two timevals */
-bool operator==(const timeval& lhs, const timeval& rhs);
-
 /* Class to keep global options */
 class GlobOpts {
 private:
@@ -113,13 +112,19 @@ public:
 	static string sojourn_time_file;
 	static bool oneway_delay_variance;
 	static bool look_for_get_request;
+	static bool single_pass;
+	static int threads;
+	static uint64_t stream_horizon_ms;
+	static bool evict_closed;
+	static size_t out_of_core_shards;
+	static bool recv_join;
 	/* Debug warning prints */
 	static int  debugLevel;
 	static bool debugSender;
 	static bool debugReceiver;
-	static bool print_payload_mismatch_warn;
-	static bool print_timestamp_mismatch_warn;
-	static bool print_missing_byterange_warn;
+	static atomic<bool> print_payload_mismatch_warn;
+	static atomic<bool> print_timestamp_mismatch_warn;
+	static atomic<bool> print_missing_byterange_warn;
 	/* Debug test variables */
 	static bool conn_key_debug;
 };
@@ -129,6 +134,26 @@ public:
 #define DEBUGL_RECEIVER(level) (GlobOpts::debugReceiver && GlobOpts::debugLevel >= level)
 
 
+/* A SACK option holds at most 4 blocks (40 bytes of options) */
+#define MAX_SACK_BLOCKS 4
+
+struct SackBlock {
+	seq64_t left;
+	seq64_t right;
+};
+
+/* The SACK blocks of one ACK, stored inline so registering an ACK does not allocate */
+struct SackBlocks {
+	uint8_t count;
+	SackBlock blocks[MAX_SACK_BLOCKS];
+
+	SackBlocks() : count(0) {}
+	size_t size() const { return count; }
+	bool full() const { return count == MAX_SACK_BLOCKS; }
+	void push_back(seq64_t left, seq64_t right) { blocks[count].left = left; blocks[count].right = right; count++; }
+	const SackBlock& operator[](size_t i) const { return blocks[i]; }
+};
+
 struct DataSeg {
 	seq64_t seq;
 	seq64_t endSeq;
@@ -141,14 +166,14 @@ struct DataSeg {
 		is_rdb : 1,         /* Is a rdb packet */
 		sacks : 1,          /* Has SACK blocks */
 		in_sequence : 1;    /* Is the segment expected or out of order */
-	timeval tstamp_pcap;
+	tstamp_t tstamp_pcap;
 	uint32_t tstamp_tcp;
 	uint32_t tstamp_tcp_echo;
-	vector< pair<seq64_t, seq64_t> > tcp_sacks;
+	SackBlocks tcp_sacks;
 	u_char flags;
 	DataSeg() : seq(0), endSeq(0), rdb_end_seq(0), seq_absolute(0), ack(0),
 		window(0), payloadSize(0), retrans(0), is_rdb(0), in_sequence(0),
-		tstamp_tcp(0), tstamp_tcp_echo(0), flags(0) {
+		tstamp_pcap(0), tstamp_tcp(0), tstamp_tcp_echo(0), flags(0) {
 	}
 //	u_char *data;
 };
@@ -401,6 +401,10 @@ void BaseStats::computePercentiles()
 		maximum.itt.add(bs.itt.max);
 	}
 
+	if (bs.sack_latency.get_counter()) {
+		aggregated.sack_latency.add_to_aggregate(bs.sack_latency);
+	}
+
 	// Add retrans stats
 	if ((ulong) bs.retrans.size() > aggregated.retrans.size()) {
 		for (ulong i = aggregated.retrans.size(); i < bs.retrans.size(); i++) {
@@ -165,7 +165,7 @@ public:
 	int16_t pifs; // Packets in flight after this packet was sent
 	PacketStats() {}
 	PacketStats(sent_type type, string connKey, int64_t time, uint32_t s)
-		: s_type(type), stream_id(connKey), send_time_us(time), size(s), itt_usec(0), pifs(0)
+		: s_type(type), stream_id(connKey), send_time_us(time), size(s), itt_usec(0), ack_latency_usec(0), pifs(0)
 	{}
 	static void writeHeader(csv::ofstream& stream);
 
@@ -198,11 +198,13 @@ public:
 	vector<SegmentStats> packet_stats;
 	vector<int> retrans;
 	vector<int> dupacks;
+	BaseStats sack_latency;            // Latency until the ranges SACKed were SACKed in full
 
 	void init() {
 		packet_stats.clear();
 		retrans.clear();
 		dupacks.clear();
+		sack_latency.init();
 		StreamStats::init();
 	}
 
@@ -214,7 +216,7 @@ public:
 		return latency.get_counter() > 0;
 	}
 
-	PacketsStats(bool _is_aggregate = false) : StreamStats(_is_aggregate) {}
+	PacketsStats(bool _is_aggregate = false) : StreamStats(_is_aggregate), sack_latency(_is_aggregate) {}
 };
 
 
@@ -251,11 +253,11 @@ public:
  *****************************************/
 
 struct PacketSize {
-	timeval time;
+	tstamp_t time;
 	uint16_t packet_size;
 	uint16_t payload_size;
 	bool retrans;
-	PacketSize(timeval t, uint16_t ps, uint16_t pls, bool _retrans) :
+	PacketSize(tstamp_t t, uint16_t ps, uint16_t pls, bool _retrans) :
 		time(t),
 		packet_size(ps),
 		payload_size(pls),
@@ -1,11 +1,473 @@
 #include <cxxtest/TestSuite.h>
+#include <new>
 #include "../Connection.h"
+#include "../RangeManager.h"
+#include "../Dump.h"
+#include "../PcapReader.h"
+#include "../ByteRange.h"
+#include "../SmallVector.h"
+#include "../ConnectionTable.h"
+#include "../SackScoreboard.h"
 
 #define UINT_MAX (std::numeric_limits<ulong>::max())
 
+/* Packets sent (and acked) by testAllocationsPerPacket */
+#define ALLOC_TEST_PACKETS 100000
+/*
+  Most heap allocations allowed per million in-order data packets and their ACKs.
+  A range sent once keeps its history inline, so only the chunks of the ranges
+  map and the slabs of the range arena are allocated. That is 15700, so this
+  fails on any new allocation per packet.
+ */
+#define MAX_ALLOCS_PER_MILLION_PACKETS 17000
+
+/* Heap allocations made since the test binary started */
+static size_t allocation_count = 0;
+
+void* operator new(size_t size) {
+	allocation_count++;
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
 class TestSuite : public CxxTest::TestSuite
 {
 public:
+	/* Sends in-order data through a connection with an ACK for each packet, and counts the allocations */
+	void testAllocationsPerPacket(void) {
+		uint16_t src_port = htons(2000), dst_port = htons(80);
+		in_addr src_ip, dst_ip;
+		inet_pton(AF_INET, "192.0.2.33", &src_ip);
+		inet_pton(AF_INET, "192.0.2.34", &dst_ip);
+		seq32_t first_seq = 1000;
+		Connection *conn = new Connection(src_ip, &src_port, dst_ip, &dst_port, first_seq);
+
+		sendData sd;
+		sd.ipHdrLen = 20;
+		sd.tcpHdrLen = 32;
+		sd.tcpOptionLen = 12;
+		sd.data.payloadSize = 100;
+		sd.totalSize = sd.ipHdrLen + sd.tcpHdrLen + sd.data.payloadSize;
+		sd.ipSize = sd.totalSize;
+
+		// SYN
+		sd.data.seq_absolute = first_seq;
+		sd.data.seq = conn->getRelativeSequenceNumber(first_seq, RELSEQ_SEND_OUT);
+		sd.data.endSeq = sd.data.seq;
+		sd.data.payloadSize = 0;
+		sd.data.flags = TH_SYN;
+		sd.data.tstamp_pcap = 0;
+		if (conn->registerSent(&sd))
+			conn->registerRange(&sd);
+		sd.data.payloadSize = 100;
+
+		DataSeg ack;
+		size_t allocs = 0;
+		for (int i = 0; i < ALLOC_TEST_PACKETS; i++) {
+			sd.data.seq_absolute = first_seq + 1 + i * sd.data.payloadSize;
+			sd.data.seq = conn->getRelativeSequenceNumber(sd.data.seq_absolute, RELSEQ_SEND_OUT);
+			sd.data.endSeq = sd.data.seq + sd.data.payloadSize;
+			sd.data.retrans = sd.data.is_rdb = false;
+			sd.data.flags = TH_ACK | TH_PUSH;
+			sd.data.tstamp_pcap = i * NSEC_PER_MSEC;
+			sd.data.tstamp_tcp = i;
+
+			ack.ack = conn->getRelativeSequenceNumber(sd.data.seq_absolute + sd.data.payloadSize, RELSEQ_SEND_ACK);
+			ack.tstamp_pcap = sd.data.tstamp_pcap + 500 * NSEC_PER_USEC;
+			ack.flags = TH_ACK;
+			ack.tstamp_tcp_echo = i;
+
+			// The first packets set up the connection, count the steady state
+			if (i == ALLOC_TEST_PACKETS / 10)
+				allocs = allocation_count;
+			if (conn->registerSent(&sd))
+				conn->registerRange(&sd);
+			conn->registerAck(&ack);
+		}
+		allocs = allocation_count - allocs;
+
+		size_t per_million = allocs * 1000000 / (ALLOC_TEST_PACKETS - ALLOC_TEST_PACKETS / 10);
+		printf("\nAllocations per million packets: %zu\n", per_million);
+		TS_ASSERT_LESS_THAN_EQUALS(per_million, (size_t) MAX_ALLOCS_PER_MILLION_PACKETS);
+		delete conn;
+	}
+
+	/* Parses a SACK option with three blocks, each of which must be read at its own offset */
+	void testSackOptionBlocks(void) {
+		uint16_t src_port = htons(2000), dst_port = htons(80);
+		in_addr src_ip, dst_ip;
+		inet_pton(AF_INET, "192.0.2.33", &src_ip);
+		inet_pton(AF_INET, "192.0.2.34", &dst_ip);
+		seq32_t first_seq = 1000;
+		Connection *conn = new Connection(src_ip, &src_port, dst_ip, &dst_port, first_seq);
+		Dump dump("", "", "", "", "", "", "");
+
+		const uint32_t edges[6] = { 2000, 3000, 4000, 5000, 6000, 7000 };
+		uint8_t opts[28] = { 1, 1, 5, 2 + 3 * 8 };
+		for (int i = 0; i < 6; i++) {
+			uint32_t edge = htonl(first_seq + edges[i]);
+			memcpy(opts + 4 + 4 * i, &edge, sizeof(edge));
+		}
+
+		DataSeg seg;
+		dump.parseTCPOptions(&seg, opts, sizeof(opts), conn, RELSEQ_SEND_ACK);
+		TS_ASSERT(seg.sacks);
+		TS_ASSERT_EQUALS(seg.tcp_sacks.size(), (size_t) 3);
+		for (size_t i = 0; i < seg.tcp_sacks.size(); i++) {
+			TS_ASSERT_EQUALS(seg.tcp_sacks[i].left, (seq64_t) edges[2 * i]);
+			TS_ASSERT_EQUALS(seg.tcp_sacks[i].right, (seq64_t) edges[2 * i + 1]);
+		}
+		delete conn;
+	}
+
+	/* Inserts into a full chunk, which is split, and checks that an iterator taken before finds its range again */
+	void testRangeMapChunkSplit(void) {
+		RangeMap map;
+		for (seq64_t i = 0; i < RANGE_CHUNK_SIZE; i++)
+			map.append(RangeMap::value_type(i * 10, (ByteRange*) (uintptr_t) (i + 1)));
+
+		RangeMap::iterator it = map.find(300);
+		TS_ASSERT(map.insert(RangeMap::value_type(5, (ByteRange*) 1000)).second);
+		TS_ASSERT(map.insert(RangeMap::value_type(615, (ByteRange*) 1001)).second);
+		TS_ASSERT(!map.insert(RangeMap::value_type(310, (ByteRange*) 1002)).second);
+		TS_ASSERT_EQUALS(map.size(), (size_t) RANGE_CHUNK_SIZE + 2);
+
+		// The ranges after the split point moved to a new chunk
+		TS_ASSERT_EQUALS(it->first, (seq64_t) 300);
+		TS_ASSERT_EQUALS(it->second, (ByteRange*) 31);
+		++it;
+		TS_ASSERT_EQUALS(it->first, (seq64_t) 310);
+		TS_ASSERT_EQUALS(it->second, (ByteRange*) 32);
+
+		seq64_t prev = 0;
+		size_t count = 0;
+		for (RangeMap::iterator i = map.begin(); i != map.end(); i++, count++) {
+			TS_ASSERT(count == 0 || i->first > prev);
+			prev = i->first;
+		}
+		TS_ASSERT_EQUALS(count, map.size());
+		TS_ASSERT_EQUALS(map.find(5)->second, (ByteRange*) 1000);
+		TS_ASSERT_EQUALS(map.lower_bound(6)->first, (seq64_t) 10);
+		TS_ASSERT_EQUALS(map.upper_bound(610)->first, (seq64_t) 615);
+		TS_ASSERT(map.find(7) == map.end());
+		TS_ASSERT_EQUALS((--map.end())->first, (seq64_t) (RANGE_CHUNK_SIZE - 1) * 10);
+	}
+
+	/* Removes ranges from the front, across chunks, and checks the iterators to the ranges left */
+	void testRangeMapPopFront(void) {
+		RangeMap map;
+		for (seq64_t i = 0; i < 3 * RANGE_CHUNK_SIZE; i++)
+			map.append(RangeMap::value_type(i * 10, (ByteRange*) (uintptr_t) (i + 1)));
+
+		RangeMap::iterator it = map.find(1500);
+		map.pop_front(RANGE_CHUNK_SIZE + 10);
+		TS_ASSERT_EQUALS(map.size(), (size_t) 2 * RANGE_CHUNK_SIZE - 10);
+		TS_ASSERT_EQUALS(map.begin()->first, (seq64_t) (RANGE_CHUNK_SIZE + 10) * 10);
+		TS_ASSERT_EQUALS(it->first, (seq64_t) 1500);
+		TS_ASSERT_EQUALS(it->second, (ByteRange*) 151);
+		TS_ASSERT(map.find(0) == map.end());
+
+		// Inserting before the first range left
+		TS_ASSERT(map.insert(RangeMap::value_type(5, (ByteRange*) 1000)).second);
+		TS_ASSERT_EQUALS(map.begin()->first, (seq64_t) 5);
+		TS_ASSERT_EQUALS(it->second, (ByteRange*) 151);
+
+		map.pop_front(map.size());
+		TS_ASSERT(map.empty());
+		TS_ASSERT(map.begin() == map.end());
+	}
+
+	/* Changes a copy sharing the heap storage of a vector, which must be left as it was */
+	void testSmallVectorCopyOnWrite(void) {
+		SmallVector<int, 2> a;
+		for (int i = 0; i < 5; i++)
+			a.push_back(i);
+
+		SmallVector<int, 2> b = a;
+		TS_ASSERT(a.shared());
+		b.push_back(5);
+		TS_ASSERT(!a.shared());
+		TS_ASSERT_EQUALS(a.size(), (size_t) 5);
+		TS_ASSERT_EQUALS(b.size(), (size_t) 6);
+
+		SmallVector<int, 2> c = a;
+		c.set(0, 42);
+		TS_ASSERT_EQUALS(a[0], 0);
+		TS_ASSERT_EQUALS(c[0], 42);
+
+		SmallVector<int, 2> d = a;
+		d.erase(d.begin());
+		TS_ASSERT_EQUALS(a.size(), (size_t) 5);
+		TS_ASSERT_EQUALS(d.size(), (size_t) 4);
+		TS_ASSERT_EQUALS(d[0], 1);
+		for (int i = 0; i < 5; i++)
+			TS_ASSERT_EQUALS(a[i], i);
+
+		// Pushing an element of the vector itself while it grows
+		SmallVector<int, 2> e;
+		e.push_back(7);
+		e.push_back(8);
+		e.push_back(e[0]);
+		TS_ASSERT_EQUALS(e[2], 7);
+	}
+
+	/* Erases connections from a chain of colliding slots, which wraps around the end of the table */
+	void testConnectionTableErase(void) {
+		ConnectionTable table;
+		in_addr src_ip, dst_ip;
+		inet_pton(AF_INET, "192.0.2.33", &src_ip);
+		inet_pton(AF_INET, "192.0.2.34", &dst_ip);
+		const size_t mask = 63;    // The table starts with 64 slots
+
+		// Five ports with home slot 62, three with 63 and three with 0
+		vector<uint16_t> ports;
+		const size_t homes[3] = { 62, 63, 0 };
+		const size_t wanted[3] = { 5, 3, 3 };
+		for (int h = 0; h < 3; h++) {
+			size_t found = 0;
+			for (uint32_t port = 1; found < wanted[h]; port++) {
+				if ((ConnectionTable::hash(src_ip, dst_ip, (uint16_t) port, 80) & mask) == homes[h]) {
+					ports.push_back((uint16_t) port);
+					found++;
+				}
+			}
+		}
+
+		vector<bool> erased(ports.size(), false);
+		for (size_t i = 0; i < ports.size(); i++)
+			table.insert(src_ip, dst_ip, ports[i], 80, (Connection*) (uintptr_t) (i + 1));
+
+		const size_t order[] = { 0, 6, 2, 9, 5, 10, 1, 3, 4, 7, 8 };
+		for (size_t k = 0; k < ports.size(); k++) {
+			size_t e = order[k];
+			TS_ASSERT_EQUALS(table.erase(src_ip, dst_ip, ports[e], 80), (Connection*) (uintptr_t) (e + 1));
+			erased[e] = true;
+			TS_ASSERT_EQUALS(table.size(), ports.size() - k - 1);
+
+			for (size_t i = 0; i < ports.size(); i++) {
+				Connection *expected = erased[i] ? NULL : (Connection*) (uintptr_t) (i + 1);
+				TS_ASSERT_EQUALS(table.find(src_ip, dst_ip, ports[i], 80), expected);
+				TS_ASSERT_EQUALS(table.findReverse(dst_ip, src_ip, 80, ports[i]), expected);
+			}
+		}
+		TS_ASSERT(table.erase(src_ip, dst_ip, ports[0], 80) == NULL);
+	}
+
+	/* Adding a block returns the parts not SACKed before, and the cumulative ACK drops what it covers */
+	void testSackScoreboard(void) {
+		SackScoreboard sb;
+		vector<SackBlock> added;
+
+		added = sb.add(100, 200);
+		TS_ASSERT_EQUALS(added.size(), (size_t) 1);
+		TS_ASSERT(added[0].left == 100 && added[0].right == 200);
+
+		added = sb.add(150, 250);
+		TS_ASSERT_EQUALS(added.size(), (size_t) 1);
+		TS_ASSERT(added[0].left == 200 && added[0].right == 250);
+
+		sb.add(300, 400);
+		TS_ASSERT_EQUALS(sb.size(), (size_t) 2);
+		TS_ASSERT(!sb.covers(240, 310));
+
+		// Spans both intervals, the holes and the ends are new
+		added = sb.add(50, 450);
+		TS_ASSERT_EQUALS(added.size(), (size_t) 3);
+		TS_ASSERT(added[0].left == 50 && added[0].right == 100);
+		TS_ASSERT(added[1].left == 250 && added[1].right == 300);
+		TS_ASSERT(added[2].left == 400 && added[2].right == 450);
+		TS_ASSERT_EQUALS(sb.size(), (size_t) 1);
+		TS_ASSERT(sb.covers(50, 450));
+
+		TS_ASSERT(sb.add(100, 200).empty());
+		TS_ASSERT(sb.add(10, 10).empty());
+
+		sb.add(500, 600);
+		TS_ASSERT(!sb.covers(400, 550));
+
+		sb.ack(120);
+		TS_ASSERT(!sb.covers(100, 130));
+		TS_ASSERT(sb.covers(120, 450));
+
+		sb.ack(550);
+		TS_ASSERT_EQUALS(sb.size(), (size_t) 1);
+		TS_ASSERT(!sb.covers(500, 600));
+		TS_ASSERT(sb.covers(550, 600));
+
+		sb.ack(600);
+		TS_ASSERT(sb.empty());
+	}
+
+	/*
+	  Writes a dump where every payload holds a chain of plausible record
+	  headers, so the chunks parsed in parallel start at false record
+	  boundaries. The records read must be the same as without threads.
+	 */
+	void testPcapReaderChunkResync(void) {
+		char fn[] = "/tmp/analyseTCP-test-XXXXXX";
+		int fd = mkstemp(fn);
+		TS_ASSERT(fd >= 0);
+		FILE *f = fdopen(fd, "wb");
+
+		uint32_t file_hdr[6] = { 0xa1b2c3d4, 2 | (4 << 16), 0, 0, 65535, 1 };
+		fwrite(file_hdr, sizeof(file_hdr), 1, f);
+
+		const uint32_t first_sec = 1500000000;
+		const uint32_t records = 20000;
+		for (uint32_t i = 0; i < records; i++) {
+			vector<u_char> payload(sizeof(i));
+			memcpy(payload.data(), &i, sizeof(i));
+			for (uint32_t k = 0; k < 10 + i % 7; k++) {
+				uint32_t fake[4] = { first_sec, 0, 1, 1 };
+				payload.insert(payload.end(), (u_char*) fake, (u_char*) (fake + 4));
+				payload.push_back(0xff);
+			}
+			uint32_t rec_hdr[4] = { first_sec + i / 1000, (i % 1000) * 1000, (uint32_t) payload.size(), (uint32_t) payload.size() };
+			fwrite(rec_hdr, sizeof(rec_hdr), 1, f);
+			fwrite(payload.data(), payload.size(), 1, f);
+		}
+		fclose(f);
+
+		vector<pair<uint32_t, uint32_t> > read[2];
+		int threads = GlobOpts::threads;
+		for (int t = 0; t < 2; t++) {
+			GlobOpts::threads = t ? 4 : 1;
+			PcapReader reader(fn);
+			pcap_pkthdr header;
+			const u_char *data;
+			while ((data = reader.next(&header)) != NULL) {
+				uint32_t id;
+				memcpy(&id, data, sizeof(id));
+				read[t].push_back(make_pair(id, header.caplen));
+			}
+		}
+		GlobOpts::threads = threads;
+		unlink(fn);
+
+		TS_ASSERT_EQUALS(read[0].size(), (size_t) records);
+		TS_ASSERT(read[0] == read[1]);
+	}
+
+	/* Sends count segments of size bytes on the connection */
+	void sendSegments(Connection *conn, seq32_t first_seq, int count, uint16_t size) {
+		sendData sd;
+		sd.ipHdrLen = 20;
+		sd.tcpHdrLen = 20;
+		sd.tcpOptionLen = 0;
+		sd.data.tstamp_tcp = 0;
+		sd.data.window = 1000;
+		for (int i = -1; i < count; i++) {
+			// The SYN first
+			sd.data.payloadSize = i < 0 ? 0 : size;
+			sd.data.seq_absolute = i < 0 ? first_seq : first_seq + 1 + i * size;
+			sd.data.seq = conn->getRelativeSequenceNumber(sd.data.seq_absolute, RELSEQ_SEND_OUT);
+			sd.data.endSeq = sd.data.seq + sd.data.payloadSize;
+			sd.data.retrans = sd.data.is_rdb = false;
+			sd.data.flags = i < 0 ? TH_SYN : TH_ACK | TH_PUSH;
+			sd.data.tstamp_pcap = (i + 1) * NSEC_PER_MSEC;
+			sd.totalSize = sd.ipSize = sd.ipHdrLen + sd.tcpHdrLen + sd.data.payloadSize;
+			if (conn->registerSent(&sd))
+				conn->registerRange(&sd);
+		}
+	}
+
+	/* Registers the received segments, given as [start, end) relative to the first data byte, in capture order */
+	void receiveSegments(Connection *conn, seq32_t first_seq, const vector<pair<uint32_t, uint32_t> > &segs) {
+		for (size_t i = 0; i < segs.size(); i++) {
+			sendData sd;
+			sd.ipHdrLen = 20;
+			sd.tcpHdrLen = 20;
+			sd.tcpOptionLen = 0;
+			sd.data.payloadSize = (uint16_t) (segs[i].second - segs[i].first);
+			sd.data.seq_absolute = first_seq + 1 + segs[i].first;
+			sd.data.seq = conn->getRelativeSequenceNumber(sd.data.seq_absolute, RELSEQ_RECV_INN);
+			sd.data.endSeq = sd.data.seq + sd.data.payloadSize;
+			sd.data.tstamp_pcap = (tstamp_t) (100 + i) * NSEC_PER_MSEC;
+			sd.data.tstamp_tcp = (uint32_t) (100 + i);
+			sd.data.flags = TH_ACK;
+			sd.data.window = 1000;
+			sd.data.retrans = sd.data.is_rdb = false;
+			sd.data.in_sequence = 0;
+			sd.totalSize = sd.ipSize = sd.ipHdrLen + sd.tcpHdrLen + sd.data.payloadSize;
+			conn->registerRecvd(&sd);
+		}
+	}
+
+	/* Receives the segments with and without --recv-join, and compares the ranges */
+	void checkRecvJoin(const vector<pair<uint32_t, uint32_t> > &segs, ullint_t joined) {
+		uint16_t src_port = htons(2000), dst_port = htons(80);
+		in_addr src_ip, dst_ip;
+		inet_pton(AF_INET, "192.0.2.33", &src_ip);
+		inet_pton(AF_INET, "192.0.2.34", &dst_ip);
+		seq32_t first_seq = 1000;
+		Connection *conns[2];
+		bool recv_join = GlobOpts::recv_join, with_recv = GlobOpts::withRecv;
+
+		// The ranges only keep what was received with a receiver dump
+		GlobOpts::withRecv = true;
+		for (int j = 0; j < 2; j++) {
+			conns[j] = new Connection(src_ip, &src_port, dst_ip, &dst_port, first_seq);
+			sendSegments(conns[j], first_seq, 20, 100);
+			GlobOpts::recv_join = j == 1;
+			receiveSegments(conns[j], first_seq, segs);
+			conns[j]->rm->joinReceivedRanges();
+		}
+		GlobOpts::recv_join = recv_join;
+		GlobOpts::withRecv = with_recv;
+
+		RangeManager *rm = conns[1]->rm;
+		TS_ASSERT_EQUALS(rm->recv_joined_count, joined);
+		TS_ASSERT_EQUALS(conns[0]->rm->ranges.size(), rm->ranges.size());
+
+		RangeMap::iterator a = conns[0]->rm->ranges.begin(), b = rm->ranges.begin();
+		for (; a != conns[0]->rm->ranges.end() && b != rm->ranges.end(); a++, b++) {
+			TS_ASSERT_EQUALS(a->second->startSeq, b->second->startSeq);
+			TS_ASSERT_EQUALS(a->second->endSeq, b->second->endSeq);
+			TS_ASSERT_EQUALS(a->second->packet_received_count, b->second->packet_received_count);
+			TS_ASSERT_EQUALS(a->second->data_received_count, b->second->data_received_count);
+			TS_ASSERT_EQUALS(a->second->recv == NULL, b->second->recv == NULL);
+			if (a->second->recv != NULL && b->second->recv != NULL) {
+				TS_ASSERT_EQUALS(a->second->recv->received_tstamp_pcap, b->second->recv->received_tstamp_pcap);
+				TS_ASSERT_EQUALS(a->second->recv->received_tstamp_tcp, b->second->recv->received_tstamp_tcp);
+				TS_ASSERT_EQUALS(a->second->recv->sent_tstamps_tcp.size(), b->second->recv->sent_tstamps_tcp.size());
+			}
+		}
+		delete conns[0];
+		delete conns[1];
+	}
+
+	/* Segments joined in sequence order by joinReceivedRanges() must give the ranges of capture order */
+	void testRecvJoinMatchesCaptureOrder(void) {
+		vector<pair<uint32_t, uint32_t> > segs;
+
+		// Reordered
+		const uint32_t reordered[][2] = { {0, 100}, {200, 300}, {500, 700}, {100, 150}, {300, 400}, {800, 900}, {1000, 1100}, {700, 750} };
+		for (size_t i = 0; i < sizeof(reordered) / sizeof(reordered[0]); i++)
+			segs.push_back(make_pair(reordered[i][0], reordered[i][1]));
+		checkRecvJoin(segs, segs.size());
+
+		// Segments bundling data with the one received before them
+		const uint32_t overlapping[][2] = { {0, 100}, {200, 300}, {100, 300}, {400, 500}, {300, 500}, {600, 700} };
+		segs.clear();
+		for (size_t i = 0; i < sizeof(overlapping) / sizeof(overlapping[0]); i++)
+			segs.push_back(make_pair(overlapping[i][0], overlapping[i][1]));
+		checkRecvJoin(segs, segs.size());
+
+		// Segments starting and ending inside the ranges, and past the last one
+		const uint32_t resegmented[][2] = { {250, 420}, {150, 260}, {1000, 1100}, {0, 160}, {410, 500}, {230, 240},
+											{100, 900}, {50, 60}, {250, 420}, {1950, 2100}, {2100, 2200} };
+		segs.clear();
+		for (size_t i = 0; i < sizeof(resegmented) / sizeof(resegmented[0]); i++)
+			segs.push_back(make_pair(resegmented[i][0], resegmented[i][1]));
+		checkRecvJoin(segs, segs.size() - 1);
+	}
+
 	void testAddition(void) {
 		uint16_t port = 2000;
 		in_addr src_ip;
@@ -5,6 +5,7 @@
 #endif
 
 #define _CXXTEST_HAVE_STD
+#define _CXXTEST_HAVE_EH
 #include <cxxtest/TestListener.h>
 #include <cxxtest/TestTracker.h>
 #include <cxxtest/TestRunner.h>
@@ -25,11 +26,65 @@ bool suite_TestSuite_init = false;
 static TestSuite suite_TestSuite;
 
 static CxxTest::List Tests_TestSuite = { 0, 0 };
-CxxTest::StaticSuiteDescription suiteDescription_TestSuite( "TestAnalyseTCP.h", 6, "TestSuite", suite_TestSuite, Tests_TestSuite );
+CxxTest::StaticSuiteDescription suiteDescription_TestSuite( "TestAnalyseTCP.h", 39, "TestSuite", suite_TestSuite, Tests_TestSuite );
+
+static class TestDescription_suite_TestSuite_testAllocationsPerPacket : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testAllocationsPerPacket() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 43, "testAllocationsPerPacket" ) {}
+ void runTest() { suite_TestSuite.testAllocationsPerPacket(); }
+} testDescription_suite_TestSuite_testAllocationsPerPacket;
+
+static class TestDescription_suite_TestSuite_testSackOptionBlocks : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testSackOptionBlocks() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 102, "testSackOptionBlocks" ) {}
+ void runTest() { suite_TestSuite.testSackOptionBlocks(); }
+} testDescription_suite_TestSuite_testSackOptionBlocks;
+
+static class TestDescription_suite_TestSuite_testRangeMapChunkSplit : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testRangeMapChunkSplit() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 130, "testRangeMapChunkSplit" ) {}
+ void runTest() { suite_TestSuite.testRangeMapChunkSplit(); }
+} testDescription_suite_TestSuite_testRangeMapChunkSplit;
+
+static class TestDescription_suite_TestSuite_testRangeMapPopFront : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testRangeMapPopFront() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 163, "testRangeMapPopFront" ) {}
+ void runTest() { suite_TestSuite.testRangeMapPopFront(); }
+} testDescription_suite_TestSuite_testRangeMapPopFront;
+
+static class TestDescription_suite_TestSuite_testSmallVectorCopyOnWrite : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testSmallVectorCopyOnWrite() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 187, "testSmallVectorCopyOnWrite" ) {}
+ void runTest() { suite_TestSuite.testSmallVectorCopyOnWrite(); }
+} testDescription_suite_TestSuite_testSmallVectorCopyOnWrite;
+
+static class TestDescription_suite_TestSuite_testConnectionTableErase : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testConnectionTableErase() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 221, "testConnectionTableErase" ) {}
+ void runTest() { suite_TestSuite.testConnectionTableErase(); }
+} testDescription_suite_TestSuite_testConnectionTableErase;
+
+static class TestDescription_suite_TestSuite_testSackScoreboard : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testSackScoreboard() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 263, "testSackScoreboard" ) {}
+ void runTest() { suite_TestSuite.testSackScoreboard(); }
+} testDescription_suite_TestSuite_testSackScoreboard;
+
+static class TestDescription_suite_TestSuite_testPcapReaderChunkResync : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testPcapReaderChunkResync() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 312, "testPcapReaderChunkResync" ) {}
+ void runTest() { suite_TestSuite.testPcapReaderChunkResync(); }
+} testDescription_suite_TestSuite_testPcapReaderChunkResync;
+
+static class TestDescription_suite_TestSuite_testRecvJoinMatchesCaptureOrder : public CxxTest::RealTestDescription {
+public:
+ TestDescription_suite_TestSuite_testRecvJoinMatchesCaptureOrder() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 446, "testRecvJoinMatchesCaptureOrder" ) {}
+ void runTest() { suite_TestSuite.testRecvJoinMatchesCaptureOrder(); }
+} testDescription_suite_TestSuite_testRecvJoinMatchesCaptureOrder;
 
 static class TestDescription_suite_TestSuite_testAddition : public CxxTest::RealTestDescription {
 public:
- TestDescription_suite_TestSuite_testAddition() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 9, "testAddition" ) {}
+ TestDescription_suite_TestSuite_testAddition() : CxxTest::RealTestDescription( Tests_TestSuite, suiteDescription_TestSuite, 471, "testAddition" ) {}
  void runTest() { suite_TestSuite.testAddition(); }
 } testDescription_suite_TestSuite_testAddition;
 
@@ -66,6 +66,14 @@ long get_usecs(struct timeval *tv) {
 	return tv->tv_sec * 1000000 + tv->tv_usec;
 }
 
+/* For printing timestamps with the sprint_time functions */
+struct timeval tstamp_to_timeval(tstamp_t ts) {
+	struct timeval tv;
+	tv.tv_sec = (time_t) (ts / NSEC_PER_SEC);
+	tv.tv_usec = (suseconds_t) ((ts % NSEC_PER_SEC) / NSEC_PER_USEC);
+	return tv;
+}
+
 void timevalfix(struct timeval *tv) {
 	if (tv->tv_usec < 0) {
 		tv->tv_sec--;
@@ -2,6 +2,7 @@
 #define TIME_UTIL_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
@@ -10,6 +11,19 @@
 #define TV_TO_MS(tv) ((int64_t)((tv).tv_sec * 1000L + ((tv).tv_usec / 1000L)))
 #define TV_TO_MICSEC(tv) ((int64_t)((tv).tv_sec * 1000000L + ((tv).tv_usec)))
 
+/* Timestamps of packets, in nanoseconds since the epoch. 0 is unset */
+typedef int64_t tstamp_t;
+
+#define NSEC_PER_USEC 1000LL
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC  1000000000LL
+
+/* Convert a timestamp, or the difference between two, to seconds, milliseconds or microseconds.
+   Negative differences are rounded towards zero. */
+#define TS_TO_SEC(ts) ((ts) / NSEC_PER_SEC)
+#define TS_TO_MS(ts) ((ts) / NSEC_PER_MSEC)
+#define TS_TO_US(ts) ((ts) / NSEC_PER_USEC)
+
 typedef enum {SEC_PREC, MSEC_PREC, USEC_PREC} TIME_PREC;
 
 #ifdef __cplusplus
@@ -26,6 +40,7 @@ struct timeval sprint_readable_time_diff(char *buf, struct timeval oldest, struc
 struct timeval sprint_readable_time_now_diff(char *buf, struct timeval old_time);
 long get_msecs(struct timeval *tv);
 long get_usecs(struct timeval *tv);
+struct timeval tstamp_to_timeval(tstamp_t ts);
 
 void timevalfix(struct timeval *tv);
 void timevaladd(struct timeval *to, struct timeval *val);
@@ -37,6 +52,7 @@ void timevalsub(struct timeval *to, struct timeval *val);
 
 
 #define tval_pair(tval) tval.tv_sec, tval.tv_usec
+#define tstamp_pair(ts) (ulong) TS_TO_SEC(ts), (ulong) TS_TO_US((ts) % NSEC_PER_SEC)
 
 #define timespecsub(tvp, uvp, vvp)							\
 	do {													\
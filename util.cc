@@ -34,6 +34,7 @@ string ipToStr(const in_addr &ip) {
 
 in_addr strToIp(const string &ip) {
 	in_addr addr;
+	addr.s_addr = INADDR_ANY;
 	inet_pton(AF_INET, ip.c_str(), &addr);
 	return addr;
 }